@@ -1,90 +1,240 @@
 #include "command.h"
+#include "work_item.h"
 
 
 Command::Command() {
     _command_id = 0;
     _cmd_func_ptr = nullptr;
-    _help_text.clear();
+    _typed_func_ptr = nullptr;
+    _invoker = nullptr;
+    _name = nullptr;
+    _help_text = "";
 }
 
-Command::Command(uint16_t command_id, void (*cmd_func_ptr)(CommandArgs args), etl::string<64> help_text) {
+Command::Command(uint16_t command_id, const char * name, command_function_t cmd_func_ptr, const char * help_text) {
     _cmd_func_ptr = cmd_func_ptr;
+    _typed_func_ptr = nullptr;
+    _invoker = nullptr;
     _command_id = command_id;
-    _help_text.assign(help_text);
+    _name = name;
+    _help_text = help_text;
 }
 
-uint16_t Command::get_cmd_id() {
+Command::Command(uint16_t command_id, const char * name, generic_function_t typed_func_ptr, command_invoker_t invoker, const char * help_text) {
+    _cmd_func_ptr = nullptr;
+    _typed_func_ptr = typed_func_ptr;
+    _invoker = invoker;
+    _command_id = command_id;
+    _name = name;
+    _help_text = help_text;
+}
+
+uint16_t Command::get_cmd_id() const {
     return(_command_id);
 }
 
-void Command::run(CommandArgs args) {
+const char * Command::get_name() const {
+    return(_name);
+}
+
+bool Command::run(const CommandArgs & args) {
+    if (_invoker != nullptr) {
+        return(_invoker(_typed_func_ptr, args));
+    }
     _cmd_func_ptr(args);
+    return(true);
 }
 
-etl::string_view Command::help() {
+const char * Command::help() {
     return _help_text;
 }
 
-CommandParser::CommandParser() {
-    _partial_cmd_from_serial.clear();
+CommandParser::CommandParser() : _serial(Serial) {
+    _next_job_id = 1;
+    _next_job_index = 0;
+    _job_started = false;
+    _in_batch = false;
+    _last_tick_ms = 0;
 }
 
-void CommandParser::parse(ETLSTR cmd_string) {
+cmd_status CommandParser::parse(etl::string_view cmd_string, Connection * reply_connection) {
     // remove whitespace from end of line
     // Iterate from the end and check if the character is in the set of characters to remove
-    while (!cmd_string.empty() && 
+    while (!cmd_string.empty() &&
         (cmd_string.back() == '\n' || cmd_string.back() == '\r' || cmd_string.back() == ' '))
     {
-        cmd_string.pop_back(); // Remove the last character
+        cmd_string.remove_suffix(1); // Remove the last character
     }
 
-    // log_info("Recevied: %s", cmd_string.c_str() );
+    // "@<correlation>:<command>" replies on <topic>/response, see begin_response()
+    if ( !cmd_string.empty() && cmd_string.front() == '@' ) {
+        size_t colon_pos = cmd_string.find(':');
+        if ( colon_pos == etl::string_view::npos || colon_pos < 2 || colon_pos > RESPONSE_CORRELATION_LENGTH + 1 ) {
+            log_error("Bad correlation ID in: %.*s", (int)cmd_string.size(), cmd_string.data());
+            return(cmd_status::ERROR);
+        }
+        Connection * connection = (reply_connection != nullptr) ? reply_connection : get_log_connection();
+        begin_response(connection, cmd_string.substr(1, colon_pos - 1));
+        cmd_status status = _run_batch(cmd_string.substr(colon_pos + 1));
+        if (status == cmd_status::IN_PROGRESS) {
+            detach_response(); // the job ends the response
+        }
+        else {
+            end_response(status == cmd_status::OK);
+        }
+        return(status);
+    }
+    return(_run_batch(cmd_string));
+}
 
-    CommandArgs args;
-    // casts output of find to int to get negative value when no comma is found
-    int comma_pos = cmd_string.find(",");
+static bool next_command(etl::string_view batch, size_t & start, etl::string_view & command) {
+    // commands are separated by ';' or line breaks, empty ones are skipped
+    while (start <= batch.size()) {
+        size_t end = start;
+        while (end < batch.size() && batch[end] != ';' && batch[end] != '\n') {
+            end++;
+        }
+        command = batch.substr(start, end - start);
+        start = end + 1;
+        while (!command.empty() && (command.front() == ' ' || command.front() == '\r')) {
+            command.remove_prefix(1);
+        }
+        while (!command.empty() && (command.back() == ' ' || command.back() == '\r')) {
+            command.remove_suffix(1);
+        }
+        if (!command.empty()) {
+            return(true);
+        }
+    }
+    return(false);
+}
 
-    // check if cmd is just command id or comma delimted list:
-    if ( comma_pos > 0 ) {
-        // comma delimited list
-        etl::vector<etl::string_view, 6> argv;
+cmd_status CommandParser::_run_batch(etl::string_view batch) {
+    // "!" in front runs the batch as a script, see the class comment
+    bool script = !batch.empty() && batch.front() == '!';
+    if (script) {
+        batch.remove_prefix(1);
+    }
 
-        bool all_views_found = etl::get_token_list(cmd_string, argv, ",", false, 6);
-        if (!all_views_found) {
-            log_warning("Got more than 5 arguments. Omitting the excess arguments.");
+    size_t start = 0;
+    size_t n_commands = 0;
+    etl::string_view command;
+    while (next_command(batch, start, command)) {
+        n_commands++;
+        if (script && _find(command.substr(0, command.find(','))) == nullptr) {
+            log_error("Script not run, unknown command %d: %.*s", n_commands, (int)command.size(), command.data());
+            return(cmd_status::ERROR);
         }
-        
-        args.command_id = etl::to_arithmetic<uint16_t>(argv[0]);
-        args.n_args = argv.size() - 1; // subtract command ID
-        log_info("Received command ID: %d with %d arguments", args.command_id, args.n_args);
+    }
+    if (n_commands == 0) {
+        log_error("Cannot parse: %.*s", (int)batch.size(), batch.data());
+        return(cmd_status::ERROR);
+    }
+    if (n_commands == 1 && !script) {
+        start = 0;
+        next_command(batch, start, command);
+        return(_run(command));
+    }
 
-        for (size_t i = 1; i < argv.size(); i++) {
-            args.argv.push_back(etl::string<32>(argv[i]));
-            log_debug("%d: %s", i, args.argv[i-1].c_str());
+    // jobs started by a batch do not reply, the batch ends the response
+    uint8_t count[CMD_STATUS_COUNT] = {0};
+    cmd_status result = cmd_status::OK;
+    size_t n = 0;
+    start = 0;
+    _in_batch = true;
+    while (next_command(batch, start, command)) {
+        n++;
+        cmd_status status = cmd_status::SKIPPED;
+        if (!script || result == cmd_status::OK) {
+            status = _run(command);
+        }
+        if (status == cmd_status::ERROR) {
+            result = cmd_status::ERROR;
         }
+        count[(uint8_t)status]++;
+        log_response("[%d] %s %.*s", n, cmd_status_name(status), (int)command.size(), command.data());
     }
-    else {
-        args.n_args = 0;
-        args.command_id = etl::to_arithmetic<uint16_t>(cmd_string);
+    _in_batch = false;
+    log_response("%d commands: %d ok, %d failed, %d skipped, %d in progress", n_commands,
+        count[(uint8_t)cmd_status::OK], count[(uint8_t)cmd_status::ERROR],
+        count[(uint8_t)cmd_status::SKIPPED], count[(uint8_t)cmd_status::IN_PROGRESS]);
+    return(result);
+}
+
+cmd_status CommandParser::_run(etl::string_view cmd_string) {
+
+    // log_info("Recevied: %s", cmd_string.c_str() );
+
+    // split the comma separated list into views, the command is the first one
+    etl::vector<etl::string_view, CMD_MAX_ARGS + 1> tokens;
+    size_t start = 0;
+    while (start <= cmd_string.size()) {
+        if (tokens.full()) {
+            log_warning("Got more than %d arguments. Omitting the excess arguments.", CMD_MAX_ARGS);
+            break;
+        }
+        size_t comma_pos = cmd_string.find(',', start);
+        if (comma_pos == etl::string_view::npos) {
+            comma_pos = cmd_string.size();
+        }
+        tokens.push_back(cmd_string.substr(start, comma_pos - start));
+        start = comma_pos + 1;
     }
 
-    if ( args.command_id == 0 ) {
-        // error parsing command
-        log_error("Cannot parse: %s", cmd_string.c_str());
-        return;
+    Command * command = _find(tokens[0]);
+    if ( command == nullptr ) {
+        log_error("Cannot parse: %.*s", (int)cmd_string.size(), cmd_string.data());
+        return(cmd_status::ERROR);
+    }
+
+    CommandArgs args;
+    args.command_id = command->get_cmd_id();
+    args.n_args = tokens.size() - 1; // subtract command
+    for (size_t i = 1; i < tokens.size(); i++) {
+        args.argv.push_back(tokens[i]);
+    }
+    if (args.n_args > 0) {
+        log_info("Received command ID: %d with %d arguments", args.command_id, args.n_args);
     }
-    
-    if (command_id_exists(args.command_id)) {
-        _cmd_list[args.command_id].run(args);
+    _job_started = false;
+    if (!command->run(args)) {
+        return(cmd_status::ERROR);
     }
+    return(_job_started ? cmd_status::IN_PROGRESS : cmd_status::OK);
 }
 
+Command * CommandParser::_find(etl::string_view token) {
+    // numbers are command IDs, anything else a command name
+    if ( token.empty() ) {
+        return(nullptr);
+    }
+    if ( isdigit(token.front()) ) {
+        uint16_t command_id = etl::to_arithmetic<uint16_t>(token);
+        auto id = _ids.find(command_id);
+        if (id == _ids.end()) {
+            log_warning("Command ID %d not found", command_id);
+            return(nullptr);
+        }
+        return(&_commands[id->second]);
+    }
+    auto name = _names.find(token);
+    if (name == _names.end()) {
+        log_warning("Command %.*s not found", (int)token.size(), token.data());
+        return(nullptr);
+    }
+    return(&_commands[name->second]);
+}
+
+void CommandParser::run_cmd(const CommandArgs & args) {
+    auto id = _ids.find(args.command_id);
+    if (id != _ids.end()) {
+        _commands[id->second].run(args);
+    }
+}
 
  bool CommandParser::command_id_exists(uint16_t command_id) {
-    for (size_t i = 0; i < NO_COMMANDS; i++) {
-        if (_cmd_list[i].get_cmd_id() == command_id) {
-            return(true);
-        }
+    if (_ids.find(command_id) != _ids.end()) {
+        return(true);
     }
     log_warning("Command ID %d not found", command_id);
     return(false);
@@ -92,41 +242,204 @@ void CommandParser::parse(ETLSTR cmd_string) {
 
 void CommandParser::log_cmd_help_text(uint16_t command_id) {
     log_response("--- Available commands on device ---");
-    for (uint16_t i = 0; i < NO_COMMANDS; i++) {
-        if (_cmd_list[i].get_cmd_id() != 0) {
-            etl::string<64> help_text(_cmd_list[i].help());
-            log_response("%d: %s", i, help_text.c_str());
+    for (Command & command : _commands) {
+        if (command.get_name() != nullptr) {
+            log_response("%d %s: %s", command.get_cmd_id(), command.get_name(), command.help());
+        }
+        else {
+            log_response("%d: %s", command.get_cmd_id(), command.help());
         }
     }
 }
 
-void CommandParser::add(uint16_t command_id, void (*cmd_func_ptr)(CommandArgs args), etl::string<64> help_text) {
-    if (command_id >= NO_COMMANDS) {
-        log_error("Cannot add command ID %d. Max command ID: %d", command_id, NO_COMMANDS - 1 );
+void CommandParser::add(uint16_t command_id, command_function_t cmd_func_ptr, const char * help_text) {
+    add(command_id, nullptr, cmd_func_ptr, help_text);
+}
+
+void CommandParser::add(uint16_t command_id, const char * name, command_function_t cmd_func_ptr, const char * help_text) {
+    _add(Command(command_id, name, cmd_func_ptr, help_text));
+}
+
+void CommandParser::add(uint16_t command_id, command_status_function_t cmd_func_ptr, const char * help_text) {
+    add(command_id, nullptr, cmd_func_ptr, help_text);
+}
+
+void CommandParser::add(uint16_t command_id, const char * name, command_status_function_t cmd_func_ptr, const char * help_text) {
+    _add(Command(command_id, name, reinterpret_cast<generic_function_t>(cmd_func_ptr), &invoke_status_command, help_text));
+}
+
+void CommandParser::_add(const Command & command) {
+    // name and help_text must be string literals, only the pointers are kept
+    uint16_t command_id = command.get_cmd_id();
+    const char * name = command.get_name();
+    if (command_id == 0 || _ids.find(command_id) != _ids.end()) {
+        log_error("Cannot add command ID %d, 0 or already used", command_id);
+        return;
+    }
+    if (_commands.full()) {
+        log_error("Cannot add command ID %d. Max number of commands: %d", command_id, CMD_MAX_COMMANDS);
+        return;
+    }
+    if (name != nullptr && _names.find(etl::string_view(name)) != _names.end()) {
+        log_error("Cannot add command %s, name already used", name);
         return;
     }
-    auto command = Command(command_id, cmd_func_ptr, help_text);
-    _cmd_list[command_id] = command;
+    uint8_t index = _commands.size();
+    _commands.push_back(command);
+    _ids.insert(etl::make_pair(command_id, index));
+    if (name != nullptr) {
+        _names.insert(etl::make_pair(etl::string_view(name), index));
+    }
 }
 
-void CommandParser::tick() {
-    // handle serial
-    auto c = Serial.read();
-    if ( c == '\n') {
-        parse(_partial_cmd_from_serial);
-        _partial_cmd_from_serial.clear();
+bool CommandParser::submit(etl::string_view cmd_string, Connection * reply_connection) {
+    // the text is copied, the caller's buffer may be reused
+    if (_queue.full()) {
+        log_error("Command queue full, dropped: %.*s", (int)cmd_string.size(), cmd_string.data());
+        return(false);
+    }
+    if (cmd_string.size() > CMD_QUEUE_TEXT_LENGTH) {
+        log_error("Command longer than %d characters, dropped", CMD_QUEUE_TEXT_LENGTH);
+        return(false);
+    }
+    _queue.emplace_back();
+    _queue.back().reply_connection = reply_connection;
+    _queue.back().text.assign(cmd_string.begin(), cmd_string.end());
+    return(true);
+}
+
+bool CommandParser::start_job(const char * name, job_step_t step, uint32_t data) {
+    // called from a command function, which then returns IN_PROGRESS
+    if (_jobs.full()) {
+        log_error("Cannot start job %s, %d jobs running", name, CMD_MAX_JOBS);
+        return(false);
+    }
+    Job job;
+    job.id = _next_job_id++;
+    if (_next_job_id == 0) {
+        _next_job_id = 1;
+    }
+    job.name = name;
+    job.step = step;
+    job.data = data;
+    job.started_ms = millis();
+    job.cancelled = false;
+    job.waiting = false;
+    job.reply_connection = _in_batch ? nullptr : get_response_connection();
+    if (job.reply_connection != nullptr) {
+        etl::string_view correlation = get_response_correlation();
+        job.correlation.assign(correlation.begin(), correlation.end());
+    }
+    _jobs.push_back(job);
+    _job_started = true;
+    return(true);
+}
+
+bool CommandParser::cancel_job(uint8_t job_id) {
+    for (Job & job : _jobs) {
+        if (job.id == job_id) {
+            job.cancelled = true; // removed after its next step
+            return(true);
+        }
+    }
+    return(false);
+}
+
+void CommandParser::log_jobs() {
+    if (_jobs.empty()) {
+        log_response("No jobs running");
+        return;
+    }
+    for (Job & job : _jobs) {
+        log_response("%d %s: running for %lus%s", job.id, job.name,
+            (unsigned long)((millis() - job.started_ms) / 1000), job.cancelled ? ", cancelling" : "");
+    }
+}
+
+void CommandParser::_run_jobs() {
+    // one job per call, round robin, for at most CMD_JOB_SLICE_US
+    if (_jobs.empty()) {
+        return;
+    }
+    if (_next_job_index >= _jobs.size()) {
+        _next_job_index = 0;
     }
-    else if (c < 0) {
-        // nothinh received, do nothing
+    Job & job = _jobs[_next_job_index];
+    if (job.reply_connection != nullptr) {
+        begin_response(job.reply_connection, job.correlation);
+    }
+    cmd_status status;
+    job.waiting = false;
+    run_slice([&job, &status]() {
+        status = job.step(job);
+        return(status == cmd_status::IN_PROGRESS && !job.cancelled && !job.waiting);
+    }, CMD_JOB_SLICE_US);
+
+    if (status == cmd_status::IN_PROGRESS && !job.cancelled) {
+        if (job.reply_connection != nullptr) {
+            detach_response();
+        }
+        _next_job_index++;
+        return;
+    }
+    if (job.cancelled) {
+        log_response("Job %d %s cancelled", job.id, job.name);
+        status = cmd_status::ERROR;
+    }
+    if (job.reply_connection != nullptr) {
+        end_response(status == cmd_status::OK);
     }
     else {
-        _partial_cmd_from_serial.push_back(c);
+        log_info("Job %d %s finished: %s", job.id, job.name, cmd_status_name(status));
     }
+    _jobs.erase(_jobs.begin() + _next_job_index);
+}
 
+uint32_t CommandParser::next_tick_ms() {
+    // time until tick() has work, for a loop that sleeps in between
+    if (!_queue.empty() || _serial.available() > 0) {
+        return(0);
+    }
+    uint32_t poll_ms = _jobs.empty() ? CMD_IDLE_POLL_MS : CMD_JOB_POLL_MS;
+    uint32_t elapsed = millis() - _last_tick_ms;
+    return((elapsed < poll_ms) ? poll_ms - elapsed : 0);
 }
 
+void CommandParser::tick() {
+    _last_tick_ms = millis();
+    // handle serial, a bounded number of bytes per call
+    size_t budget = SERIAL_READER_MAX_BYTES_PER_TICK;
+    etl::string_view command;
+    serial_item item;
+    while ((item = _serial.poll(command, budget)) != serial_item::NONE) {
+        cmd_status status = parse(command);
+        if (item == serial_item::FRAME) {
+            _serial.reply(status == cmd_status::ERROR ? serial_frame_status::COMMAND_FAILED : serial_frame_status::OK);
+        }
+    }
 
-bool check_args(CommandArgs args, uint8_t n) {
+    // one queued command per call
+    if (!_queue.empty()) {
+        QueuedCommand & queued = _queue.front();
+        parse(queued.text, queued.reply_connection);
+        _queue.pop_front();
+    }
+
+    _run_jobs();
+}
+
+
+const char * cmd_status_name(cmd_status status) {
+    switch (status) {
+        case cmd_status::OK: return("OK");
+        case cmd_status::ERROR: return("ERROR");
+        case cmd_status::SKIPPED: return("SKIPPED");
+        case cmd_status::IN_PROGRESS: return("IN_PROGRESS");
+    }
+    return("UNKNOWN");
+}
+
+bool check_args(const CommandArgs & args, uint8_t n) {
     if (args.n_args < n) {
         log_error("Too few arguments. Got %d, expected %d", args.n_args, n);
         return false;
@@ -136,4 +449,3 @@ bool check_args(CommandArgs args, uint8_t n) {
     }
     return true;
 }
-
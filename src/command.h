@@ -1,57 +1,224 @@
 #pragma once
 #include <Arduino.h>
 #include <etl/string.h>
+#include <etl/string_view.h>
 #include <etl/vector.h>
+#include <etl/unordered_map.h>
+#include <etl/deque.h>
 #include <etl/to_arithmetic.h>
+#include <etl/utility.h>
+#include <tuple>
 #include <logging.h>
+#include "command_args.h"
+#include "serial_reader.h"
 
 
-#define NO_COMMANDS 20
-
-#define ETLSTR etl::string<128>
+#define CMD_MAX_COMMANDS 32
+#define CMD_MAX_ARGS 5
+#define CMD_EXPECTED_TEXT_LENGTH 96 // argument description in parse errors
+#define CMD_QUEUE_LENGTH 4
+#define CMD_QUEUE_TEXT_LENGTH 256 // same as the MQTT message buffer
+#define CMD_MAX_JOBS 4
+#define CMD_JOB_SLICE_US 2000 // time a job may run per tick()
+#define CMD_JOB_POLL_MS 20
+#define CMD_IDLE_POLL_MS 1000 // serial input and submit() are not missed, they make tick() due
 
+// Arguments are views into the received command and are only valid while the
+// command function runs. They are not null terminated, print them with %.*s.
 struct CommandArgs {
     uint16_t command_id;
     uint8_t n_args;
-    etl::vector<ETLSTR, 5> argv;
+    etl::vector<etl::string_view, CMD_MAX_ARGS> argv;
+};
+
+enum class cmd_status : uint8_t {
+    OK,
+    ERROR,
+    SKIPPED,    // not run, an earlier command in the script failed
+    IN_PROGRESS // continues as a job
+};
+#define CMD_STATUS_COUNT 4
+
+const char * cmd_status_name(cmd_status status);
+
+typedef void (*command_function_t)(const CommandArgs & args);
+typedef cmd_status (*command_status_function_t)(const CommandArgs & args);
+typedef void (*generic_function_t)();
+typedef bool (*command_invoker_t)(generic_function_t function, const CommandArgs & args);
+
+bool check_args(const CommandArgs & args, uint8_t n);
+
+template <typename T>
+bool parse_command_arg(const CommandArgs & args, size_t index, T & value, bool & ok) {
+    if (!ok) {
+        return(false); // report only the first bad argument
+    }
+    if (!command_arg<T>::parse(args.argv[index], value)) {
+        char expected[CMD_EXPECTED_TEXT_LENGTH];
+        command_arg<T>::expected(expected, sizeof(expected));
+        log_error("Argument %d: expected %s, got '%.*s'", (int)index + 1, expected,
+            (int)args.argv[index].size(), args.argv[index].data());
+        ok = false;
+    }
+    return(ok);
+}
+
+// Result of a typed command function, which returns void or cmd_status
+template <typename R>
+struct typed_result;
+
+template <>
+struct typed_result<void> {
+    template <typename F, typename... As>
+    static bool call(F function, As &... args) {
+        function(args...);
+        return(true);
+    }
+};
+
+template <>
+struct typed_result<cmd_status> {
+    template <typename F, typename... As>
+    static bool call(F function, As &... args) {
+        return(function(args...) != cmd_status::ERROR);
+    }
+};
+
+// Checks and converts the arguments for a command function taking Ts...
+template <typename R, typename... Ts>
+struct typed_command {
+    typedef R (*function_t)(Ts...);
+
+    static bool invoke(generic_function_t function, const CommandArgs & args) {
+        return(call(reinterpret_cast<function_t>(function), args, etl::make_index_sequence<sizeof...(Ts)>()));
+    }
+
+    template <size_t... Is>
+    static bool call(function_t function, const CommandArgs & args, etl::index_sequence<Is...>) {
+        if (!check_args(args, sizeof...(Ts))) {
+            return(false);
+        }
+        std::tuple<typename std::decay<Ts>::type...> values;
+        bool ok = true;
+        bool parsed[] = { true, parse_command_arg(args, Is, std::get<Is>(values), ok)... };
+        (void)parsed;
+        if (!ok) {
+            return(false);
+        }
+        return(typed_result<R>::call(function, std::get<Is>(values)...));
+    }
+};
+
+// Raw handlers that report their own status, for optional arguments
+inline bool invoke_status_command(generic_function_t function, const CommandArgs & args) {
+    return(reinterpret_cast<command_status_function_t>(function)(args) != cmd_status::ERROR);
+}
+
+struct Job;
+typedef cmd_status (*job_step_t)(Job & job);
+
+// Long running work started by a command. step() is called from
+// CommandParser::tick() until it returns OK or ERROR, repeatedly within one
+// slice while it returns IN_PROGRESS. It should do a small piece of work per
+// call and set waiting when there is nothing to do until the next tick(). log_response() in step() goes to the reply of the starting command,
+// which gets its END when the job finishes.
+struct Job {
+    uint8_t id;
+    const char * name;
+    job_step_t step;
+    uint32_t data;      // free for the step function
+    uint32_t started_ms;
+    bool cancelled;     // set for the last call, clean up and return
+    bool waiting;       // set by step() to end the slice, e.g. when polling
+    Connection * reply_connection;
+    etl::string<RESPONSE_CORRELATION_LENGTH> correlation;
+};
+
+struct QueuedCommand {
+    Connection * reply_connection;
+    etl::string<CMD_QUEUE_TEXT_LENGTH> text;
 };
 
 class Command {
     public:
-        Command(uint16_t command_id, void (*cmd_func_ptr)(CommandArgs args), etl::string<64> help_text );
+        Command(uint16_t command_id, const char * name, command_function_t cmd_func_ptr, const char * help_text);
+        Command(uint16_t command_id, const char * name, generic_function_t typed_func_ptr, command_invoker_t invoker, const char * help_text);
         Command();
-        uint16_t get_cmd_id();
-        void run(CommandArgs args);
-        etl::string_view help();
+        uint16_t get_cmd_id() const;
+        const char * get_name() const;
+        bool run(const CommandArgs & args);
+        const char * help();
 
     private:
-        void (*_cmd_func_ptr)(CommandArgs args);
+        command_function_t _cmd_func_ptr;
+        generic_function_t _typed_func_ptr;
+        command_invoker_t _invoker; // set for typed commands
         uint16_t _command_id;
-        etl::string<64> _help_text;
+        const char * _name;      // string literals, kept in flash
+        const char * _help_text;
 
 };
 
 
+// Commands are called by number ("3") or by name ("status"), arguments follow
+// comma separated ("5,DEBUG"). Both lookups are hashed.
+// Command functions either take the raw CommandArgs, or typed parameters that
+// are checked and converted before the call (see command_args.h). Both kinds
+// may return cmd_status instead of void, returning ERROR fails the command:
+//   void set_target(float celsius, uint8_t zone);
+//   cmd.add(12, "target", set_target, "Set target temperature. Arg1: celsius, Arg2: zone");
+// One message may hold a batch of commands separated by ';' or line breaks
+// ("5,DEBUG;target,21.5,1"). They run in order and each gets a status line
+// followed by a summary. A batch starting with '!' is a script: nothing runs
+// if a command is unknown, and the rest is skipped after the first failure.
+// Commands from MQTT are submit()ted and run from tick(), one per call, so
+// they never run inside Connection::maintain().
 class CommandParser {
 
     public:
         CommandParser();
         void tick();
-        void parse(ETLSTR);
-        void run_cmd(CommandArgs args);
-        void add(uint16_t command_id, void (*cmd_func_ptr)(CommandArgs args), etl::string<64> help_text);
+        uint32_t next_tick_ms();
+        cmd_status parse(etl::string_view cmd_string, Connection * reply_connection = nullptr);
+        bool submit(etl::string_view cmd_string, Connection * reply_connection = nullptr);
+        bool start_job(const char * name, job_step_t step, uint32_t data = 0);
+        bool cancel_job(uint8_t job_id);
+        void log_jobs();
+        void run_cmd(const CommandArgs & args);
+        void add(uint16_t command_id, command_function_t cmd_func_ptr, const char * help_text);
+        void add(uint16_t command_id, const char * name, command_function_t cmd_func_ptr, const char * help_text);
+        void add(uint16_t command_id, command_status_function_t cmd_func_ptr, const char * help_text);
+        void add(uint16_t command_id, const char * name, command_status_function_t cmd_func_ptr, const char * help_text);
+
+        template <typename R, typename... Ts>
+        void add(uint16_t command_id, R (*cmd_func_ptr)(Ts...), const char * help_text) {
+            add<R, Ts...>(command_id, nullptr, cmd_func_ptr, help_text);
+        }
+
+        template <typename R, typename... Ts>
+        void add(uint16_t command_id, const char * name, R (*cmd_func_ptr)(Ts...), const char * help_text) {
+            _add(Command(command_id, name, reinterpret_cast<generic_function_t>(cmd_func_ptr),
+                &typed_command<R, Ts...>::invoke, help_text));
+        }
+
         bool command_id_exists(uint16_t command_id);
         void log_cmd_help_text(uint16_t command_id = 0);
 
     private:
-        Command _cmd_list[NO_COMMANDS];
-        ETLSTR _partial_cmd_from_serial;
+        cmd_status _run_batch(etl::string_view batch);
+        cmd_status _run(etl::string_view cmd_string);
+        void _add(const Command & command);
+        Command * _find(etl::string_view token);
+        void _run_jobs();
+        etl::vector<Command, CMD_MAX_COMMANDS> _commands; // in registration order, for help
+        etl::unordered_map<uint16_t, uint8_t, CMD_MAX_COMMANDS> _ids;
+        etl::unordered_map<etl::string_view, uint8_t, CMD_MAX_COMMANDS> _names;
+        SerialCommandReader _serial;
+        etl::deque<QueuedCommand, CMD_QUEUE_LENGTH> _queue;
+        etl::vector<Job, CMD_MAX_JOBS> _jobs;
+        uint8_t _next_job_id;
+        size_t _next_job_index;
+        bool _job_started; // by the command that is running
+        bool _in_batch;
+        uint32_t _last_tick_ms;
 };
-
-bool check_args(CommandArgs args, uint8_t n);
-
-// namespace cmd_func {
-    // void reboot(CommandArgs args);
-    // void status(CommandArgs args);
-    // void enable_ota(CommandArgs args);
-// };
@@ -0,0 +1,114 @@
+#pragma once
+#include <Arduino.h>
+#include <type_traits>
+#include <etl/string_view.h>
+#include <etl/to_arithmetic.h>
+
+// Conversion of command arguments to the parameter types of typed commands,
+// see CommandParser::add<Ts...>(). Supported are integers, float, bool,
+// etl::string_view and enums with a name table:
+//
+//   template<> struct command_enum<log_severity> {
+//       static const command_enum_name<log_severity> * names(size_t & count) {
+//           static const command_enum_name<log_severity> table[] = {
+//               {"DEBUG", log_severity::DEBUG}, ...
+//           };
+//           count = sizeof(table) / sizeof(table[0]);
+//           return(table);
+//       }
+//   };
+
+template <typename E>
+struct command_enum_name {
+    const char * name;
+    E value;
+};
+
+template <typename E>
+struct command_enum; // specialise for each enum used as a command argument
+
+template <typename T, typename Enable = void>
+struct command_arg; // no conversion for this parameter type
+
+template <typename T>
+struct command_arg<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+    static bool parse(etl::string_view text, T & value) {
+        auto result = etl::to_arithmetic<T>(text);
+        if (!result.has_value()) {
+            return(false);
+        }
+        value = result.value();
+        return(true);
+    }
+    static void expected(char * buffer, size_t size) {
+        snprintf(buffer, size, std::is_signed<T>::value ? "integer" : "positive integer");
+    }
+};
+
+template <>
+struct command_arg<float> {
+    static bool parse(etl::string_view text, float & value) {
+        auto result = etl::to_arithmetic<float>(text);
+        if (!result.has_value()) {
+            return(false);
+        }
+        value = result.value();
+        return(true);
+    }
+    static void expected(char * buffer, size_t size) {
+        snprintf(buffer, size, "number");
+    }
+};
+
+template <>
+struct command_arg<bool> {
+    static bool parse(etl::string_view text, bool & value) {
+        if (text == etl::string_view("1") || text == etl::string_view("on") || text == etl::string_view("true")) {
+            value = true;
+            return(true);
+        }
+        if (text == etl::string_view("0") || text == etl::string_view("off") || text == etl::string_view("false")) {
+            value = false;
+            return(true);
+        }
+        return(false);
+    }
+    static void expected(char * buffer, size_t size) {
+        snprintf(buffer, size, "1/0, on/off or true/false");
+    }
+};
+
+template <>
+struct command_arg<etl::string_view> {
+    static bool parse(etl::string_view text, etl::string_view & value) {
+        value = text;
+        return(true);
+    }
+    static void expected(char * buffer, size_t size) {
+        snprintf(buffer, size, "text");
+    }
+};
+
+template <typename T>
+struct command_arg<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    static bool parse(etl::string_view text, T & value) {
+        // names are matched without regard to case
+        size_t count;
+        const command_enum_name<T> * names = command_enum<T>::names(count);
+        for (size_t i = 0; i < count; i++) {
+            if (strlen(names[i].name) == text.size() && strncasecmp(names[i].name, text.data(), text.size()) == 0) {
+                value = names[i].value;
+                return(true);
+            }
+        }
+        return(false);
+    }
+    static void expected(char * buffer, size_t size) {
+        size_t count;
+        const command_enum_name<T> * names = command_enum<T>::names(count);
+        size_t used = snprintf(buffer, size, "one of");
+        for (size_t i = 0; i < count && used < size; i++) {
+            used += snprintf(buffer + used, size - used, " %s", names[i].name);
+        }
+    }
+};
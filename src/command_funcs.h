@@ -3,23 +3,42 @@
 #include <ArduinoOTA.h>
 #include "command.h"
 #include "mqttConnection.h"
+#include "ota_service.h"
+#include "work_item.h"
 #include "logging.h"
 #include <time.h>
 
 extern CommandParser cmd;
 extern Connection conn;
+extern OtaService ota;
+
+template <>
+struct command_enum<log_severity> {
+    static const command_enum_name<log_severity> * names(size_t & count) {
+        static const command_enum_name<log_severity> table[] = {
+            {"DEBUG", log_severity::DEBUG},
+            {"INFO", log_severity::INFO},
+            {"WARNING", log_severity::WARNING},
+            {"ERROR", log_severity::ERROR},
+            {"CRITICAL", log_severity::CRITICAL},
+            {"RESPONSE", log_severity::RESPONSE}
+        };
+        count = sizeof(table) / sizeof(table[0]);
+        return(table);
+    }
+};
 
 namespace CMD {
 
-    void list_commands(CommandArgs args) {
+    void list_commands() {
         cmd.log_cmd_help_text();
     }
 
-    void reboot(CommandArgs args) {
+    void reboot() {
         ESP.restart();
     }
 
-    void status(CommandArgs args) {
+    void status() {
         // status message:
         // Memory
         // Time + uptime
@@ -28,6 +47,7 @@ namespace CMD {
         log_response("Device name: %s", conn.get_mqtt_client_name().c_str() );
         log_response("Connected to %s with RSSI %ddB", WiFi.SSID().c_str(), WiFi.RSSI() );
         log_response("Using %.1f%% of memory", (float(ESP.getFreeHeap())/float(ESP.getHeapSize()))*100 );
+        log_response("Largest free block %u of %u bytes free", ESP.getMaxAllocHeap(), ESP.getFreeHeap() );
 
         uint32_t uptime_ms = (millis() / 1000);
         uint16_t days = uptime_ms / (24*60*60);
@@ -38,91 +58,114 @@ namespace CMD {
         uint8_t seconds = uptime_ms % 60;
 
         log_response("Uptime: %dd %dh %dm %ds", days, hours, minutes, seconds);
+        log_response("MQTT sent %u bytes in %u segments from %u writes",
+            conn.get_transport()->get_bytes_written(),
+            conn.get_transport()->get_segments_written(),
+            conn.get_transport()->get_write_calls() );
+        log_response("Broker connects: %u, last %ums, slowest %ums",
+            conn.get_transport()->get_connect_count(),
+            conn.get_transport()->get_last_connect_ms(),
+            conn.get_transport()->get_max_connect_ms() );
+        log_response("Largest MQTT packet received: %u bytes", conn.get_transport()->get_max_incoming_packet() );
+        log_response("QoS 1 publishes sent as QoS 0 (window full): %u", conn.number_qos1_downgrades );
         log_response("Time is: %s", conn.get_time_string().c_str());
 
     }
 
-    void enable_ota(CommandArgs args) {
-        log_response("Enabling OTA");
-
-        // Stores OTA progress to avoid spamming logs with same percentage
-        unsigned int last_progress = 0 ;
-        
-        ArduinoOTA
-            .onStart([]() {
-                etl::string<16> type;
-                if (ArduinoOTA.getCommand() == U_FLASH)
-                    type = "sketch";
-                else // U_SPIFFS
-                    type = "filesystem";
-
-                // NOTE: if updating SPIFFS this would be the place to unmount SPIFFS using SPIFFS.end()
-                log_response("Start updating %s", type);
-            })
-            .onEnd([]() {
-                log_response("Data transmission completed");
-            })
-            .onProgress([&last_progress](unsigned int progress, unsigned int total) {
-                unsigned int progress_pct = (progress / (total / 100));
-                if (progress_pct != last_progress ) {
-                    log_response("Progress: %u%%\r", progress_pct);
-                    last_progress = progress_pct;
+    cmd_status enable_ota(const CommandArgs & args) {
+        // arg 1: window in seconds (optional)
+        uint32_t window_s = OTA_DEFAULT_WINDOW_S;
+        bool ok = true;
+        if (args.n_args > 0 && !parse_command_arg(args, 0, window_s, ok)) {
+            return(cmd_status::ERROR);
+        }
+        ota.enable(window_s);
+        log_response("Enabling OTA for %u seconds", window_s);
+        return(cmd_status::OK);
+    }
+
+    cmd_status pull_update_progress(Job & job) {
+        // job.data is the last reported progress
+        job.waiting = true;
+        if (job.cancelled) {
+            log_response("The download continues, progress is on the ota topic");
+            return(cmd_status::ERROR);
+        }
+        if (ota.is_pull_pending()) {
+            return(cmd_status::IN_PROGRESS);
+        }
+        switch (ota.get_state()) {
+            case ota_state::UPDATING:
+                if (ota.get_progress() >= job.data + 10) {
+                    job.data = ota.get_progress();
+                    log_response("Progress %u%%", (unsigned)job.data);
                 }
-            })
-            .onError([](ota_error_t error) {
-                log_error("OTA Error[%u]: ", error);
-                if (error == OTA_AUTH_ERROR) log_error("Auth Failed");
-                else if (error == OTA_BEGIN_ERROR) log_error("Begin Failed");
-                else if (error == OTA_CONNECT_ERROR) log_error("Connect Failed");
-                else if (error == OTA_RECEIVE_ERROR) log_error("Receive Failed");
-                else if (error == OTA_END_ERROR) log_error("End Failed");
-            });
-
-        ArduinoOTA.begin();
-
-        for (int seconds_passed = 0; seconds_passed < 60; seconds_passed++) {
-            ArduinoOTA.handle();
-            if (seconds_passed % 10 == 0) {
-                log_info("OTA active for %d seconds", seconds_passed);
-            }
-            delay(1000);
+                return(cmd_status::IN_PROGRESS);
+            case ota_state::DONE:
+                log_response("Update written, rebooting");
+                return(cmd_status::OK);
+            default:
+                log_response("Update failed");
+                return(cmd_status::ERROR);
+        }
+    }
+
+    cmd_status pull_update(etl::string_view url) {
+        // url of a package made by tools/package_firmware.py, progress is
+        // reported by a job until the update is written
+        if ( ! ota.pull(url)) {
+            log_response("Update already running");
+            return(cmd_status::ERROR);
         }
-        ArduinoOTA.end();
-        log_error("OTA sessions completed, no new firmware received.");
+        log_response("Pulling update from %.*s", (int)url.size(), url.data());
+        cmd.start_job("pull", pull_update_progress);
+        return(cmd_status::OK);
     }
 
-    void set_wifi(CommandArgs args) {
+    cmd_status jobs(const CommandArgs & args) {
+        // arg 1: ID of a job to cancel (optional)
+        uint8_t job_id;
+        bool ok = true;
+        if (args.n_args == 0) {
+            cmd.log_jobs();
+            return(cmd_status::OK);
+        }
+        if (!parse_command_arg(args, 0, job_id, ok)) {
+            return(cmd_status::ERROR);
+        }
+        if (!cmd.cancel_job(job_id)) {
+            log_response("No job %d", job_id);
+            return(cmd_status::ERROR);
+        }
+        log_response("Cancelling job %d", job_id);
+        return(cmd_status::OK);
+    }
+
+    void work_items() {
+        // worst loop latency and how the work items use their budgets
+        log_response("Worst loop latency since last heartbeat: %lu us", (unsigned long)conn.get_max_loop_us());
+        WorkItem::log_all();
+    }
+
+    cmd_status set_wifi(const CommandArgs & args) {
         // Sets a wifi and SSID and password
         // arg 1: SSID
         // arg 2: password
 
         log_warning("Setting wifi not implemented yet");
+        return(cmd_status::ERROR);
     }
 
 
-    void set_log_level(CommandArgs args ) {
-        if (! check_args(args, 1)) { return; }
-
-        if (args.argv[0] == "DEBUG") {
-            set_log_level(log_severity::DEBUG);
-        } else if (args.argv[0] == "INFO") {
-            set_log_level(log_severity::INFO);
-        } else if (args.argv[0] == "WARNING") {
-            set_log_level(log_severity::WARNING);
-        } else if (args.argv[0] == "ERROR") {
-            set_log_level(log_severity::ERROR);
-        } else if (args.argv[0] == "CRITICAL") {
-            set_log_level(log_severity::CRITICAL);
-        } else if (args.argv[0] == "RESPONSE") {
-            set_log_level(log_severity::RESPONSE);
-        }
+    void change_log_level(log_severity level) {
+        set_log_level(level);
     }
 
-    void log_ip(CommandArgs args) {
+    void log_ip() {
         log_response("IP: %s", WiFi.localIP().toString());
     }
 
-    void log_mac(CommandArgs args) {
+    void log_mac() {
         log_response("MAC: %s", WiFi.macAddress().c_str());
     }
 }
\ No newline at end of file
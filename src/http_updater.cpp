@@ -0,0 +1,385 @@
+#include "http_updater.h"
+
+static uint32_t read_u32(const uint8_t * data)
+{
+    // package fields are little endian
+    return((uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+}
+
+HttpUpdater::HttpUpdater()
+{
+    _stream = nullptr;
+    _state = http_update_state::IDLE;
+    _error = http_update_error::NONE;
+    _received = 0;
+    _package_size = 0;
+    _skip = 0;
+    _retries = 0;
+    _resumes = 0;
+    _retry_at_ms = 0;
+    _last_data_ms = 0;
+    _flags = 0;
+    _image_size = 0;
+    _delta_state = OPERATION;
+    _delta_operation = 0;
+    _delta_argument_length = 0;
+    _insert_remaining = 0;
+    _running = nullptr;
+    _target = nullptr;
+    _ota_handle = 0;
+    _ota_begun = false;
+    _flash_length = 0;
+    _image_written = 0;
+}
+
+bool HttpUpdater::start(etl::string_view url)
+{
+    if (is_active()) {
+        _error = http_update_error::BUSY;
+        return(false);
+    }
+    _url.assign(url.begin(), url.end());
+    _state = http_update_state::CONNECTING;
+    _error = http_update_error::NONE;
+    _received = 0;
+    _package_size = 0;
+    _skip = 0;
+    _retries = 0;
+    _resumes = 0;
+    _retry_at_ms = millis();
+    _delta_state = OPERATION;
+    _flash_length = 0;
+    _image_written = 0;
+    _image_size = 0;
+    return(true);
+}
+
+void HttpUpdater::abort()
+{
+    if (is_active()) {
+        _fail(http_update_error::NONE);
+        _state = http_update_state::IDLE;
+    }
+}
+
+bool HttpUpdater::is_active()
+{
+    return(_state == http_update_state::CONNECTING
+        || _state == http_update_state::STREAMING
+        || _state == http_update_state::WAITING_RETRY);
+}
+
+http_update_state HttpUpdater::get_state()
+{
+    return(_state);
+}
+
+http_update_error HttpUpdater::get_error()
+{
+    return(_error);
+}
+
+uint8_t HttpUpdater::get_progress()
+{
+    if (_image_size == 0) {
+        return(0);
+    }
+    return((uint8_t)((uint64_t)(_image_written + _flash_length) * 100 / _image_size));
+}
+
+uint32_t HttpUpdater::get_resumes()
+{
+    return(_resumes);
+}
+
+void HttpUpdater::step()
+{
+    if (_state == http_update_state::CONNECTING || _state == http_update_state::WAITING_RETRY) {
+        if ((int32_t)(millis() - _retry_at_ms) >= 0) {
+            _connect();
+        }
+        return;
+    }
+    if (_state != http_update_state::STREAMING) {
+        return;
+    }
+
+    int available = _stream->available();
+    if (available <= 0) {
+        if ( ! _http.connected() || millis() - _last_data_ms > HTTP_UPDATE_TIMEOUT_MS ) {
+            _interrupted();
+        }
+        return;
+    }
+    uint8_t buffer[HTTP_UPDATE_CHUNK_SIZE];
+    int length = _stream->read(buffer, available < HTTP_UPDATE_CHUNK_SIZE ? available : HTTP_UPDATE_CHUNK_SIZE);
+    if (length <= 0) {
+        return;
+    }
+    _last_data_ms = millis();
+
+    size_t offset = 0;
+    if (_skip > 0) {
+        // the server sent the whole file, drop what was already consumed
+        offset = _skip < (uint32_t)length ? _skip : length;
+        _skip -= offset;
+    }
+    if ( ! _consume(buffer + offset, length - offset) ) {
+        return;
+    }
+    if (_package_size > 0 && _received >= _package_size) {
+        _finish();
+    }
+}
+
+void HttpUpdater::_connect()
+{
+    _http.end();
+    _http.setTimeout(HTTP_UPDATE_TIMEOUT_MS);
+    if ( ! _http.begin(_client, _url.c_str()) ) {
+        _fail(http_update_error::HTTP_STATUS);
+        return;
+    }
+    if (_received > 0) {
+        char range[32];
+        snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)_received);
+        _http.addHeader("Range", range);
+        _resumes++;
+    }
+    int status = _http.GET();
+    if (status == HTTP_CODE_PARTIAL_CONTENT) {
+        _skip = 0;
+    }
+    else if (status == HTTP_CODE_OK) {
+        _skip = _received;
+    }
+    else if (status >= 400 && status < 500) {
+        _fail(http_update_error::HTTP_STATUS); // missing package, retrying will not help
+        return;
+    }
+    else {
+        _interrupted();
+        return;
+    }
+    _stream = _http.getStreamPtr();
+    _last_data_ms = millis();
+    _state = http_update_state::STREAMING;
+}
+
+void HttpUpdater::_interrupted()
+{
+    _http.end();
+    _retries++;
+    if (_retries > HTTP_UPDATE_MAX_RETRIES) {
+        _fail(http_update_error::RETRIES);
+        return;
+    }
+    _retry_at_ms = millis() + HTTP_UPDATE_RETRY_DELAY_MS * _retries;
+    _state = http_update_state::WAITING_RETRY;
+}
+
+void HttpUpdater::_fail(http_update_error error)
+{
+    _http.end();
+    if (_ota_begun) {
+        esp_ota_abort(_ota_handle);
+        mbedtls_sha256_free(&_sha256);
+        _ota_begun = false;
+    }
+    _error = error;
+    _state = http_update_state::FAILED;
+}
+
+bool HttpUpdater::_consume(const uint8_t * data, size_t length)
+{
+    uint8_t decoded[LZSS_MAX_OUTPUT];
+    for (size_t i = 0; i < length; i++) {
+        if (_received < HTTP_UPDATE_HEADER_SIZE) {
+            _header[_received++] = data[i];
+            if (_received == HTTP_UPDATE_HEADER_SIZE && ! _parse_header()) {
+                return(false);
+            }
+            continue;
+        }
+        _received++;
+
+        const uint8_t * payload = &data[i];
+        size_t payload_length = 1;
+        if (_flags & HTTP_UPDATE_FLAG_COMPRESSED) {
+            payload_length = _lzss.decode(data[i], decoded);
+            payload = decoded;
+        }
+        if (_flags & HTTP_UPDATE_FLAG_DELTA) {
+            for (size_t j = 0; j < payload_length; j++) {
+                if ( ! _delta_byte(payload[j]) ) {
+                    return(false);
+                }
+            }
+        }
+        else if ( ! _image_bytes(payload, payload_length) ) {
+            return(false);
+        }
+    }
+    return(true);
+}
+
+bool HttpUpdater::_parse_header()
+{
+    if (memcmp(_header, HTTP_UPDATE_MAGIC, 4) != 0) {
+        _fail(http_update_error::HEADER);
+        return(false);
+    }
+    _flags = _header[4];
+    _image_size = read_u32(&_header[8]);
+    _package_size = HTTP_UPDATE_HEADER_SIZE + read_u32(&_header[12]);
+    memcpy(_image_sha256, &_header[16], sizeof(_image_sha256));
+    if ( (_flags & HTTP_UPDATE_FLAG_COMPRESSED) && ! _lzss.begin(_header[5], _header[6]) ) {
+        _fail(http_update_error::HEADER);
+        return(false);
+    }
+
+    _running = esp_ota_get_running_partition();
+    _target = esp_ota_get_next_update_partition(nullptr);
+    if (_target == nullptr || _image_size == 0 || _image_size > _target->size) {
+        _fail(http_update_error::FLASH);
+        return(false);
+    }
+    if (_flags & HTTP_UPDATE_FLAG_DELTA) {
+        // a delta only applies to the image it was made from
+        uint8_t running_sha256[32];
+        if (esp_partition_get_sha256(_running, running_sha256) != ESP_OK
+            || memcmp(running_sha256, &_header[48], sizeof(running_sha256)) != 0) {
+            _fail(http_update_error::BASE_MISMATCH);
+            return(false);
+        }
+    }
+
+#ifdef OTA_WITH_SEQUENTIAL_WRITES
+    size_t erase_size = OTA_WITH_SEQUENTIAL_WRITES; // erase sector by sector while writing
+#else
+    size_t erase_size = _image_size;
+#endif
+    if (esp_ota_begin(_target, erase_size, &_ota_handle) != ESP_OK) {
+        _fail(http_update_error::FLASH);
+        return(false);
+    }
+    mbedtls_sha256_init(&_sha256);
+    mbedtls_sha256_starts(&_sha256, 0);
+    _ota_begun = true;
+    return(true);
+}
+
+bool HttpUpdater::_delta_byte(uint8_t byte)
+{
+    switch (_delta_state) {
+        case OPERATION:
+            if (byte != DELTA_OP_COPY && byte != DELTA_OP_INSERT) {
+                _fail(http_update_error::FORMAT);
+                return(false);
+            }
+            _delta_operation = byte;
+            _delta_argument_length = 0;
+            _delta_state = ARGUMENTS;
+            return(true);
+        case ARGUMENTS:
+            _delta_arguments[_delta_argument_length++] = byte;
+            if (_delta_operation == DELTA_OP_INSERT && _delta_argument_length == 4) {
+                _insert_remaining = read_u32(_delta_arguments);
+                _delta_state = (_insert_remaining > 0) ? INSERT_DATA : OPERATION;
+            }
+            else if (_delta_operation == DELTA_OP_COPY && _delta_argument_length == 8) {
+                _delta_state = OPERATION;
+                return(_copy_from_base(read_u32(_delta_arguments), read_u32(&_delta_arguments[4])));
+            }
+            return(true);
+        case INSERT_DATA:
+            if (--_insert_remaining == 0) {
+                _delta_state = OPERATION;
+            }
+            return(_image_bytes(&byte, 1));
+    }
+    return(true);
+}
+
+bool HttpUpdater::_copy_from_base(uint32_t offset, uint32_t length)
+{
+    if (offset + length > _running->size || offset + length < offset) {
+        _fail(http_update_error::FORMAT);
+        return(false);
+    }
+    uint8_t buffer[HTTP_UPDATE_COPY_SIZE];
+    while (length > 0) {
+        size_t chunk = length < HTTP_UPDATE_COPY_SIZE ? length : HTTP_UPDATE_COPY_SIZE;
+        if (esp_partition_read(_running, offset, buffer, chunk) != ESP_OK) {
+            _fail(http_update_error::FLASH);
+            return(false);
+        }
+        if ( ! _image_bytes(buffer, chunk) ) {
+            return(false);
+        }
+        offset += chunk;
+        length -= chunk;
+        yield(); // long copies, let other tasks on this core run
+    }
+    return(true);
+}
+
+bool HttpUpdater::_image_bytes(const uint8_t * data, size_t length)
+{
+    while (length > 0) {
+        uint32_t room = _image_size - (_image_written + _flash_length);
+        if (room == 0) {
+            return(true); // padding after the image
+        }
+        size_t chunk = HTTP_UPDATE_FLASH_BUFFER_SIZE - _flash_length;
+        if (chunk > length) { chunk = length; }
+        if (chunk > room) { chunk = room; }
+        memcpy(&_flash_buffer[_flash_length], data, chunk);
+        _flash_length += chunk;
+        data += chunk;
+        length -= chunk;
+        if (_flash_length == HTTP_UPDATE_FLASH_BUFFER_SIZE && ! _flush_flash()) {
+            return(false);
+        }
+    }
+    return(true);
+}
+
+bool HttpUpdater::_flush_flash()
+{
+    mbedtls_sha256_update(&_sha256, _flash_buffer, _flash_length);
+    if (esp_ota_write(_ota_handle, _flash_buffer, _flash_length) != ESP_OK) {
+        _fail(http_update_error::FLASH);
+        return(false);
+    }
+    _image_written += _flash_length;
+    _flash_length = 0;
+    return(true);
+}
+
+bool HttpUpdater::_finish()
+{
+    if (_flash_length > 0 && ! _flush_flash()) {
+        return(false);
+    }
+    if (_image_written != _image_size) {
+        _fail(http_update_error::FORMAT);
+        return(false);
+    }
+    uint8_t sha256[32];
+    mbedtls_sha256_finish(&_sha256, sha256);
+    if (memcmp(sha256, _image_sha256, sizeof(sha256)) != 0) {
+        _fail(http_update_error::HASH);
+        return(false);
+    }
+    mbedtls_sha256_free(&_sha256);
+    _ota_begun = false;
+    // esp_ota_end() also checks the image itself before it can be booted
+    if (esp_ota_end(_ota_handle) != ESP_OK || esp_ota_set_boot_partition(_target) != ESP_OK) {
+        _fail(http_update_error::FLASH);
+        return(false);
+    }
+    _http.end();
+    _state = http_update_state::DONE;
+    return(true);
+}
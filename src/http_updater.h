@@ -0,0 +1,121 @@
+#pragma once
+
+#include <Arduino.h>
+#include <HTTPClient.h>
+#include <WiFiClient.h>
+#include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+#include <etl/string.h>
+#include "lzss_decoder.h"
+
+#define HTTP_UPDATE_URL_LENGTH 128
+#define HTTP_UPDATE_HEADER_SIZE 80
+#define HTTP_UPDATE_MAGIC "DBU1"
+#define HTTP_UPDATE_FLAG_COMPRESSED 0x01
+#define HTTP_UPDATE_FLAG_DELTA 0x02
+#define HTTP_UPDATE_CHUNK_SIZE 1024       // bytes read from the server per step()
+#define HTTP_UPDATE_FLASH_BUFFER_SIZE 4096 // one flash sector
+#define HTTP_UPDATE_COPY_SIZE 256          // base image bytes read at a time for delta copies
+#define HTTP_UPDATE_TIMEOUT_MS 10000       // no data for this long counts as an interruption
+#define HTTP_UPDATE_MAX_RETRIES 10
+#define HTTP_UPDATE_RETRY_DELAY_MS 2000    // multiplied by the retry number
+
+#define DELTA_OP_COPY 0x01   // <u32 base offset> <u32 length>
+#define DELTA_OP_INSERT 0x02 // <u32 length> <bytes>
+
+enum class http_update_state : uint8_t {
+    IDLE,
+    CONNECTING,
+    STREAMING,
+    WAITING_RETRY,
+    DONE,
+    FAILED
+};
+
+enum class http_update_error : uint8_t {
+    NONE,
+    BUSY,
+    HTTP_STATUS,
+    HEADER,
+    BASE_MISMATCH,
+    FLASH,
+    FORMAT,
+    HASH,
+    RETRIES
+};
+
+// Pulls a package made by tools/package_firmware.py from an HTTP server and
+// writes it to the inactive OTA partition while it downloads. The package is
+// LZSS compressed and may be a delta against the running firmware. The image
+// SHA-256 is computed while writing and checked before the partition is made
+// bootable. Interrupted downloads resume with a Range request from the last
+// byte received, the decoder state is kept in RAM (not across reboots).
+// step() does a bounded amount of work; delta copies and flash erases still
+// take time, so run it from the OTA task.
+class HttpUpdater
+{
+    public:
+        HttpUpdater();
+        bool start(etl::string_view url);
+        void step();
+        void abort();
+        bool is_active();
+        http_update_state get_state();
+        http_update_error get_error();
+        uint8_t get_progress();
+        uint32_t get_resumes();
+
+    private:
+        void _connect();
+        void _interrupted();
+        void _fail(http_update_error error);
+        bool _consume(const uint8_t * data, size_t length);
+        bool _parse_header();
+        bool _delta_byte(uint8_t byte);
+        bool _copy_from_base(uint32_t offset, uint32_t length);
+        bool _image_bytes(const uint8_t * data, size_t length);
+        bool _flush_flash();
+        bool _finish();
+
+        enum delta_state : uint8_t {
+            OPERATION,
+            ARGUMENTS,
+            INSERT_DATA
+        };
+
+        HTTPClient _http;
+        WiFiClient _client;
+        WiFiClient * _stream;
+        etl::string<HTTP_UPDATE_URL_LENGTH> _url;
+        http_update_state _state;
+        http_update_error _error;
+        uint32_t _received;      // package bytes consumed, the resume position
+        uint32_t _package_size;
+        uint32_t _skip;          // bytes to discard when the server ignored the Range header
+        uint32_t _retries;
+        uint32_t _resumes;
+        uint32_t _retry_at_ms;
+        uint32_t _last_data_ms;
+
+        uint8_t _header[HTTP_UPDATE_HEADER_SIZE];
+        uint8_t _flags;
+        uint32_t _image_size;
+        uint8_t _image_sha256[32];
+
+        LzssDecoder _lzss;
+        delta_state _delta_state;
+        uint8_t _delta_operation;
+        uint8_t _delta_arguments[8];
+        uint8_t _delta_argument_length;
+        uint32_t _insert_remaining;
+
+        const esp_partition_t * _running;
+        const esp_partition_t * _target;
+        esp_ota_handle_t _ota_handle;
+        bool _ota_begun;
+        mbedtls_sha256_context _sha256;
+        uint8_t _flash_buffer[HTTP_UPDATE_FLASH_BUFFER_SIZE];
+        size_t _flash_length;
+        uint32_t _image_written;
+};
@@ -41,7 +41,7 @@ etl::string<32> OnOffSwitch::getName() {
 void OnOffSwitch::turnOn(bool updateOnOffTopic)
 {
     digitalWrite(_pin, HIGH);
-    if (updateOnOffTopic) { _conn->publish(_mqtt_topic, _on_value); }
+    if (updateOnOffTopic) { _conn->publish(_mqtt_topic, _on_value, mqtt_qos::AT_LEAST_ONCE, true); }
     log_info("OnOffSwitch %s turned ON", _name.c_str() );
 }
 
@@ -49,7 +49,7 @@ void OnOffSwitch::turnOn(bool updateOnOffTopic)
 void OnOffSwitch::turnOff(bool updateOnOffTopic)
 {
     digitalWrite(_pin, LOW);
-    if (updateOnOffTopic) { _conn->publish(_mqtt_topic, _off_value); }
+    if (updateOnOffTopic) { _conn->publish(_mqtt_topic, _off_value, mqtt_qos::AT_LEAST_ONCE, true); }
     log_info("OnOffSwitch %s turned OFF", _name.c_str());
 }
 
@@ -105,14 +105,15 @@ void OnOffSwitch::parse_action(etl::string<16> action_string) {
 
 
 
-DS18B20_temperature_sensors::DS18B20_temperature_sensors(Connection * conn, int pin, etl::string<64> mqtt_main_topic): _oneWire(pin), _sensors(&_oneWire) 
+DS18B20_temperature_sensors::DS18B20_temperature_sensors(Connection * conn, int pin, etl::string<64> mqtt_main_topic): _oneWire(pin), _sensors(&_oneWire),
+    _publish_work("ds18b20", [this](uint16_t step) { return(_publish_step(step)); })
 // dunno why this works, but initating DallasTemperature objects in contructor does not work
 {
     _conn = conn;
     _mqtt_main_topic = mqtt_main_topic;
     _numberOfDevices = 0;
     _mapSize = 0;
-    _getting_data = false;
+    _request_ms = 0;
 }
 
 uint8_t DS18B20_temperature_sensors::scanForSensors()
@@ -147,6 +148,11 @@ uint8_t DS18B20_temperature_sensors::scanForSensors()
     }
 
 
+    // register publish topics now that the device names are known
+    for (int i = 0; i < _numberOfDevices; i++) {
+        _deviceTopics[i] = _conn->register_topic(_mqtt_main_topic, _deviceNames[i]);
+    }
+
     // _sensors.requestTemperatures();
     return(_numberOfDevices);
 }
@@ -192,13 +198,38 @@ etl::string<24> DS18B20_temperature_sensors::getName(int deviceIndex) {
 
 void DS18B20_temperature_sensors::publishAllTemperatures()
 {
-   _getting_data = true;
-   _currentDevice = 0;
-   uint32_t request_start_time = millis();
-   _sensors.requestTemperatures();
-   uint32_t request_time_ms = millis() - request_start_time;
-   log_debug("Requested all DS18B20 in %dms", request_time_ms);
-}   
+    // published from tick() once the conversion is done
+    _publish_work.start();
+}
+
+work_step DS18B20_temperature_sensors::_publish_step(uint16_t step)
+{
+    if (step == 0) {
+        // start the conversion without waiting the up to 750ms it takes
+        _sensors.setWaitForConversion(false);
+        _sensors.requestTemperatures();
+        _sensors.setWaitForConversion(true);
+        _request_ms = millis();
+        return(work_step::NEXT);
+    }
+    if (step == 1) {
+        if (millis() - _request_ms < (uint32_t)_sensors.millisToWaitForConversion(_sensors.getResolution())) {
+            return(work_step::WAIT);
+        }
+        log_debug("Requested all DS18B20 in %lums", (unsigned long)(millis() - _request_ms));
+        return(work_step::NEXT);
+    }
+    uint16_t i = step - 2;
+    if (i >= _numberOfDevices) {
+        return(work_step::DONE);
+    }
+    float temperature = _sensors.getTempC(_deviceAddresses[i]);
+    etl::string<16> temperature_string;
+    temperature_string.assign(etl::to_string(temperature, temperature_string, etl::format_spec().precision(2)));
+    _conn->publish(_deviceTopics[i], temperature_string);
+    log_debug("%s: %.2fC", _deviceNames[i].c_str(), temperature);
+    return(work_step::NEXT);
+}
 
 
 float DS18B20_temperature_sensors::getTemperature(uint8_t deviceIndex) {
@@ -218,27 +249,8 @@ float DS18B20_temperature_sensors::getTemperatureByName(etl::string<24> deviceNa
     return(-201); // deviceName not found
 }
 
-void DS18B20_temperature_sensors::_get_sensor_data_nonblocking() {
-    int i = _currentDevice++;
-
-    etl::string<88> deviceMqttTopic(_mqtt_main_topic);
-    deviceMqttTopic += "/" ;
-    deviceMqttTopic += _deviceNames[i];
-    etl::string<16> temperature_string;
-    temperature_string.assign(etl::to_string(_sensors.getTempC(_deviceAddresses[i]), temperature_string, etl::format_spec().precision(2)));
-    _conn->publish(deviceMqttTopic, temperature_string);
-    log_debug("%s: %.2fC", _deviceNames[i].c_str(), _sensors.getTempC(_deviceAddresses[i]));
-
-    if (_currentDevice >= _numberOfDevices ) {
-        _getting_data = false;
-    }
-}
-
 void DS18B20_temperature_sensors::tick() {
-    if (_getting_data == true) {
-        _get_sensor_data_nonblocking();
-    }
-
+    _publish_work.tick();
 }
 
 InputMomentary::InputMomentary(
@@ -267,6 +279,7 @@ InputMomentary::InputMomentary(
     _state = InputMomentary::RESET;
     _last_state = InputMomentary::RESET;
     _last_debounce_time = 0;
+    _last_tick_ms = 0;
     _is_pressed = false;
     _is_released = false;
     _sticky_timer.set(0, 's');
@@ -320,7 +333,27 @@ void InputMomentary::press() {
     _virtual_press = true;
 }
 
+uint32_t InputMomentary::next_tick_ms() {
+    // time until tick() has work; waiting for a press or a release is polled
+    // slowly and relies on a GPIO wake
+    uint32_t elapsed = millis() - _last_tick_ms;
+    switch(_state) {
+        case InputMomentary::START:
+        case InputMomentary::HELD:
+            if (_virtual_press) {
+                return(0);
+            }
+            return((elapsed < INPUT_IDLE_POLL_MS) ? INPUT_IDLE_POLL_MS - elapsed : 0);
+        case InputMomentary::WAIT:
+            return(_debounce_timer.remaining());
+        case InputMomentary::STICKY:
+            return(_sticky_timer.remaining());
+    }
+    return(0);
+}
+
 void InputMomentary::tick() {
+    _last_tick_ms = millis();
     switch_value = _unpressed;
     if (_virtual_press == true) {
         switch_value = _pressed;
@@ -367,7 +400,7 @@ void InputMomentary::tick() {
             _hold_time_ms = millis();
             // Serial.println("Button pressed");
             _sticky_timer.reset();
-            _conn->publish(_mqtt_topic, _on_value);
+            _conn->publish(_mqtt_topic, _on_value, mqtt_qos::AT_LEAST_ONCE);
             _state = InputMomentary::HELD;
             break;
 
@@ -388,7 +421,7 @@ void InputMomentary::tick() {
         case InputMomentary::RELEASED:
             _is_sticky_held = false;
             _is_released = true;
-            _conn->publish(_mqtt_topic, _off_value);
+            _conn->publish(_mqtt_topic, _off_value, mqtt_qos::AT_LEAST_ONCE);
             _state = InputMomentary::RESET;
             break;
     }
@@ -397,7 +430,8 @@ void InputMomentary::tick() {
 
 
 
-HANreader::HANreader(Connection * conn, etl::string<MQTT_TOPIC_STRING_LENGTH> mqttTopic, uint8_t RXpin, uint8_t TXpin): serialHAN(1)
+HANreader::HANreader(Connection * conn, etl::string<MQTT_TOPIC_STRING_LENGTH> mqttTopic, uint8_t RXpin, uint8_t TXpin): serialHAN(1),
+    _publish_work("han", [this](uint16_t step) { return(_publish_step(step)); })
 {
     _RXpin = RXpin;
     _TXpin = TXpin;
@@ -409,6 +443,9 @@ HANreader::HANreader(Connection * conn, etl::string<MQTT_TOPIC_STRING_LENGTH> mq
 
 void HANreader::begin() {
     serialHAN.begin(2400, SERIAL_8N1, _RXpin, _TXpin);
+    for (size_t l = 0; l < han_lines.size(); l++) {
+        _han_line_topics[l] = _conn->register_topic(_mqttTopic, han_lines[l].subtopic);
+    }
     _last_byte_millis = 0;
     // _message = "";
     _message_buf_pos = 0;
@@ -419,6 +456,8 @@ void HANreader::end() {
 }
 
 void HANreader::tick() {
+    _publish_work.tick();
+
     uint32_t time_since_last_byte = millis() - _last_byte_millis;
 
     if ( time_since_last_byte > HAN_READ_TIMEOUT_MS && _message_buf_pos > 0 ) {
@@ -509,10 +548,10 @@ void HANreader::parse_message() {
         // String unit = "";
         // String subtopic = "";
         // String value_str = "";
-        _subtopic.clear();
         _value_string.clear();
 
-        size_t current_line_index;
+        size_t current_line_index = HAN_MAX_LINES;
+        _scratch_lines.clear();
 
         for (int line = 0; line < payload_lines; line++) {
             i += 4; // jump past type identifier in line
@@ -630,13 +669,12 @@ void HANreader::parse_message() {
                     etl::to_string(value_f, _value_string, etl::format_spec().precision(1));
                 }
             }
-            
-            _subtopic.clear();
-            _subtopic = _mqttTopic;
-            _subtopic += "/" ;
-            _subtopic += han_lines[current_line_index].subtopic;
 
-            _conn->publish(_subtopic, _value_string );
+            // published from tick() once the whole packet has been checked
+            if (current_line_index < han_lines.size() && ! _scratch_lines.full()) {
+                _scratch_values[current_line_index] = _value_string;
+                _scratch_lines.push_back(current_line_index);
+            }
         }
 
         // checking packet checksum
@@ -651,23 +689,60 @@ void HANreader::parse_message() {
         
         if (_message[i] != 0x7e) {
             log_warning("No end flag found. Instead found: %0x. Dropping packet", _message[i]);
+            return;
+        }
+        // values of a run in progress are not touched, this message is dropped
+        if ( ! _publish_work.start()) {
+            log_debug("HAN message dropped, still publishing the last one");
+            return;
+        }
+        _parsed_lines = _scratch_lines;
+        for (uint8_t line : _parsed_lines) {
+            _line_values[line] = _scratch_values[line];
         }
     }
 }
 
+work_step HANreader::_publish_step(uint16_t step)
+{
+    if (step >= _parsed_lines.size()) {
+        return(work_step::DONE);
+    }
+    uint8_t line = _parsed_lines[step];
+    _conn->publish(_han_line_topics[line], _line_values[line]);
+    return(work_step::NEXT);
+}
 
-VEdirectReader::VEdirectReader(Connection * conn, etl::string<MQTT_TOPIC_STRING_LENGTH> mqttTopic, uint8_t RXpin, uint8_t TXpin): serialVE(2)
+
+VEdirectReader::VEdirectReader(Connection * conn, etl::string<MQTT_TOPIC_STRING_LENGTH> mqttTopic, uint8_t RXpin, uint8_t TXpin): serialVE(2),
+    _publish_work("vedirect", [this](uint16_t step) { return(_publish_step(step)); })
 {
     _RXpin = RXpin;
     _TXpin = TXpin;
     _conn = conn;
     _mqttTopic = mqttTopic;
+    _publish_interval_s = 0;
+    _sample_every_ms = 0;
+    _sample_window_ms = 0;
+    _window_start_ms = 0;
+    _last_tick_ms = 0;
 }
 
 void VEdirectReader::begin() {
     serialVE.begin(19200, SERIAL_8N1, _RXpin, _TXpin); // for hardwareserial
     _send_raw_data_timer.set(100, 's');
-    set_publish_timer_s(5);
+    _voltage_topic = _conn->register_topic(_mqttTopic, "battery_voltage_V");
+    _soc_by_v_topic = _conn->register_topic(_mqttTopic, "soc_by_v");
+    _current_topic = _conn->register_topic(_mqttTopic, "current_I");
+    _power_topic = _conn->register_topic(_mqttTopic, "power_W");
+    _soc_topic = _conn->register_topic(_mqttTopic, "soc_%");
+    _pv_voltage_topic = _conn->register_topic(_mqttTopic, "pv_voltage_V");
+    _pv_power_topic = _conn->register_topic(_mqttTopic, "pv_power_W");
+    _yield_total_topic = _conn->register_topic(_mqttTopic, "yield_total_kWh");
+    _yield_today_topic = _conn->register_topic(_mqttTopic, "yield_today_kWh");
+    _max_power_today_topic = _conn->register_topic(_mqttTopic, "max_power_today_W");
+    _yield_yesterday_topic = _conn->register_topic(_mqttTopic, "yield_yesterday_kWh");
+    _max_power_yesterday_topic = _conn->register_topic(_mqttTopic, "max_power_yesterday_W");
     _last_byte_millis = 0;
     _message.clear();
     _voltage_V = 0;
@@ -696,6 +771,20 @@ void VEdirectReader::end() {
 }
 
 void VEdirectReader::tick() {
+    _last_tick_ms = millis();
+    if ( _sample_every_ms > 0 && millis() - _window_start_ms >= _sample_every_ms ) {
+        // new window, what arrived before it is incomplete
+        _window_start_ms = millis();
+        while ( serialVE.available() > 0 ) {
+            serialVE.read();
+        }
+        _message.clear();
+    }
+    if ( _publish_interval_s > 0 && _publish_data_timer.is_done() ) {
+        publish_data();
+    }
+    _publish_work.tick();
+
     uint32_t time_since_last_byte = millis() - _last_byte_millis;
 
     if ( time_since_last_byte > VEDIRECT_TIMEOUT_MS && !_message.empty() ) {
@@ -705,7 +794,8 @@ void VEdirectReader::tick() {
         // _message_buf_pos = 0;
     }
 
-    if ( serialVE.available() > 0 ) {
+    // drain everything received, tick() may run only every few tens of ms
+    while ( is_listening() && serialVE.available() > 0 ) {
         char recv_char = serialVE.read();
         _last_byte_millis = millis(); // reset timeout counter
         _message += recv_char;
@@ -713,55 +803,88 @@ void VEdirectReader::tick() {
     }
 }
 
+void VEdirectReader::set_sample_window(uint32_t every_ms, uint32_t window_ms) {
+    // only read the UART for window_ms every every_ms, for a chip that sleeps
+    // in between and cannot be woken by this UART. 0 listens all the time
+    _sample_every_ms = every_ms;
+    _sample_window_ms = window_ms;
+    _window_start_ms = millis() - every_ms; // first window on the next tick()
+}
+
+bool VEdirectReader::is_listening() {
+    return(_sample_every_ms == 0 || millis() - _window_start_ms < _sample_window_ms);
+}
+
+uint32_t VEdirectReader::next_tick_ms() {
+    // time until tick() has work: reading the UART while listening, then
+    // parsing the last message, the next window and the next publish
+    if ( _publish_work.is_running() ) {
+        return(0);
+    }
+    uint32_t now = millis();
+    if ( is_listening() ) {
+        uint32_t elapsed = now - _last_tick_ms;
+        return((elapsed < VEDIRECT_POLL_MS) ? VEDIRECT_POLL_MS - elapsed : 0);
+    }
+    uint32_t elapsed = now - _window_start_ms;
+    uint32_t next = (elapsed < _sample_every_ms) ? _sample_every_ms - elapsed : 0;
+    if ( ! _message.empty() ) {
+        uint32_t quiet = now - _last_byte_millis;
+        uint32_t parse_in = (quiet <= VEDIRECT_TIMEOUT_MS) ? VEDIRECT_TIMEOUT_MS + 1 - quiet : 0;
+        if ( parse_in < next ) { next = parse_in; }
+    }
+    if ( _publish_interval_s > 0 && _publish_data_timer.remaining() < next ) {
+        next = _publish_data_timer.remaining();
+    }
+    return(next);
+}
+
 void VEdirectReader::set_publish_timer_s(u_int16_t seconds) {
+    // publish_data() every few seconds from tick(), 0 turns it off
+    _publish_interval_s = seconds;
     _publish_data_timer.set(seconds, 's');
 }
 
-void VEdirectReader::publish_float(etl::string<16> subtopic, float value, uint8_t decimal_places) {
+void VEdirectReader::publish_float(topic_handle_t topic, float value, uint8_t decimal_places) {
     auto format_spec = etl::format_spec().precision(decimal_places);
     etl::string<16> number_buffer;
-    etl::string<MQTT_TOPIC_STRING_LENGTH + 16> topic(_mqttTopic);
-    topic += "/";
-    topic += subtopic;
     etl::to_string(value, number_buffer, format_spec);
     _conn->publish(topic, number_buffer);
 }
 
 void VEdirectReader::publish_data() {
-    if (_voltage_is_set) {
-        publish_float("battery_voltage_V", _voltage_V, 2);
-        publish_float("soc_by_v", _soc_by_v, 1);
-    }
-    if (_current_is_set) {
-        publish_float("current_I", _current_A, 2);
-    }
-    if (_power_is_set) {
-        publish_float("power_W", _power_W, 0);
-    }
-    if (_soc_is_set) {
-        publish_float("soc_%", _soc, 1);
-    }
-    if (_pv_voltage_is_set) {
-        publish_float("pv_voltage_V", _pv_voltage_V, 2);
-    }
-    if (_pv_power_is_set) {
-        publish_float("pv_power_W", _pv_power_W, 0);
-    }
-    if (_yield_total_is_set) {
-        publish_float("yield_total_kWh", _yield_total_kWh, 2);
-    }
-    if (_yield_today_is_set) {
-        publish_float("yield_today_kWh", _yield_today_kWh, 2);
-    }
-    if (_max_power_today_is_set) {
-        publish_float("max_power_today_W", _max_power_today_W, 0);
-    }
-    if (_yield_yesterday_is_set) {
-        publish_float("yield_yesterday_kWh", _yield_yesterday_kWh, 2);
+    // published from tick(), a few values at a time
+    _publish_work.start();
+}
+
+work_step VEdirectReader::_publish_step(uint16_t step)
+{
+    const struct {
+        topic_handle_t topic;
+        float value;
+        bool is_set;
+        uint8_t decimal_places;
+    } values[] = {
+        {_voltage_topic, _voltage_V, _voltage_is_set, 2},
+        {_soc_by_v_topic, _soc_by_v, _voltage_is_set, 1},
+        {_current_topic, _current_A, _current_is_set, 2},
+        {_power_topic, _power_W, _power_is_set, 0},
+        {_soc_topic, _soc, _soc_is_set, 1},
+        {_pv_voltage_topic, _pv_voltage_V, _pv_voltage_is_set, 2},
+        {_pv_power_topic, _pv_power_W, _pv_power_is_set, 0},
+        {_yield_total_topic, _yield_total_kWh, _yield_total_is_set, 2},
+        {_yield_today_topic, _yield_today_kWh, _yield_today_is_set, 2},
+        {_max_power_today_topic, _max_power_today_W, _max_power_today_is_set, 0},
+        {_yield_yesterday_topic, _yield_yesterday_kWh, _yield_yesterday_is_set, 2},
+        {_max_power_yesterday_topic, _max_power_yesterday_W, _max_power_yesterday_is_set, 0},
+    };
+    if (step >= sizeof(values) / sizeof(values[0])) {
+        return(work_step::DONE);
     }
-    if (_max_power_yesterday_is_set) {
-        publish_float("max_power_yesterday_W", _max_power_yesterday_W, 0);
+    if (values[step].is_set) {
+        publish_float(values[step].topic, values[step].value, values[step].decimal_places);
     }
+    return(work_step::NEXT);
 }
 
 void VEdirectReader::parse_message() {
@@ -959,14 +1082,14 @@ void Thermostat::tick() {
                 log_info("Start cooling");
                 log_debug("T: %.1f°C [%.1f°C, %.1f°C] cooling: %d", current_temperature, _min_temperature_C, _max_temperature_C, _is_cooling);
                 digitalWrite(_relay_pin, HIGH);
-                _conn->publish(_mqtt_cooling_state_topic, "1");
+                _conn->publish(_mqtt_cooling_state_topic, "1", mqtt_qos::AT_LEAST_ONCE, true);
             }
             else {
                 // Stopp cooling, open relay
                 log_info("Stopped cooling");
                 log_debug("T: %.1f°C [%.1f°C, %.1f°C] cooling: %d", current_temperature, _min_temperature_C, _max_temperature_C, _is_cooling);
                 digitalWrite(_relay_pin, LOW);
-                _conn->publish(_mqtt_cooling_state_topic, "0");
+                _conn->publish(_mqtt_cooling_state_topic, "0", mqtt_qos::AT_LEAST_ONCE, true);
             }
         }
     }
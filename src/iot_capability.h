@@ -4,6 +4,7 @@
 #include "logging.h"
 #include "mqttConnection.h"
 #include "timer.h"
+#include "work_item.h"
 #include <OneWire.h>
 #include <DallasTemperature.h>
 #include <HardwareSerial.h>
@@ -12,7 +13,6 @@
 #include <etl/to_string.h>
 #include <etl/to_arithmetic.h>
 
-#define MQTT_TOPIC_STRING_LENGTH 64
 #define MQTT_PAYLOAD_STRING_LENGTH 256
 
 class OnOffSwitch
@@ -71,16 +71,19 @@ class DS18B20_temperature_sensors
         DeviceAddress _deviceAddresses[127];
         etl::string<32> _deviceNames[127];
         uint8_t _numberOfDevices;
-        uint8_t _currentDevice;
         etl::string<32> _name;
         etl::string<MQTT_TOPIC_STRING_LENGTH> _mqtt_main_topic;
         etl::string<24> _addressMap[127];
         etl::string<24> _nameMap[127];
+        topic_handle_t _deviceTopics[127];
         size_t _mapSize;
-        void _get_sensor_data_nonblocking();
-        bool _getting_data;
+        WorkItem _publish_work;         // request, wait for the conversion, then one sensor per step
+        uint32_t _request_ms;
+        work_step _publish_step(uint16_t step);
 };
 
+#define INPUT_IDLE_POLL_MS 1000 // digital inputs also need a GPIO wake to be seen sooner
+
 class InputMomentary {
     public:
         InputMomentary(
@@ -95,6 +98,7 @@ class InputMomentary {
             etl::string<8> off_value = "false");
         void begin();
         void tick();
+        uint32_t next_tick_ms();
         bool is_pressed();
         bool is_held();
         bool is_released();
@@ -133,6 +137,7 @@ class InputMomentary {
         int _state;
         int _last_state;
         u_int32_t _last_debounce_time;
+        u_int32_t _last_tick_ms;
         u_int32_t _hold_time_ms;
         Timer _debounce_timer;
         Timer _sticky_timer;
@@ -147,6 +152,7 @@ class InputMomentary {
 
 #define HAN_READ_TIMEOUT_MS 100
 #define HAN_MAX_MESSAGE_SIZE 512
+#define HAN_MAX_LINES 20
 
 class HANreader {
     public:
@@ -190,7 +196,7 @@ class HANreader {
         han_line cum_reactive_import {.obis_code = { 0x01, 0x00, 0x03, 0x08, 0x00, 0xff }, .name="Cummulative reactive import", .unit="kVArh", .subtopic="cum_reactive_import_kVArh"  };
         han_line cum_reactive_export {.obis_code = { 0x01, 0x00, 0x04, 0x08, 0x00, 0xff }, .name="Cummulative reactive export", .unit="kVArh", .subtopic="cum_reactive_export_kVArh"  };
 
-        etl::vector<han_line, 20> han_lines = {version, id, type, active_import, active_export, reactive_import, reactive_export, current_L1, current_L2, current_L3, 
+        etl::vector<han_line, HAN_MAX_LINES> han_lines = {version, id, type, active_import, active_export, reactive_import, reactive_export, current_L1, current_L2, current_L3, 
                             voltage_L1, voltage_L2, voltage_L3, meter_clock, cum_active_import, cum_active_export, cum_reactive_import, cum_reactive_export };
         // _no_han_lines = 18;
 
@@ -198,6 +204,7 @@ class HANreader {
         Connection * _conn;
         etl::string<MQTT_TOPIC_STRING_LENGTH> _mqttTopic;
         etl::string<MQTT_TOPIC_STRING_LENGTH> _han_hex_topic;
+        topic_handle_t _han_line_topics[HAN_MAX_LINES];
         uint8_t _RXpin;
         uint8_t _TXpin;
         int16_t _state;
@@ -214,10 +221,16 @@ class HANreader {
         bool _match_sequence(uint16_t);
         // u_int16_t _no_han_lines;
         etl::string<32> _value_string;
-        etl::string<88> _subtopic;
+        etl::string<32> _line_values[HAN_MAX_LINES];
+        etl::vector<uint8_t, HAN_MAX_LINES> _parsed_lines;     // han_lines indexes in the last message
+        etl::string<32> _scratch_values[HAN_MAX_LINES];         // message being parsed, not yet checked
+        etl::vector<uint8_t, HAN_MAX_LINES> _scratch_lines;
+        WorkItem _publish_work;                                 // one line per step
+        work_step _publish_step(uint16_t step);
 };
 
 #define VEDIRECT_TIMEOUT_MS 100
+#define VEDIRECT_POLL_MS 50 // while listening, the UART buffer holds about 130 ms at 19200 baud
 #define VEDIRECT_MESSAGE_SIZE 2000
 #define VEDIRECT_NUMBER_KEYS_TO_PARSE 20
 class VEdirectReader {
@@ -229,8 +242,11 @@ class VEdirectReader {
         HardwareSerial serialVE;
         void parse_message();
         void set_publish_timer_s(u_int16_t seconds);
+        void set_sample_window(uint32_t every_ms, uint32_t window_ms);
+        bool is_listening();
+        uint32_t next_tick_ms();
         void publish_data();
-        void publish_float(etl::string<16> subtopic, float value, uint8_t decimal_places);
+        void publish_float(topic_handle_t topic, float value, uint8_t decimal_places);
 
     private:
         Connection * _conn;
@@ -245,6 +261,25 @@ class VEdirectReader {
         uint32_t _last_byte_millis;
         Timer _send_raw_data_timer;
         Timer _publish_data_timer;
+        u_int16_t _publish_interval_s;
+        uint32_t _sample_every_ms;  // 0 listens all the time
+        uint32_t _sample_window_ms;
+        uint32_t _window_start_ms;
+        uint32_t _last_tick_ms;
+        WorkItem _publish_work;     // one value per step
+        work_step _publish_step(uint16_t step);
+        topic_handle_t _voltage_topic;
+        topic_handle_t _soc_by_v_topic;
+        topic_handle_t _current_topic;
+        topic_handle_t _power_topic;
+        topic_handle_t _soc_topic;
+        topic_handle_t _pv_voltage_topic;
+        topic_handle_t _pv_power_topic;
+        topic_handle_t _yield_total_topic;
+        topic_handle_t _yield_today_topic;
+        topic_handle_t _max_power_today_topic;
+        topic_handle_t _yield_yesterday_topic;
+        topic_handle_t _max_power_yesterday_topic;
         float _voltage_V;
         float _current_A;
         float _power_W;
@@ -1,12 +1,68 @@
 #include <logging.h>
 #include <mqttConnection.h>
+#include <wall_clock.h>
 
-extern Connection conn;
+// connection log messages are published on, nullptr logs to serial only
+static Connection * log_connection = nullptr;
+
+// the app task and the network tasks log at the same time; recursive
+// because publishing a log line may log again from the same task.
+// Created on the first log line, before setup() starts any other task.
+static SemaphoreHandle_t log_mutex = nullptr;
+
+static void lock_log() {
+    if (log_mutex == nullptr) {
+        log_mutex = xSemaphoreCreateRecursiveMutex();
+    }
+    xSemaphoreTakeRecursive(log_mutex, portMAX_DELAY);
+}
+
+static void unlock_log() {
+    xSemaphoreGiveRecursive(log_mutex);
+}
 
 void set_log_level(log_severity new_log_level) {
     log_level = new_log_level;
 }
 
+void set_log_connection(Connection * connection) {
+    log_connection = connection;
+}
+
+Connection * get_log_connection() {
+    return(log_connection);
+}
+
+// set while a correlated command runs
+static Connection * response_connection = nullptr;
+static etl::string<RESPONSE_CORRELATION_LENGTH> response_correlation;
+
+void begin_response(Connection * connection, etl::string_view correlation) {
+    response_connection = connection;
+    response_correlation.assign(correlation.begin(), correlation.end());
+}
+
+void end_response(bool success) {
+    if (response_connection == nullptr) {
+        return;
+    }
+    response_connection->publish_response(response_correlation, success ? "END" : "END ERROR");
+    detach_response();
+}
+
+void detach_response() {
+    response_connection = nullptr;
+    response_correlation.clear();
+}
+
+Connection * get_response_connection() {
+    return(response_connection);
+}
+
+etl::string_view get_response_correlation() {
+    return(etl::string_view(response_correlation.data(), response_correlation.size()));
+}
+
 void log(etl::string<LOG_STRING_LENGTH> message, log_severity severity, bool only_serial, bool store_in_nvm) {
     // Sends message to mqtt and serial (if not flag is set to false)
     // can also store log message in nvm log if flag is set
@@ -16,10 +72,10 @@ void log(etl::string<LOG_STRING_LENGTH> message, log_severity severity, bool onl
         return;
     }
 
-    uint32_t ms = millis();
-    float seconds = (float)ms/1000.0;
-
-    etl::to_string(seconds, timestamp, etl::format_spec().precision(1), false);
+    // wall clock time when NTP has synced, seconds since boot before that
+    etl::string<24> timestamp;
+    wall_clock.get_log_timestamp(timestamp);
+    etl::string<LOG_STRING_LENGTH + 15> modified_log_message;
 
     switch (severity) {
         case log_severity::DEBUG: {
@@ -56,22 +112,22 @@ void log(etl::string<LOG_STRING_LENGTH> message, log_severity severity, bool onl
 
     modified_log_message.append(message);
 
+    lock_log();
     Serial.println(modified_log_message.c_str());
     
-    if (!only_serial && conn.is_connected() ) {
-        conn.publish_log(modified_log_message );
-        conn.loop_mqtt();
+    if (!only_serial && log_connection != nullptr && log_connection->is_connected() ) {
+        log_connection->publish_log(modified_log_message );
+        log_connection->loop_mqtt();
     }
+    unlock_log();
 
     if (store_in_nvm) {
         // TODO: Store in NVM
     }
-
-    modified_log_message.clear();
-    timestamp.clear();
 }
 
 void log_debug(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
@@ -81,6 +137,7 @@ void log_debug(const char* format, ...) {
 }
 
 void log_info(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
@@ -90,6 +147,7 @@ void log_info(const char* format, ...) {
 }
 
 void log_warning(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
@@ -99,6 +157,7 @@ void log_warning(const char* format, ...) {
 }
 
 void log_error(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
@@ -108,6 +167,7 @@ void log_error(const char* format, ...) {
 }
 
 void log_critical(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
@@ -117,8 +177,20 @@ void log_critical(const char* format, ...) {
 }
 
 void log_response(const char* format, ...) {
+    char buffer[LOG_STRING_LENGTH];
     va_list args;
     va_start(args, format);
+    if (response_connection != nullptr) {
+        // correlated command: no log prefix and room for longer lines
+        char response[RESPONSE_STRING_LENGTH];
+        vsnprintf(response, RESPONSE_STRING_LENGTH, format, args);
+        va_end(args);
+        lock_log();
+        Serial.println(response);
+        response_connection->publish_response(response_correlation, response);
+        unlock_log();
+        return;
+    }
     vsnprintf(buffer, LOG_STRING_LENGTH, format, args);
     va_end(args);
 
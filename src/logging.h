@@ -2,12 +2,15 @@
 
 #include <Arduino.h>
 #include <etl/string.h>
+#include <etl/string_view.h>
 #include <etl/to_arithmetic.h>
 #include <etl/to_string.h>
 #include <cstdio>
 #include <cstdarg>
 
 #define LOG_STRING_LENGTH 100
+#define RESPONSE_STRING_LENGTH 240
+#define RESPONSE_CORRELATION_LENGTH 16
 
 enum class log_severity : uint8_t {
     DEBUG,
@@ -20,11 +23,22 @@ enum class log_severity : uint8_t {
 
 static log_severity log_level = log_severity::INFO;
 
-void set_log_level(log_severity new_log_level);
+class Connection;
 
-static etl::string<LOG_STRING_LENGTH + 15> modified_log_message; 
-static etl::string<24> timestamp; 
-static char buffer[LOG_STRING_LENGTH];
+void set_log_level(log_severity new_log_level);
+void set_log_connection(Connection * connection);
+Connection * get_log_connection();
+
+// While a correlated command runs, log_response() publishes "<correlation>|<line>"
+// on <topic>/response of the given connection instead of the log topic.
+// end_response() sends the completion marker "<correlation>|END" (or "END ERROR").
+// A command that continues as a job detaches from the response and the job
+// begins it again for each of its slices.
+void begin_response(Connection * connection, etl::string_view correlation);
+void end_response(bool success);
+void detach_response();
+Connection * get_response_connection();
+etl::string_view get_response_correlation();
 
 void log(
     etl::string<LOG_STRING_LENGTH> message, 
@@ -0,0 +1,404 @@
+#include "loop_scheduler.h"
+#include <WiFi.h>
+#include <esp_idf_version.h>
+#include <esp_sleep.h>
+#include <driver/uart.h>
+#include <driver/gpio.h>
+#include <hal/gpio_ll.h>
+#include <lwip/sockets.h>
+#include "logging.h"
+
+#if ESP_IDF_VERSION_MAJOR >= 5
+typedef esp_pm_config_t pm_config_t;
+#elif CONFIG_IDF_TARGET_ESP32S3
+typedef esp_pm_config_esp32s3_t pm_config_t;
+#else
+typedef esp_pm_config_esp32_t pm_config_t;
+#endif
+
+LoopScheduler::LoopScheduler()
+{
+    _socket_component = LOOP_SCHEDULER_NONE;
+    _socket_task = nullptr;
+    _watched_fd = -1;
+    _socket_watching = false;
+    _task = nullptr;
+    _woken = 0;
+    _awake_until_ms = 0;
+    _light_sleep = false;
+    _awake_held = false;
+    _awake_lock = nullptr;
+    _busy_us = 0;
+    _idle_us = 0;
+    _stats_start_ms = 0;
+}
+
+void LoopScheduler::begin()
+{
+    // call from setup(), wake sources notify the task that runs loop()
+    _task = xTaskGetCurrentTaskHandle();
+    _stats_start_ms = millis();
+}
+
+component_id_t LoopScheduler::add(const char * name, std::function<void()> tick, uint32_t interval_ms, uint32_t budget_us)
+{
+    LoopComponent component = {};
+    component.name = name;
+    component.tick = tick;
+    component.interval_ms = interval_ms;
+    component.stats.budget_us = budget_us;
+    return(_add(component));
+}
+
+component_id_t LoopScheduler::add(const char * name, std::function<void()> tick, std::function<uint32_t()> due_in_ms, uint32_t budget_us)
+{
+    LoopComponent component = {};
+    component.name = name;
+    component.tick = tick;
+    component.due_in_ms = due_in_ms;
+    component.stats.budget_us = budget_us;
+    return(_add(component));
+}
+
+component_id_t LoopScheduler::_add(const LoopComponent & component)
+{
+    if (_components.full()) {
+        log_error("Loop scheduler full, %s not added", component.name);
+        return(LOOP_SCHEDULER_NONE);
+    }
+    _components.push_back(component);
+    _components.back().next_run_ms = millis(); // first run on the next tick()
+    return(_components.size() - 1);
+}
+
+bool LoopScheduler::wake_on_gpio(component_id_t id, uint8_t pin)
+{
+    if (id >= _components.size() || _wake_sources.full()) {
+        log_error("Cannot add GPIO %d as wake source", pin);
+        return(false);
+    }
+    _wake_sources.push_back({this, id, -1, pin, false});
+    attachInterruptArg(pin, &LoopScheduler::_on_gpio, &_wake_sources.back(), CHANGE);
+    if (_light_sleep) {
+        esp_sleep_enable_gpio_wakeup();
+    }
+    return(true);
+}
+
+bool LoopScheduler::wake_on_uart(component_id_t id, HardwareSerial & serial, uint8_t uart_num)
+{
+    // register after serial.begin()
+    if (id >= _components.size() || _wake_sources.full()) {
+        log_error("Cannot add UART %d as wake source", uart_num);
+        return(false);
+    }
+    _wake_sources.push_back({this, id, (int8_t)uart_num, 0, false});
+    serial.onReceive([this, id, uart_num]() {
+        // UART event task. Other UARTs than 0 and 1 cannot wake the chip, and
+        // holding it awake for them would keep it out of light sleep for good
+        if (uart_num <= 1) {
+            stay_awake_for(LOOP_SCHEDULER_UART_AWAKE_MS);
+        }
+        wake(id);
+    });
+    if (_light_sleep) {
+        _enable_uart_wakeup(uart_num);
+    }
+    return(true);
+}
+
+bool LoopScheduler::wake_on_socket(component_id_t id, std::function<int()> socket_fd, std::function<bool()> has_buffered_input)
+{
+    // one socket, usually the MQTT broker connection. socket_fd() is only
+    // called from the loop task, which owns the connection
+    if (id >= _components.size() || _socket_task != nullptr) {
+        return(false);
+    }
+    _socket_fd = socket_fd;
+    _socket_buffered = has_buffered_input;
+    _socket_component = id;
+    BaseType_t created = xTaskCreate(&LoopScheduler::_socket_task_main, "loop_socket",
+        LOOP_SCHEDULER_SOCKET_TASK_STACK, this, uxTaskPriorityGet(nullptr), &_socket_task);
+    if (created != pdPASS) {
+        _socket_task = nullptr;
+        _socket_component = LOOP_SCHEDULER_NONE;
+        log_error("Could not start the loop socket task");
+        return(false);
+    }
+    return(true);
+}
+
+void LoopScheduler::_socket_task_main(void * parameter)
+{
+    LoopScheduler * scheduler = static_cast<LoopScheduler *>(parameter);
+    for (;;) {
+        // started by _watch_socket() when the loop goes idle
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int fd = scheduler->_watched_fd;
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(fd, &readable);
+        struct timeval timeout;
+        timeout.tv_sec = LOOP_SCHEDULER_SOCKET_WATCH_MS / 1000;
+        timeout.tv_usec = 0;
+        int ready = select(fd + 1, &readable, nullptr, nullptr, &timeout);
+        scheduler->_socket_watching = false;
+        if (ready > 0) {
+            scheduler->wake(scheduler->_socket_component);
+        }
+    }
+}
+
+void LoopScheduler::_watch_socket()
+{
+    if (_socket_task == nullptr || _socket_watching) {
+        return;
+    }
+    int fd = _socket_fd();
+    if (fd < 0) {
+        return; // disconnected, the component's interval covers reconnects
+    }
+    _watched_fd = fd;
+    _socket_watching = true;
+    xTaskNotifyGive(_socket_task);
+}
+
+void LoopScheduler::stay_awake_for(uint32_t ms)
+{
+    // callable from any task, only ever extends the time
+    uint32_t until_ms = millis() + ms;
+    if ((int32_t)(until_ms - _awake_until_ms) > 0) {
+        _awake_until_ms = until_ms;
+    }
+}
+
+void LoopScheduler::wake(component_id_t id)
+{
+    // run the component on the next tick(), callable from any task
+    if (id >= _components.size()) {
+        return;
+    }
+    __atomic_fetch_or(&_woken, 1UL << id, __ATOMIC_RELAXED);
+    if (_task != nullptr) {
+        xTaskNotifyGive(_task);
+    }
+}
+
+void IRAM_ATTR LoopScheduler::_on_gpio(void * arg)
+{
+    WakeSource * source = static_cast<WakeSource *>(arg);
+    LoopScheduler * scheduler = source->scheduler;
+    if (source->armed) {
+        // back to edges, the wakeup level would keep interrupting
+        gpio_ll_set_intr_type(&GPIO, (gpio_num_t)source->pin, GPIO_INTR_ANYEDGE);
+        source->armed = false;
+    }
+    __atomic_fetch_or(&scheduler->_woken, 1UL << source->id, __ATOMIC_RELAXED);
+    if (scheduler->_task != nullptr) {
+        BaseType_t higher_priority_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(scheduler->_task, &higher_priority_woken);
+        if (higher_priority_woken) {
+            portYIELD_FROM_ISR();
+        }
+    }
+}
+
+bool LoopScheduler::enable_light_sleep(uint16_t max_mhz, uint16_t min_mhz)
+{
+#if CONFIG_PM_ENABLE
+    pm_config_t config = {};
+    config.max_freq_mhz = max_mhz;
+    config.min_freq_mhz = min_mhz;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+    config.light_sleep_enable = true;
+#else
+    log_warning("Tickless idle not enabled, only lowering the CPU clock when idle");
+#endif
+    esp_err_t result = esp_pm_configure(&config);
+    if (result != ESP_OK) {
+        log_error("Power management not configured: %s", esp_err_to_name(result));
+        return(false);
+    }
+    if (_awake_lock == nullptr && esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "loop_uart", &_awake_lock) != ESP_OK) {
+        _awake_lock = nullptr;
+    }
+    // modem sleep keeps the WiFi association between DTIM beacons
+    WiFi.setSleep(true);
+    _light_sleep = true;
+    for (WakeSource & source : _wake_sources) {
+        if (source.uart_num >= 0) {
+            _enable_uart_wakeup(source.uart_num);
+        }
+        else {
+            esp_sleep_enable_gpio_wakeup();
+        }
+    }
+    log_info("Light sleep enabled, CPU %u-%u MHz", min_mhz, max_mhz);
+    return(true);
+#else
+    log_warning("Built without CONFIG_PM_ENABLE, the loop only yields when idle");
+    return(false);
+#endif
+}
+
+void LoopScheduler::_enable_uart_wakeup(uint8_t uart_num)
+{
+    // the ESP32 wakes on UART0 and UART1 only, the waking characters are lost;
+    // traffic on other UARTs is only seen while something else keeps it awake
+    if (uart_num > 1) {
+        return;
+    }
+    uart_set_wakeup_threshold((uart_port_t)uart_num, LOOP_SCHEDULER_UART_WAKE_EDGES);
+    esp_sleep_enable_uart_wakeup(uart_num);
+}
+
+void LoopScheduler::_arm_gpio_wakeup(bool arm)
+{
+    // light sleep only wakes on a GPIO level, so wait for the level opposite
+    // to the current one; _on_gpio() restores the edge interrupt when it fires
+    for (WakeSource & source : _wake_sources) {
+        if (source.uart_num >= 0) {
+            continue;
+        }
+        gpio_num_t pin = (gpio_num_t)source.pin;
+        if (arm) {
+            source.armed = true;
+            gpio_wakeup_enable(pin, digitalRead(source.pin) ? GPIO_INTR_LOW_LEVEL : GPIO_INTR_HIGH_LEVEL);
+        }
+        else {
+            gpio_wakeup_disable(pin);
+            gpio_set_intr_type(pin, GPIO_INTR_ANYEDGE);
+            source.armed = false;
+        }
+    }
+}
+
+void LoopScheduler::_hold_awake()
+{
+    // UART RX is lost in light sleep, stay awake while stay_awake_for() asks
+    if (_awake_lock == nullptr) {
+        return;
+    }
+    bool active = (int32_t)(_awake_until_ms - millis()) > 0;
+    if (active && ! _awake_held) {
+        esp_pm_lock_acquire(_awake_lock);
+        _awake_held = true;
+    }
+    else if ( ! active && _awake_held) {
+        esp_pm_lock_release(_awake_lock);
+        _awake_held = false;
+    }
+}
+
+uint32_t LoopScheduler::_due_in_ms(LoopComponent & component)
+{
+    if (component.due_in_ms) {
+        return(component.due_in_ms());
+    }
+    int32_t left = (int32_t)(component.next_run_ms - millis());
+    return((left > 0) ? left : 0);
+}
+
+void LoopScheduler::tick()
+{
+    // call from loop(), runs what is due and then waits for the next deadline
+    uint32_t woken = __atomic_exchange_n(&_woken, 0, __ATOMIC_RELAXED);
+    for (component_id_t id = 0; id < _components.size(); id++) {
+        LoopComponent & component = _components[id];
+        bool is_woken = (woken & (1UL << id)) != 0;
+        if ( ! is_woken && _due_in_ms(component) > 0 ) {
+            continue;
+        }
+        uint32_t start_us = micros();
+        component.tick();
+        uint32_t elapsed_us = micros() - start_us;
+        component.next_run_ms = millis() + component.interval_ms;
+        if (id == _socket_component && _socket_buffered && _socket_buffered()) {
+            // already read from the socket, select() would not report it
+            __atomic_fetch_or(&_woken, 1UL << id, __ATOMIC_RELAXED);
+        }
+
+        LoopComponentStats & stats = component.stats;
+        stats.runs++;
+        if (is_woken) { stats.woken++; }
+        stats.total_us += elapsed_us;
+        if (elapsed_us > stats.max_us) { stats.max_us = elapsed_us; }
+        if (stats.budget_us > 0 && elapsed_us > stats.budget_us) { stats.overruns++; }
+        _busy_us += elapsed_us;
+    }
+    _hold_awake();
+
+    uint32_t wait_ms = LOOP_SCHEDULER_MAX_IDLE_MS;
+    for (LoopComponent & component : _components) {
+        uint32_t due_in_ms = _due_in_ms(component);
+        if (due_in_ms < wait_ms) {
+            wait_ms = due_in_ms;
+        }
+    }
+    if (_awake_held) {
+        // come back to release the lock when the time is up
+        int32_t awake_ms = (int32_t)(_awake_until_ms - millis());
+        if (awake_ms > 0 && (uint32_t)awake_ms < wait_ms) {
+            wait_ms = awake_ms;
+        }
+    }
+    if (wait_ms > 0 && _woken == 0) {
+        _watch_socket();
+        _idle(wait_ms);
+    }
+}
+
+void LoopScheduler::_idle(uint32_t wait_ms)
+{
+    uint32_t start_us = micros();
+    if (_light_sleep) {
+        _arm_gpio_wakeup(true);
+    }
+    TickType_t ticks = pdMS_TO_TICKS(wait_ms);
+    ulTaskNotifyTake(pdTRUE, (ticks > 0) ? ticks : 1);
+    if (_light_sleep) {
+        _arm_gpio_wakeup(false);
+    }
+    _idle_us += micros() - start_us;
+}
+
+LoopComponentStats LoopScheduler::get_stats(component_id_t id)
+{
+    if (id >= _components.size()) {
+        return(LoopComponentStats());
+    }
+    return(_components[id].stats);
+}
+
+void LoopScheduler::reset_stats()
+{
+    for (LoopComponent & component : _components) {
+        uint32_t budget_us = component.stats.budget_us;
+        component.stats = LoopComponentStats();
+        component.stats.budget_us = budget_us;
+    }
+    _busy_us = 0;
+    _idle_us = 0;
+    _stats_start_ms = millis();
+}
+
+void LoopScheduler::log_stats()
+{
+    uint32_t elapsed_ms = millis() - _stats_start_ms;
+    uint64_t elapsed_us = (uint64_t)elapsed_ms * 1000;
+    log_response("Loop over %lus: %u%% busy, %u%% idle%s", (unsigned long)(elapsed_ms / 1000),
+        elapsed_us > 0 ? (unsigned)(_busy_us * 100 / elapsed_us) : 0,
+        elapsed_us > 0 ? (unsigned)(_idle_us * 100 / elapsed_us) : 0,
+        _light_sleep ? (_awake_held ? ", light sleep held off" : ", light sleep") : "");
+    for (LoopComponent & component : _components) {
+        LoopComponentStats & stats = component.stats;
+        log_response("%s: %lu runs (%lu woken), avg %lu us, max %lu us, budget %lu us, %lu over",
+            component.name,
+            (unsigned long)stats.runs,
+            (unsigned long)stats.woken,
+            (unsigned long)(stats.runs > 0 ? stats.total_us / stats.runs : 0),
+            (unsigned long)stats.max_us,
+            (unsigned long)stats.budget_us,
+            (unsigned long)stats.overruns);
+    }
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+#include <etl/vector.h>
+#include <esp_pm.h>
+
+#define LOOP_SCHEDULER_MAX_COMPONENTS 16
+#define LOOP_SCHEDULER_MAX_WAKE_SOURCES 8
+#define LOOP_SCHEDULER_MAX_IDLE_MS 1000     // longest wait when nothing declares a deadline
+#define LOOP_SCHEDULER_SOCKET_WATCH_MS 10000 // select() timeout, a new connection is watched after at most this
+#define LOOP_SCHEDULER_SOCKET_TASK_STACK 2048
+#define LOOP_SCHEDULER_UART_AWAKE_MS 2000   // no light sleep this long after UART0/1 traffic
+#define LOOP_SCHEDULER_UART_WAKE_EDGES 3    // RX edges that wake UART0/1 from light sleep
+#define LOOP_SCHEDULER_NONE 0xFF
+
+typedef uint8_t component_id_t;
+
+struct LoopComponentStats {
+    uint32_t runs;
+    uint32_t woken;         // runs caused by a wake source rather than the deadline
+    uint64_t total_us;
+    uint32_t max_us;
+    uint32_t budget_us;     // 0 for no budget
+    uint32_t overruns;      // runs that took longer than the budget
+};
+
+// Main loop that runs each registered component only when it is due and
+// blocks the loop task in between. A component is due when its interval has
+// passed, when its deadline function returns 0, or when one of its wake
+// sources fired: a GPIO edge, UART data or a readable MQTT socket. The socket
+// is watched by a small task blocked in select(), so the loop task itself
+// only waits for its notification until the next deadline.
+// While the loop task is blocked FreeRTOS runs the idle task, which lowers
+// the CPU clock and, after enable_light_sleep(), enters automatic light
+// sleep with WiFi kept in modem sleep. stay_awake_for() holds light sleep
+// off, e.g. while reading a UART that cannot wake the chip.
+class LoopScheduler
+{
+    public:
+        LoopScheduler();
+        void begin();
+        component_id_t add(const char * name, std::function<void()> tick, uint32_t interval_ms, uint32_t budget_us = 0);
+        component_id_t add(const char * name, std::function<void()> tick, std::function<uint32_t()> due_in_ms, uint32_t budget_us = 0);
+        bool wake_on_gpio(component_id_t id, uint8_t pin);
+        bool wake_on_uart(component_id_t id, HardwareSerial & serial, uint8_t uart_num);
+        bool wake_on_socket(component_id_t id, std::function<int()> socket_fd, std::function<bool()> has_buffered_input = nullptr);
+        void wake(component_id_t id);
+        void stay_awake_for(uint32_t ms);
+        bool enable_light_sleep(uint16_t max_mhz = 240, uint16_t min_mhz = 40);
+        void tick();
+        LoopComponentStats get_stats(component_id_t id);
+        void reset_stats();
+        void log_stats();
+
+    private:
+        struct LoopComponent {
+            const char * name;
+            std::function<void()> tick;
+            std::function<uint32_t()> due_in_ms;  // empty for interval components
+            uint32_t interval_ms;
+            uint32_t next_run_ms;
+            LoopComponentStats stats;
+        };
+        struct WakeSource {
+            LoopScheduler * scheduler;
+            component_id_t id;
+            int8_t uart_num;    // -1 for GPIO sources
+            uint8_t pin;
+            volatile bool armed; // level wakeup set for light sleep
+        };
+
+        component_id_t _add(const LoopComponent & component);
+        uint32_t _due_in_ms(LoopComponent & component);
+        void _idle(uint32_t wait_ms);
+        void _watch_socket();
+        void _hold_awake();
+        void _enable_uart_wakeup(uint8_t uart_num);
+        void _arm_gpio_wakeup(bool arm);
+        static void _on_gpio(void * arg);
+        static void _socket_task_main(void * parameter);
+
+        etl::vector<LoopComponent, LOOP_SCHEDULER_MAX_COMPONENTS> _components;
+        etl::vector<WakeSource, LOOP_SCHEDULER_MAX_WAKE_SOURCES> _wake_sources; // never reallocated, ISRs keep pointers
+        std::function<int()> _socket_fd;
+        std::function<bool()> _socket_buffered;  // input select() no longer sees, e.g. decrypted TLS records
+        component_id_t _socket_component;
+        TaskHandle_t _socket_task;
+        volatile int _watched_fd;
+        volatile bool _socket_watching;         // the socket task is in select()
+        TaskHandle_t _task;
+        volatile uint32_t _woken;               // one bit per component, set from ISRs and other tasks
+        volatile uint32_t _awake_until_ms;
+        bool _light_sleep;
+        bool _awake_held;
+        esp_pm_lock_handle_t _awake_lock;
+        uint64_t _busy_us;
+        uint64_t _idle_us;
+        uint32_t _stats_start_ms;
+};
@@ -0,0 +1,79 @@
+#include "lzss_decoder.h"
+#include <string.h>
+
+LzssDecoder::LzssDecoder()
+{
+    begin(LZSS_MAX_WINDOW_SZ2, 4);
+}
+
+bool LzssDecoder::begin(uint8_t window_sz2, uint8_t lookahead_sz2)
+{
+    if (window_sz2 < LZSS_MIN_WINDOW_SZ2 || window_sz2 > LZSS_MAX_WINDOW_SZ2
+        || lookahead_sz2 == 0 || lookahead_sz2 > LZSS_MAX_LOOKAHEAD_SZ2 || lookahead_sz2 >= window_sz2) {
+        return(false);
+    }
+    _window_sz2 = window_sz2;
+    _lookahead_sz2 = lookahead_sz2;
+    _window_mask = (1 << window_sz2) - 1;
+    _position = 0;
+    _state = TAG;
+    _bits_needed = 0;
+    _value = 0;
+    _distance = 0;
+    memset(_window, 0, sizeof(_window));
+    return(true);
+}
+
+size_t LzssDecoder::decode(uint8_t input, uint8_t * output)
+{
+    // a token is at least 9 bits, so one input byte completes at most one token
+    size_t length = 0;
+    for (int bit_index = 7; bit_index >= 0; bit_index--) {
+        uint8_t bit = (input >> bit_index) & 1;
+        switch (_state) {
+            case TAG:
+                _value = 0;
+                if (bit) {
+                    _state = LITERAL;
+                    _bits_needed = 8;
+                }
+                else {
+                    _state = DISTANCE;
+                    _bits_needed = _window_sz2;
+                }
+                break;
+            case LITERAL:
+                _value = (_value << 1) | bit;
+                if (--_bits_needed == 0) {
+                    _window[_position & _window_mask] = (uint8_t)_value;
+                    _position++;
+                    output[length++] = (uint8_t)_value;
+                    _state = TAG;
+                }
+                break;
+            case DISTANCE:
+                _value = (_value << 1) | bit;
+                if (--_bits_needed == 0) {
+                    _distance = _value + 1;
+                    _value = 0;
+                    _bits_needed = _lookahead_sz2;
+                    _state = LENGTH;
+                }
+                break;
+            case LENGTH:
+                _value = (_value << 1) | bit;
+                if (--_bits_needed == 0) {
+                    // copy byte by byte, the match may overlap the bytes it produces
+                    for (uint16_t i = 0; i <= _value; i++) {
+                        uint8_t byte = _window[(_position - _distance) & _window_mask];
+                        _window[_position & _window_mask] = byte;
+                        _position++;
+                        output[length++] = byte;
+                    }
+                    _state = TAG;
+                }
+                break;
+        }
+    }
+    return(length);
+}
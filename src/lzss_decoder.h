@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LZSS_MIN_WINDOW_SZ2 8
+#define LZSS_MAX_WINDOW_SZ2 12
+#define LZSS_MAX_LOOKAHEAD_SZ2 8
+#define LZSS_MAX_OUTPUT (1 << LZSS_MAX_LOOKAHEAD_SZ2) // bytes decode() can return for one input byte
+
+// Streaming LZSS decoder using the heatshrink bit format: a 1 bit followed by
+// an 8 bit literal, or a 0 bit followed by (distance - 1) in window_sz2 bits
+// and (length - 1) in lookahead_sz2 bits. Bits are read MSB first.
+// The encoder is tools/package_firmware.py.
+class LzssDecoder
+{
+    public:
+        LzssDecoder();
+        bool begin(uint8_t window_sz2, uint8_t lookahead_sz2);
+        size_t decode(uint8_t input, uint8_t * output);
+
+    private:
+        enum decoder_state : uint8_t {
+            TAG,
+            LITERAL,
+            DISTANCE,
+            LENGTH
+        };
+
+        uint8_t _window[1 << LZSS_MAX_WINDOW_SZ2];
+        uint16_t _window_mask;
+        uint16_t _position;
+        uint8_t _window_sz2;
+        uint8_t _lookahead_sz2;
+        decoder_state _state;
+        uint8_t _bits_needed;
+        uint16_t _value;
+        uint16_t _distance;
+};
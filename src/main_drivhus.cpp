@@ -5,6 +5,7 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "timing_wheel.h"
 #include "boards/shroom.h"
 
 // Connection details
@@ -15,12 +16,17 @@
 #define DEFAULT_MQTT_HOST "192.168.2.4"
 #define DEFAULT_MQTT_PORT 1883
 
+#define TELEMETRY_INTERVAL_MS 60000
+
 // Custom pin definitions
 #define WALLSWITCH_LEFT 48 // green wire
 #define WALLSWITCH_RIGHT 45 // white wire
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
+TimingWheel timers;
+WheelTimer telemetry_timer;
 
 // Create all Iot capability objects
 DS18B20_temperature_sensors temperature_sensors(&conn, TEMP1_PIN, MQTT_TOPIC "/temperatures_C");
@@ -43,7 +49,7 @@ InputMomentary wallSwitchRight(&conn, WALLSWITCH_RIGHT, "Wallswitch right", MQTT
 InputMomentary *pushButtons[] = {&push1, &push2, &push3, &push4, &wallSwitchLeft, &wallSwitchRight};
 size_t noPushButtons = 6;
 
-void pub_temps(CommandArgs args) {
+void pub_temps() {
   temperature_sensors.publishAllTemperatures();
 }
 
@@ -53,14 +59,17 @@ void setup() {
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
-  cmd.add(8, pub_temps, "Publish all temperatures");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
+  cmd.add(8, "temps", pub_temps, "Publish all temperatures");
 
   conn.connect( 
       WIFI_SSID,
@@ -77,6 +86,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   // map temperature sensor names:
@@ -105,15 +118,19 @@ void setup() {
   temperature_sensors.publishAllTemperatures();
 
   push1.begin();
+
+  timers.schedule_every(telemetry_timer, TELEMETRY_INTERVAL_MS, [] {
+    log_debug("Publishing all temperatures");
+    temperature_sensors.publishAllTemperatures();
+  });
 }
 
-Timer telemetry_interval_timer(1, 'M');
-Timer send_network_info_timer(20, 's');
 
 void loop()
 {
   cmd.tick();
   conn.maintain();
+  ota.tick();
   push1.tick();
   push2.tick();
   push3.tick();
@@ -122,9 +139,5 @@ void loop()
   wallSwitchRight.tick();
   temperature_sensors.tick();
 
-  if (telemetry_interval_timer.is_done())
-  {
-    log_debug("Publishing all temperatures");
-    temperature_sensors.publishAllTemperatures();
-  }
+  timers.tick();
 }
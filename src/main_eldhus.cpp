@@ -5,6 +5,7 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "timing_wheel.h"
 #include "boards/r2d2.h"
 
 // Connection details
@@ -15,15 +16,20 @@
 #define DEFAULT_MQTT_HOST "192.168.2.4"
 #define DEFAULT_MQTT_PORT 1883
 
+#define TELEMETRY_INTERVAL_MS 60000
+
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
+TimingWheel timers;
+WheelTimer telemetry_timer;
 
 // Create all Iot capability objects
 DS18B20_temperature_sensors temperature_sensors(&conn, TEMP1_PIN, MQTT_TOPIC "/temperatures_C");
 InputMomentary push1(&conn, PUSH_BUTTON_1, "push", MQTT_TOPIC "/push");
 Thermostat fridge(&conn, &temperature_sensors, "kjoleskap", RELAY_PIN, "fridge_thermostat", MQTT_TOPIC "/fridge", 4.0, 1.0);
 
-void pub_temps(CommandArgs args) {
+void pub_temps() {
   temperature_sensors.publishAllTemperatures();
 }
 
@@ -33,14 +39,17 @@ void setup() {
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
-  cmd.add(8, pub_temps, "Publish all temperatures");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
+  cmd.add(8, "temps", pub_temps, "Publish all temperatures");
 
   conn.connect( 
       WIFI_SSID,
@@ -57,6 +66,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   // map temperature sensor names:
@@ -72,22 +85,22 @@ void setup() {
 
   fridge.begin();
   push1.begin();
+
+  timers.schedule_every(telemetry_timer, TELEMETRY_INTERVAL_MS, [] {
+    log_debug("Publishing all temperatures");
+    temperature_sensors.publishAllTemperatures();
+  });
 }
 
-Timer telemetry_interval_timer(1, 'M');
-Timer send_network_info_timer(20, 's');
 
 void loop()
 {
   cmd.tick();
   conn.maintain();
+  ota.tick();
   push1.tick();
   temperature_sensors.tick();
   fridge.tick();
 
-  if (telemetry_interval_timer.is_done())
-  {
-    log_debug("Publishing all temperatures");
-    temperature_sensors.publishAllTemperatures();
-  }
+  timers.tick();
 }
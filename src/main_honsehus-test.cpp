@@ -29,6 +29,7 @@
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
 
 AccelStepper stepper(AccelStepper::FULL4WIRE, STEPPER_COIL_A1, STEPPER_COIL_A2, STEPPER_COIL_B1, STEPPER_COIL_B2);
 StepperMotorDoor chickendoor(&conn, &stepper, "Chickendoor", MQTT_TOPIC "/door", STEPPER_ENABLE);
@@ -68,13 +69,16 @@ void setup() {
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
 
   conn.connect( 
       WIFI_SSID,
@@ -91,6 +95,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   // initialize outputs:
@@ -128,6 +136,7 @@ void loop()
 {
   cmd.tick();
   conn.maintain();
+  ota.tick();
   // push1.tick();
   // push2.tick();
   // push3.tick();
@@ -5,6 +5,7 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "timing_wheel.h"
 #include "boards/shroom.h"
 
 // Connection details
@@ -16,6 +17,8 @@
 #define DEFAULT_MQTT_HOST "192.168.2.4"
 #define DEFAULT_MQTT_PORT 1883
 
+#define TELEMETRY_INTERVAL_MS 60000
+
 // custom pins
 #define STEPPER_COIL_A1 11
 #define STEPPER_COIL_A2 12
@@ -27,6 +30,9 @@
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
+TimingWheel timers;
+WheelTimer telemetry_timer;
 
 AccelStepper stepper(AccelStepper::FULL4WIRE, STEPPER_COIL_A1, STEPPER_COIL_A2, STEPPER_COIL_B1, STEPPER_COIL_B2);
 StepperMotorDoor chickendoor(&conn, &stepper, "Chickendoor", MQTT_TOPIC "/door", STEPPER_ENABLE);
@@ -48,12 +54,12 @@ InputMomentary push1(&conn, PUSH_BUTTON_1, "push 1", MQTT_TOPIC "/inputs/push1")
 // InputMomentary push3(&conn, PUSH_BUTTON_3, "push 3", MQTT_TOPIC "/inputs/push3");
 // InputMomentary push4(&conn, PUSH_BUTTON_4, "push 4", MQTT_TOPIC "/inputs/push4");
 
-void log_current_door_position(CommandArgs args) {
+void log_current_door_position() {
   log_response("Door is at %d steps", chickendoor.getCurrentPosition() );
 }
 
 
-void move_door_to_position(CommandArgs args) {
+void move_door_to_position(const CommandArgs & args) {
 
 }
 void setup() {
@@ -73,14 +79,17 @@ void setup() {
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
-  cmd.add(8, log_current_door_position, "Show the current door position");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
+  cmd.add(8, "door", log_current_door_position, "Show the current door position");
 
   conn.connect( 
       WIFI_SSID,
@@ -97,6 +106,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   // initialize outputs:
@@ -125,15 +138,21 @@ void setup() {
   // chickendoor.setMaxSpeed(50);
   chickendoor.setStepsToOpen(7500);
   chickendoor.open();
+
+  // run MQTT on core 0 so network stalls do not interrupt stepper pulsing
+  conn.start_network_task(0);
+
+  timers.schedule_every(telemetry_timer, TELEMETRY_INTERVAL_MS, [] {
+    log_debug("Publishing all temperatures");
+    temperature_sensors.publishAllTemperatures();
+  });
 }
 
-Timer telemetry_interval_timer(1, 'M');
-Timer send_network_info_timer(20, 's');
-\
 void loop()
 {
   cmd.tick();
   conn.maintain();
+  ota.tick();
   push1.tick();
   // push2.tick();
   // push3.tick();
@@ -141,9 +160,5 @@ void loop()
   chickendoor.tick();
   temperature_sensors.tick();
 
-  if (telemetry_interval_timer.is_done())
-  {
-    log_debug("Publishing all temperatures");
-    temperature_sensors.publishAllTemperatures();
-  }
+  timers.tick();
 }
@@ -5,6 +5,7 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "timing_wheel.h"
 #include "boards/shroom.h"
 // Connection details
 // setting default values
@@ -15,6 +16,8 @@
 #define DEFAULT_MQTT_HOST "192.168.2.4"
 #define DEFAULT_MQTT_PORT 1883
 
+#define TELEMETRY_INTERVAL_MS 60000
+
 // custom pins
 #define UART1_TXD 17
 #define UART1_RXD 18
@@ -22,6 +25,9 @@
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
+TimingWheel timers;
+WheelTimer telemetry_timer;
 HANreader hanreader(&conn, MQTT_TOPIC "/han", UART1_RXD, UART1_TXD);
 
 // Create all Iot capability objects
@@ -59,13 +65,16 @@ void setup() {
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
 
   conn.connect( 
       WIFI_SSID,
@@ -82,6 +91,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   hanreader.begin();
@@ -134,17 +147,20 @@ void setup() {
   push4.begin();
   doorbell.set_sticky_button_timer(Timer(2, 's'));
   doorbell.begin();
+
+  timers.schedule_every(telemetry_timer, TELEMETRY_INTERVAL_MS, [] {
+    log_info("Publishing all temperatures");
+    temperature_sensors.publishAllTemperatures();
+  });
 }
 
 // Timer read_temperature_timer(10, "seconds");
-Timer telemetry_interval_timer(1, 'M');
-Timer send_network_info_timer(20, 's');
-
 
 void loop()
 {
   cmd.tick();
   conn.maintain();
+  ota.tick();
   hanreader.tick();
   push1.tick();
   push2.tick();
@@ -153,9 +169,5 @@ void loop()
   doorbell.tick();
   temperature_sensors.tick();
 
-  if (telemetry_interval_timer.is_done())
-  {
-    log_info("Publishing all temperatures");
-    temperature_sensors.publishAllTemperatures();
-  }
+  timers.tick();
 }
@@ -11,6 +11,7 @@
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
 
 OnOffSwitch led1(&conn, LED_GAUGE_OK, "LED 1", MAINTOPIC "/led1");
 OnOffSwitch led2(&conn, LED_GAUGE_H1, "LED 2", MAINTOPIC "/led2");
@@ -25,13 +26,16 @@ void setup() {
   pinMode(39, OUTPUT); // fix dim LED
   Serial.begin(112500);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
 
   conn.connect( WIFI_SSID,
     WIFI_PW,
@@ -47,6 +51,10 @@ void setup() {
     false
   );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
   led1.begin();
   led2.begin();
   led3.begin();
@@ -59,6 +67,7 @@ void setup() {
 void loop() {
   cmd.tick();
   conn.maintain();
+  ota.tick();
 
   boot_sw.tick();
 }
\ No newline at end of file
@@ -5,12 +5,14 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "micro_timer.h"
 #include "boards/dino.h"
 
 #define MAINTOPIC "test"
 
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
 
 OnOffSwitch led1(&conn, LED_GAUGE_OK, "LED 1", MAINTOPIC "/led1");
 OnOffSwitch led2(&conn, LED_GAUGE_H1, "LED 2", MAINTOPIC "/led2");
@@ -20,30 +22,79 @@ OnOffSwitch led5(&conn, LED_GAUGE_H4, "LED 5", MAINTOPIC "/led5");
 
 InputMomentary boot_sw(&conn, BOOT_SWITCH_PIN, "Boot", MAINTOPIC "/button1");
 
-void print_args(CommandArgs args) {
+void print_args(const CommandArgs & args) {
   if ( args.n_args == 0) {
     log_response("No arguments given");
     return;
   }
 
   for (uint8_t i = 0; i < args.n_args; i++) {
-    log_response("Arg %d: %s", i, args.argv[i].c_str() );
+    log_response("Arg %d: %.*s", i, (int)args.argv[i].size(), args.argv[i].data() );
   }
 }
 
+// callback lateness of a periodic timer run in the esp_timer task and in the loop
+MicroTimer jitter_task_timer([](void *) {}, nullptr, micro_timer_dispatch::TASK, "jitter_task");
+MicroTimer jitter_loop_timer([](void *) {}, nullptr, micro_timer_dispatch::LOOP, "jitter_loop");
+
+void log_jitter(const char * name, MicroTimerStats stats) {
+  if (stats.count == 0) {
+    log_response("%s: no callbacks", name);
+    return;
+  }
+  log_response("%s: %u callbacks, late min %dus mean %dus max %dus, %u missed", name,
+    (unsigned)stats.count, (int)stats.min_late_us, (int)(stats.total_late_us / stats.count),
+    (int)stats.max_late_us, (unsigned)stats.missed);
+}
+
+cmd_status report_jitter(Job & job) {
+  // job.data is the measuring time in ms
+  job.waiting = true;
+  if ( ! job.cancelled && millis() - job.started_ms < job.data) {
+    return(cmd_status::IN_PROGRESS);
+  }
+  jitter_task_timer.stop();
+  jitter_loop_timer.stop();
+  log_jitter("esp_timer task", jitter_task_timer.get_stats());
+  log_jitter("loop", jitter_loop_timer.get_stats());
+  return(job.cancelled ? cmd_status::ERROR : cmd_status::OK);
+}
+
+cmd_status measure_jitter(uint32_t period_us, uint32_t duration_s) {
+  jitter_task_timer.reset_stats();
+  jitter_loop_timer.reset_stats();
+  if ( ! jitter_task_timer.start_periodic(period_us) || ! jitter_loop_timer.start_periodic(period_us)) {
+    jitter_task_timer.stop();
+    jitter_loop_timer.stop();
+    log_response("Cannot start a %luus periodic timer, minimum is %dus", (unsigned long)period_us, MICRO_TIMER_MIN_PERIOD_US);
+    return(cmd_status::ERROR);
+  }
+  if ( ! cmd.start_job("jitter", report_jitter, duration_s * 1000)) {
+    jitter_task_timer.stop();
+    jitter_loop_timer.stop();
+    return(cmd_status::ERROR);
+  }
+  log_response("Measuring for %us", (unsigned)duration_s);
+  return(cmd_status::OK);
+}
+
 void setup() {
   set_log_level(log_severity::INFO);
   pinMode(39, OUTPUT); // fix dim LED
   Serial.begin(112500);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
-  cmd.add(10, print_args, "Lists command arguments given to this command");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
+  cmd.add(10, "args", print_args, "Lists command arguments given to this command");
+  cmd.add(12, "jitter", measure_jitter, "Measure timer callback lateness. Arg1: period in us, Arg2: seconds");
 
   conn.connect( WIFI_SSID,
     WIFI_PW,
@@ -59,6 +110,10 @@ void setup() {
     false
   );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
   led1.begin();
   led2.begin();
   led3.begin();
@@ -71,6 +126,8 @@ void setup() {
 void loop() {
   cmd.tick();
   conn.maintain();
+  ota.tick();
+  MicroTimer::dispatch_pending();
 
   boot_sw.tick();
 }
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include "mqttConnection.h"
 #include "wifi_cred.h"
 #include "iot_capability.h"
+#include "timing_wheel.h"
+#include "loop_scheduler.h"
 #include "boards/r2d2.h"
 
 // Connection details
@@ -15,32 +17,48 @@
 #define DEFAULT_MQTT_HOST "cederlov.com"
 #define DEFAULT_MQTT_PORT 38883
 
+#define TELEMETRY_INTERVAL_MS 60000
+#define BATTERY_SAMPLE_INTERVAL_MS 60000
+#define BATTERY_SAMPLE_WINDOW_MS 2500 // VE.Direct sends a frame every second
+
 CommandParser cmd;
 Connection conn;
+OtaService ota(&conn);
+TimingWheel timers;
+WheelTimer telemetry_timer;
+LoopScheduler scheduler;
 
 // Create all Iot capability objects
 DS18B20_temperature_sensors temperature_sensors(&conn, TEMP1_PIN, MQTT_TOPIC "/temperatures_C");
 InputMomentary push1(&conn, PUSH_BUTTON_1, "push", MQTT_TOPIC "/push");
 VEdirectReader battery_monitor(&conn, MQTT_TOPIC "/battery", VEDIRECT_RX_OPTO, UART2_TX);
 
-void pub_temps(CommandArgs args) {
+void pub_temps() {
   temperature_sensors.publishAllTemperatures();
 }
 
+void log_scheduler() {
+  scheduler.log_stats();
+}
+
 void setup() {
   pinMode(LED_WIFI, OUTPUT);
   pinMode(LED_MQTT, OUTPUT);
 
   Serial.begin(115200);
 
-  cmd.add(1, CMD::list_commands, "Lists available commands");
-  cmd.add(2, CMD::reboot, "Reboot device");
-  cmd.add(3, CMD::status, "Shows status of device");
-  cmd.add(4, CMD::enable_ota, "Sets device in OTA mode for 60 seconds");
-  cmd.add(5, CMD::set_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
-  cmd.add(6, CMD::log_ip, "Show device IP address");
-  cmd.add(7, CMD::log_mac, "Show device hardware address");
-  cmd.add(8, pub_temps, "Publish all temperatures");
+  cmd.add(1, "help", CMD::list_commands, "Lists available commands");
+  cmd.add(2, "reboot", CMD::reboot, "Reboot device");
+  cmd.add(3, "status", CMD::status, "Shows status of device");
+  cmd.add(4, "ota", CMD::enable_ota, "Open OTA window. Arg1: seconds (default 60)");
+  cmd.add(5, "loglevel", CMD::change_log_level, "Set log level. Arg1: DEBUG INFO WARNING ERROR CRITICAL RESPONSE");
+  cmd.add(6, "ip", CMD::log_ip, "Show device IP address");
+  cmd.add(7, "mac", CMD::log_mac, "Show device hardware address");
+  cmd.add(9, "pull", CMD::pull_update, "Pull firmware update. Arg1: package URL");
+  cmd.add(11, "jobs", CMD::jobs, "List running jobs. Arg1: job ID to cancel (optional)");
+  cmd.add(13, "work", CMD::work_items, "Show worst loop latency and work item statistics");
+  cmd.add(8, "temps", pub_temps, "Publish all temperatures");
+  cmd.add(12, "sched", log_scheduler, "Show loop scheduler statistics");
 
   conn.connect( 
       WIFI_SSID,
@@ -57,6 +75,10 @@ void setup() {
       false
     );
 
+  // OTA runs in its own task so updates do not stall the main loop
+  ota.begin();
+  ota.start_task();
+
     set_log_level(log_severity::DEBUG);
 
   // map temperature sensor names:
@@ -69,23 +91,40 @@ void setup() {
   temperature_sensors.publishAllTemperatures();
 
   battery_monitor.begin();
+  battery_monitor.set_sample_window(BATTERY_SAMPLE_INTERVAL_MS, BATTERY_SAMPLE_WINDOW_MS);
+  battery_monitor.set_publish_timer_s(BATTERY_SAMPLE_INTERVAL_MS / 1000);
   push1.begin();
-}
 
-Timer telemetry_interval_timer(1, 'M');
-Timer send_network_info_timer(20, 's');
+  timers.schedule_every(telemetry_timer, TELEMETRY_INTERVAL_MS, [] {
+    log_debug("Publishing all temperatures");
+    temperature_sensors.publishAllTemperatures();
+  });
+
+  // the loop runs only what is due and sleeps in between to save the battery
+  scheduler.begin();
+  // serial and the push button wake their components, the deadlines only
+  // bring them back soon while there is work or a debounce running
+  component_id_t console = scheduler.add("cmd", [] { cmd.tick(); }, [] { return cmd.next_tick_ms(); });
+  scheduler.wake_on_uart(console, Serial, 0);
+  component_id_t mqtt = scheduler.add("mqtt", [] { conn.maintain(); }, 1000);
+  scheduler.wake_on_socket(mqtt, [] { return conn.get_socket_fd(); }, [] { return conn.has_buffered_input(); });
+  scheduler.add("ota", [] { ota.tick(); }, 1000);
+  component_id_t push = scheduler.add("push", [] { push1.tick(); }, [] { return push1.next_tick_ms(); });
+  scheduler.wake_on_gpio(push, PUSH_BUTTON_1);
+  scheduler.add("temps", [] { temperature_sensors.tick(); }, 1000, 20000);
+  // UART2 cannot wake the chip and loses what arrives in light sleep, so the
+  // battery monitor listens for a few frames a minute and keeps it awake for that
+  scheduler.add("battery", [] {
+    battery_monitor.tick();
+    if (battery_monitor.is_listening()) {
+      scheduler.stay_awake_for(2 * VEDIRECT_POLL_MS);
+    }
+  }, [] { return battery_monitor.next_tick_ms(); }, 20000);
+  scheduler.add("timers", [] { timers.tick(); }, [] { return timers.next_deadline_ms(); });
+  scheduler.enable_light_sleep();
+}
 
 void loop()
 {
-  cmd.tick();
-  conn.maintain();
-  push1.tick();
-  temperature_sensors.tick();
-  battery_monitor.tick();
-
-  if (telemetry_interval_timer.is_done())
-  {
-    log_debug("Publishing all temperatures");
-    temperature_sensors.publishAllTemperatures();
-  }
+  scheduler.tick();
 }
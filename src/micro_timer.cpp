@@ -0,0 +1,195 @@
+#include "micro_timer.h"
+#ifndef ESP_PLATFORM
+#include <chrono>
+#endif
+
+MicroTimer * MicroTimer::_timers = nullptr;
+
+MicroTimer::MicroTimer(micro_timer_callback_t callback, void * arg, micro_timer_dispatch dispatch, const char * name)
+{
+    _callback = callback;
+    _arg = arg;
+    _dispatch = dispatch;
+    _name = name;
+    _active = false;
+    _periodic = false;
+    _period_us = 0;
+    _deadline_us = 0;
+    _fired_count = 0;
+    _dispatched_count = 0;
+#ifdef ESP_PLATFORM
+    _handle = nullptr; // created on first start, esp_timer may not run yet
+#endif
+    reset_stats();
+    _next_timer = _timers;
+    _timers = this;
+}
+
+MicroTimer::~MicroTimer()
+{
+    stop();
+#ifdef ESP_PLATFORM
+    if (_handle != nullptr) {
+        esp_timer_delete(_handle);
+    }
+#endif
+    for (MicroTimer ** timer = &_timers; *timer != nullptr; timer = &(*timer)->_next_timer) {
+        if (*timer == this) {
+            *timer = _next_timer;
+            break;
+        }
+    }
+}
+
+int64_t MicroTimer::now_us()
+{
+#ifdef ESP_PLATFORM
+    return(esp_timer_get_time());
+#else
+    return(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+bool MicroTimer::start_once(uint64_t delay_us)
+{
+    return(_start(delay_us, false));
+}
+
+bool MicroTimer::start_periodic(uint64_t period_us)
+{
+    if (period_us < MICRO_TIMER_MIN_PERIOD_US) {
+        return(false);
+    }
+    return(_start(period_us, true));
+}
+
+bool MicroTimer::_start(uint64_t time_us, bool periodic)
+{
+    stop();
+    _periodic = periodic;
+    _period_us = time_us;
+    _deadline_us = now_us() + time_us;
+    _active = true;
+#ifdef ESP_PLATFORM
+    if (_handle == nullptr) {
+        esp_timer_create_args_t args = {};
+        args.callback = &MicroTimer::_on_esp_timer;
+        args.arg = this;
+        args.dispatch_method = ESP_TIMER_TASK;
+        args.name = _name;
+        if (esp_timer_create(&args, &_handle) != ESP_OK) {
+            _handle = nullptr;
+            _active = false;
+            return(false);
+        }
+    }
+    esp_err_t result = periodic ? esp_timer_start_periodic(_handle, time_us) : esp_timer_start_once(_handle, time_us);
+    if (result != ESP_OK) {
+        _active = false;
+        return(false);
+    }
+#endif
+    return(true);
+}
+
+void MicroTimer::stop()
+{
+#ifdef ESP_PLATFORM
+    if (_handle != nullptr) {
+        esp_timer_stop(_handle); // fails harmlessly when not running
+    }
+#endif
+    _active = false;
+    _dispatched_count = _fired_count; // drop callbacks not yet dispatched
+}
+
+bool MicroTimer::is_active()
+{
+    return(_active);
+}
+
+MicroTimerStats MicroTimer::get_stats()
+{
+    // copied without locking, a TASK timer may update it meanwhile
+    return(_stats);
+}
+
+void MicroTimer::reset_stats()
+{
+    _stats.count = 0;
+    _stats.min_late_us = INT32_MAX;
+    _stats.max_late_us = INT32_MIN;
+    _stats.total_late_us = 0;
+    _stats.missed = 0;
+}
+
+#ifdef ESP_PLATFORM
+void MicroTimer::_on_esp_timer(void * arg)
+{
+    // esp_timer task
+    MicroTimer * timer = static_cast<MicroTimer *>(arg);
+    if (timer->_dispatch == micro_timer_dispatch::TASK) {
+        timer->_run(esp_timer_get_time(), 1);
+    }
+    else {
+        timer->_fired_count++; // only written here, dispatch_pending() keeps _dispatched_count
+    }
+}
+#endif
+
+void MicroTimer::_run(int64_t now_us, uint32_t periods)
+{
+    // periods is the number of deadlines that passed since the last run,
+    // the callback runs once for all of them
+    if (_periodic) {
+        _deadline_us += (int64_t)(periods - 1) * _period_us;
+        _stats.missed += periods - 1;
+    }
+    int64_t late_us = now_us - _deadline_us;
+    if (late_us > INT32_MAX) { late_us = INT32_MAX; }
+    if (late_us < INT32_MIN) { late_us = INT32_MIN; }
+    _stats.count++;
+    _stats.total_late_us += late_us;
+    if (late_us < _stats.min_late_us) { _stats.min_late_us = late_us; }
+    if (late_us > _stats.max_late_us) { _stats.max_late_us = late_us; }
+
+    if (_periodic) {
+        _deadline_us += _period_us;
+    }
+    else {
+        _active = false;
+    }
+    _callback(_arg);
+}
+
+void MicroTimer::dispatch_pending()
+{
+    // runs LOOP callbacks, call it from loop()
+    int64_t now = now_us();
+    for (MicroTimer * timer = _timers; timer != nullptr; timer = timer->_next_timer) {
+        if ( ! timer->_active ) {
+            continue;
+        }
+#ifdef ESP_PLATFORM
+        if (timer->_dispatch == micro_timer_dispatch::TASK) {
+            continue;
+        }
+        uint32_t fired = timer->_fired_count;
+        uint32_t periods = fired - timer->_dispatched_count;
+        if (periods == 0) {
+            continue;
+        }
+        timer->_dispatched_count = fired;
+#else
+        if (now < timer->_deadline_us) {
+            continue;
+        }
+        uint32_t periods = 1;
+        if (timer->_periodic) {
+            periods += (now - timer->_deadline_us) / timer->_period_us;
+        }
+#endif
+        timer->_run(now, periods);
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#ifdef ESP_PLATFORM
+#include <esp_timer.h>
+#endif
+
+#define MICRO_TIMER_MIN_PERIOD_US 50 // esp_timer does not run periodic timers faster
+
+enum class micro_timer_dispatch : uint8_t {
+    TASK,   // in the esp_timer task, keep the callback short and do not publish
+    LOOP    // from MicroTimer::dispatch_pending() in the main loop
+};
+
+// Lateness of the callbacks relative to their deadlines, in microseconds
+struct MicroTimerStats {
+    uint32_t count;
+    int32_t min_late_us;
+    int32_t max_late_us;
+    int64_t total_late_us;  // divide by count for the mean
+    uint32_t missed;        // periods that passed before the loop dispatched them
+};
+
+typedef void (*micro_timer_callback_t)(void * arg);
+
+// One-shot or periodic timer with microsecond deadlines on esp_timer, for
+// debounce, dwell and inter-byte timeouts below the resolution of millis().
+// Nothing here logs, so it is safe to start and stop from callbacks.
+// Without ESP_PLATFORM (host builds) deadlines are checked against
+// std::chrono in dispatch_pending() and both dispatch modes run from there.
+class MicroTimer
+{
+    public:
+        MicroTimer(micro_timer_callback_t callback, void * arg = nullptr,
+            micro_timer_dispatch dispatch = micro_timer_dispatch::LOOP, const char * name = "micro_timer");
+        ~MicroTimer();
+        bool start_once(uint64_t delay_us);
+        bool start_periodic(uint64_t period_us);
+        void stop();
+        bool is_active();
+        MicroTimerStats get_stats();
+        void reset_stats();
+        static void dispatch_pending();
+        static int64_t now_us();
+
+    private:
+        bool _start(uint64_t time_us, bool periodic);
+        void _run(int64_t now_us, uint32_t periods);
+#ifdef ESP_PLATFORM
+        static void _on_esp_timer(void * arg);
+        esp_timer_handle_t _handle;
+#endif
+
+        micro_timer_callback_t _callback;
+        void * _arg;
+        micro_timer_dispatch _dispatch;
+        const char * _name;
+        volatile bool _active;
+        bool _periodic;
+        uint64_t _period_us;
+        int64_t _deadline_us;           // of the next callback
+        volatile uint32_t _fired_count; // written by the esp_timer task only
+        uint32_t _dispatched_count;     // LOOP timers are due while the two differ
+        MicroTimerStats _stats;
+        MicroTimer * _next_timer;       // all timers, for dispatch_pending()
+        static MicroTimer * _timers;
+};
@@ -1,8 +1,19 @@
 
 #include "mqttConnection.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_system.h"
+#include <new>
 
 extern CommandParser cmd;
 
+// set by the WiFi event handlers, which run in the WiFi event task
+static volatile bool wifi_got_ip = false;
+
+// WiFi is shared by all connections, only one of them joins at a time
+static std::mutex wifi_join_mutex;
+static bool wifi_events_registered = false;
+
 Connection::Connection()
 {
     _wifi_ok = false;
@@ -10,7 +21,37 @@ Connection::Connection()
 
     new_mqtt_message = false;
     number_mqtt_callbacks = 0;
+    number_dropped_messages = 0;
+    number_qos1_downgrades = 0;
+    number_retransmissions = 0;
+    number_published_messages = 0;
+    number_reconnects = 0;
+    _last_heartbeat_millis = 0;
+    _heartbeat_mode = heartbeat_mode::HEALTH;
+    _loop_count = 0;
+    _max_loop_us = 0;
+    _last_maintain_us = 0;
+    _sequence_envelope = false;
+    _sequence_number = 0;
+    _last_packet_id = MQTT_FIRST_PACKET_ID;
      _last_number_of_callbacks = 0;
+    _network_task_handle = nullptr;
+    _app_task_handle = nullptr;
+    _queues = nullptr;
+    _log_topic = INVALID_TOPIC_HANDLE;
+    _ssl_root_ca = nullptr;
+    _ssl_cert = nullptr;
+    _ssl_key = nullptr;
+    _heartbeat_topic = INVALID_TOPIC_HANDLE;
+    _pong_topic = INVALID_TOPIC_HANDLE;
+    _response_topic = INVALID_TOPIC_HANDLE;
+    _received_us = 0;
+    _use_static_ip = false;
+    _broker_ip_valid = false;
+    _broker_ip_resolved_ms = 0;
+    _first_publish_done = false;
+    _buffer_limit = MQTT_BUFFER_MAX_SIZE;
+    _buffer_overflow_reported = 0;
     received_mqtt_topic.clear();
     received_mqtt_message.clear();
 }
@@ -38,37 +79,65 @@ etl::string<64> Connection::get_mqtt_client_name() {
     return(_client_name);
 }
 
-// void set_ssl_ca(etl::string<64> ca) {
-//     _wifi_client.setCACert(ca);
-// }
+etl::string<64> Connection::get_mqtt_main_topic() {
+    return(_main_topic);
+}
+
+// Certificates and keys are PEM strings that must stay valid for the lifetime
+// of the connection, e.g. string literals or files embedded in flash with
+// board_build.embed_txtfiles. Set them before connect().
+void Connection::set_ssl_ca(const char * ca) {
+    _ssl_root_ca = ca;
+}
+
+void Connection::set_ssl_cert(const char * cert) {
+    _ssl_cert = cert;
+}
+
+void Connection::set_ssl_key(const char * key) {
+    _ssl_key = key;
+}
 
-// void setSslCert(String cert) {
-//     _wifi_client.setCertificate(cert);
-// }
+void Connection::set_mqtt_buffer_limit(uint16_t max_size) {
+    _buffer_limit = max_size;
+}
 
-// void setSslKey(String key) {
-//     _wifi_client.setCertificate(key);
-// }
+// A static address skips DHCP on every join. Set it before connect().
+void Connection::set_static_ip(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns) {
+    _static_ip = ip;
+    _gateway = gateway;
+    _subnet = subnet;
+    _dns = dns;
+    _use_static_ip = true;
+}
 
 void Connection::set_mqtt_main_topic(etl::string<64> main_topic) {
     _command_topic = main_topic;
     _command_topic.append("/command");   // topic for receiving commands
-    _log_topic = main_topic;
-    _log_topic.append("/log");           // topic wher log is sent
-    _heartbeat_topic = main_topic;
-    _heartbeat_topic.append("/heartbeat");           // topic where heartbeat is sent
+    _ping_topic = main_topic;
+    _ping_topic.append("/ping");         // round trip probes, answered on <topic>/pong
+    _pong_topic = register_topic(main_topic, "pong");
+    _response_topic = register_topic(main_topic, "response");  // replies to correlated commands
+    _log_topic = register_topic(main_topic, "log");               // topic wher log is sent
+    _heartbeat_topic = register_topic(main_topic, "heartbeat");   // topic where heartbeat is sent
 }
 
 void Connection::set_status_leds()
 {
-    if (_wifi_ok) {
+    if (_wifi_led_pin == NO_LED_PIN) {
+        // no wifi LED
+    }
+    else if (_wifi_ok) {
         digitalWrite(_wifi_led_pin, HIGH);
     }
     else {
         digitalWrite(_wifi_led_pin, LOW);
     }
 
-    if (_mqtt_ok) {
+    if (_mqtt_led_pin == NO_LED_PIN) {
+        // no mqtt LED
+    }
+    else if (_mqtt_ok) {
         digitalWrite(_mqtt_led_pin, HIGH);
     }
     else {
@@ -90,9 +159,9 @@ void Connection::connect(
     etl::string<64> wifi_passwd, 
     etl::string<64> mqtt_host, 
     etl::string<64> main_topic, 
-    etl::string<512> ssl_root_ca,
-    etl::string<512> ssl_cert,
-    etl::string<512> ssl_key,
+    const char * ssl_root_ca,
+    const char * ssl_cert,
+    const char * ssl_key,
     uint16_t mqtt_port, 
     etl::string<64> mqtt_client_name, 
     int wifi_led_pin, 
@@ -109,42 +178,68 @@ void Connection::connect(
     _main_topic = main_topic;
     _wifi_led_pin = wifi_led_pin;
     _mqtt_led_pin = mqtt_led_pin;
-    _ssl_root_ca = ssl_root_ca;
-    _ssl_cert = ssl_cert;
-    _ssl_key = ssl_key;
+    if (ssl_root_ca != nullptr && ssl_root_ca[0] != '\0') { _ssl_root_ca = ssl_root_ca; }
+    if (ssl_cert != nullptr && ssl_cert[0] != '\0') { _ssl_cert = ssl_cert; }
+    if (ssl_key != nullptr && ssl_key[0] != '\0') { _ssl_key = ssl_key; }
     _use_ssl = use_ssl;
     
     // #ifdef ARDUINO_IOT_USE_SSL
     // #endif
 
     // set pin mode for LEDS
-    pinMode(_wifi_led_pin, OUTPUT);
-    pinMode(_mqtt_led_pin, OUTPUT);
+    if (_wifi_led_pin != NO_LED_PIN) { pinMode(_wifi_led_pin, OUTPUT); }
+    if (_mqtt_led_pin != NO_LED_PIN) { pinMode(_mqtt_led_pin, OUTPUT); }
 
     if (_use_ssl) {
-        log_info("Setting CA cert (using SSL)");
-        _wifi_secure_client.setCACert(_ssl_root_ca.c_str());
-        
-    // // _wifi_secure_client.setCertificate(_sslCert.c_str());
-    // // _wifi_secure_client.setPrivateKey(_sslKey.c_str());
-    }
-    else {
-        
+        if (_ssl_root_ca != nullptr) {
+            log_info("Setting CA cert (using SSL)");
+            _wifi_secure_client.setCACert(_ssl_root_ca);
+        }
+        else {
+            log_warning("No CA cert given, broker certificate is not verified");
+            _wifi_secure_client.setInsecure();
+        }
+        if (_ssl_cert != nullptr && _ssl_key != nullptr) {
+            log_info("Using client certificate authentication");
+            _wifi_secure_client.setCertificate(_ssl_cert);
+            _wifi_secure_client.setPrivateKey(_ssl_key);
+        }
     }
     _mqtt_client.setServer(_host.c_str(), _port );
     if (_use_ssl) {
-        _mqtt_client.setClient(_wifi_secure_client);
+        _transport.set_client(&_wifi_secure_client);
         log_info("Connecting to MQTT using SSL");
 
     }
     else {
-        _mqtt_client.setClient(_wifi_client);
+        _transport.set_client(&_wifi_client);
         log_info("Connecting to MQTT without SSL");
     }
+    _transport.set_puback_handler([this](uint16_t packet_id) {
+        _on_puback(packet_id);
+    });
+    _mqtt_client.setClient(_transport);
+
+    // allocated once here and kept across reconnects
+    log_heap("before MQTT buffer");
+    _mqtt_client.setBufferSize(MQTT_BUFFER_INITIAL_SIZE);
+    log_heap("after MQTT buffer");
 
     _mqtt_client.setCallback([this](char *callbackTopic, byte *payload, unsigned int payloadLength) {
         // MQTT callback lambda function:
         number_mqtt_callbacks++;
+        if ( is_network_task_running() ) {
+            // running in the network task, hand the message over to the application
+            MqttMessage message;
+            message.type = mqtt_message_type::PUBLISH;
+            message.received_us = esp_timer_get_time();
+            message.topic.assign(callbackTopic);
+            message.payload.assign((const char *)payload, payloadLength);
+            if ( ! _queues->inbound.push(message) ) {
+                number_dropped_messages++;
+            }
+            return;
+        }
         if ( new_mqtt_message ) {
             // ignore message while the previous message is handled
             return;
@@ -154,9 +249,18 @@ void Connection::connect(
             received_mqtt_message.push_back( (char)payload[i] );
         }
         received_mqtt_topic.assign(callbackTopic);
+        _received_us = esp_timer_get_time();
         new_mqtt_message = true;
     });
     
+    // the client belongs to this task until start_network_task()
+    _app_task_handle = xTaskGetCurrentTaskHandle();
+
+    // the first connection becomes the log connection unless one was chosen
+    if (get_log_connection() == nullptr) {
+        set_log_connection(this);
+    }
+
     // set all topics
     set_mqtt_main_topic(_main_topic);
     log_info("Setting MQTT main topic to: %s", _main_topic.c_str());
@@ -168,66 +272,226 @@ void Connection::connect(
 
 void Connection::wifi_mqtt_connect() {
     // initalization function for establishing wifi connection
-    log_info("Connecting to %s", _ssid.c_str() );
+    std::unique_lock<std::mutex> wifi_lock(wifi_join_mutex);
     WiFi.mode(WIFI_STA);
-    
-    // setup Wifi events
-    WiFi.onEvent(WiFiStationWifiReady, ARDUINO_EVENT_WIFI_READY);
-    WiFi.onEvent(WiFiStationWifiScanDone, ARDUINO_EVENT_WIFI_SCAN_DONE);
-    WiFi.onEvent(WiFiStationStaStart, ARDUINO_EVENT_WIFI_STA_START);
-    WiFi.onEvent(WiFiStationStaStop, ARDUINO_EVENT_WIFI_STA_STOP);
-    WiFi.onEvent(WiFiStationConnected, ARDUINO_EVENT_WIFI_STA_CONNECTED);
-    WiFi.onEvent(WiFiStationDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
-    WiFi.onEvent(WiFiStationAuthmodeChange, ARDUINO_EVENT_WIFI_STA_AUTHMODE_CHANGE);
-    WiFi.onEvent(WiFiStationGotIp, ARDUINO_EVENT_WIFI_STA_GOT_IP);
-    WiFi.onEvent(WiFiStationGotIp6, ARDUINO_EVENT_WIFI_STA_GOT_IP6);
-    WiFi.onEvent(WiFiStationLostIp, ARDUINO_EVENT_WIFI_STA_LOST_IP);
-    WiFi.onEvent(WiFiApStart, ARDUINO_EVENT_WIFI_AP_START);
-    WiFi.onEvent(WiFiApStop, ARDUINO_EVENT_WIFI_AP_STOP);
-    WiFi.onEvent(WiFiApStaConnected, ARDUINO_EVENT_WIFI_AP_STACONNECTED);
-    WiFi.onEvent(WiFiApStaDisconnected, ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
-    WiFi.onEvent(WiFiApStaIpasSigned, ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED);
-    WiFi.onEvent(WiFiApProbeEwqRecved, ARDUINO_EVENT_WIFI_AP_PROBEREQRECVED);
-    WiFi.onEvent(WiFiApGotIp6, ARDUINO_EVENT_WIFI_AP_GOT_IP6);
-    WiFi.onEvent(WiFiFtmReport, ARDUINO_EVENT_WIFI_FTM_REPORT);
 
+    if ( ! wifi_events_registered ) {
+        // setup Wifi events, only once as handlers are never removed
+        WiFi.onEvent(WiFiStationWifiReady, ARDUINO_EVENT_WIFI_READY);
+        WiFi.onEvent(WiFiStationWifiScanDone, ARDUINO_EVENT_WIFI_SCAN_DONE);
+        WiFi.onEvent(WiFiStationStaStart, ARDUINO_EVENT_WIFI_STA_START);
+        WiFi.onEvent(WiFiStationStaStop, ARDUINO_EVENT_WIFI_STA_STOP);
+        WiFi.onEvent(WiFiStationConnected, ARDUINO_EVENT_WIFI_STA_CONNECTED);
+        WiFi.onEvent(WiFiStationDisconnected, ARDUINO_EVENT_WIFI_STA_DISCONNECTED);
+        WiFi.onEvent(WiFiStationAuthmodeChange, ARDUINO_EVENT_WIFI_STA_AUTHMODE_CHANGE);
+        WiFi.onEvent(WiFiStationGotIp, ARDUINO_EVENT_WIFI_STA_GOT_IP);
+        WiFi.onEvent(WiFiStationGotIp6, ARDUINO_EVENT_WIFI_STA_GOT_IP6);
+        WiFi.onEvent(WiFiStationLostIp, ARDUINO_EVENT_WIFI_STA_LOST_IP);
+        WiFi.onEvent(WiFiApStart, ARDUINO_EVENT_WIFI_AP_START);
+        WiFi.onEvent(WiFiApStop, ARDUINO_EVENT_WIFI_AP_STOP);
+        WiFi.onEvent(WiFiApStaConnected, ARDUINO_EVENT_WIFI_AP_STACONNECTED);
+        WiFi.onEvent(WiFiApStaDisconnected, ARDUINO_EVENT_WIFI_AP_STADISCONNECTED);
+        WiFi.onEvent(WiFiApStaIpasSigned, ARDUINO_EVENT_WIFI_AP_STAIPASSIGNED);
+        WiFi.onEvent(WiFiApProbeEwqRecved, ARDUINO_EVENT_WIFI_AP_PROBEREQRECVED);
+        WiFi.onEvent(WiFiApGotIp6, ARDUINO_EVENT_WIFI_AP_GOT_IP6);
+        WiFi.onEvent(WiFiFtmReport, ARDUINO_EVENT_WIFI_FTM_REPORT);
+        wifi_events_registered = true;
+    }
+
+    if ( WiFi.status() != WL_CONNECTED ) {
+        // only (re)join WiFi when it is down, an MQTT drop alone does not need it
+        log_info("Connecting to %s", _ssid.c_str() );
+        uint32_t join_start_ms = millis();
+        if (_use_static_ip) {
+            WiFi.config(_static_ip, _gateway, _subnet, _dns);
+        }
+        bool fast_rejoin = _wifi_join_fast();
+        if ( ! fast_rejoin ) {
+            _wifi_join_full();
+        }
 
+        // wait for the address instead of a fixed settle delay
+        uint32_t got_ip_start_ms = millis();
+        while ( ! wifi_got_ip && millis() - got_ip_start_ms < WIFI_GOT_IP_TIMEOUT_MS ) {
+            delay(10);
+        }
+        log_info("Wifi connected in %lums (%s). IP: %s mac: %s", (unsigned long)(millis() - join_start_ms),
+            fast_rejoin ? "fast rejoin" : "full scan", WiFi.localIP().toString().c_str(), WiFi.macAddress().c_str());
+        _save_access_point();
+    }
+    wifi_lock.unlock();
+    _wifi_ok = true;
+    set_status_leds();
+
+    _resolve_broker();
+    if ( _mqtt_client.connect(_client_name.c_str() ) ) {
+        _mqtt_client.subscribe(_command_topic.c_str() );
+        _mqtt_client.subscribe(_ping_topic.c_str() );
+        log_info("Connected to broker as %s, %s connect took %lums", _client_name.c_str(),
+            _use_ssl ? "TCP+TLS" : "TCP", (unsigned long)_transport.get_last_connect_ms());
+        _resend_inflight();
+    }
+    else {
+        // the broker may have moved, look it up again on the next attempt
+        _broker_ip_valid = false;
+        log_error("Connecting to broker %s failed with code %d", _host.c_str(), _mqtt_client.state() );
+    }
+    _transport.flush_writes();
+
+    // sync ESP clock with NTP server, only configured on the first connect
+    //              GMT+1  Daylight saving
+    wall_clock.begin(3600, 3600);
+}
+
+bool Connection::_wifi_join_fast()
+{
+    // join the last used access point directly, without scanning all channels
+    Preferences preferences;
+    uint8_t bssid[6];
+    if ( ! preferences.begin(WIFI_PREFERENCES_NAMESPACE, true) ) {
+        return(false); // nothing stored yet
+    }
+    size_t bssid_length = preferences.getBytes("bssid", bssid, sizeof(bssid));
+    uint8_t channel = preferences.getUChar("channel", 0);
+    preferences.end();
+    if (bssid_length != sizeof(bssid) || channel == 0) {
+        return(false);
+    }
+
+    WiFi.begin(_ssid.c_str(), _passwd.c_str(), channel, bssid);
+    uint32_t start_ms = millis();
+    while ( WiFi.status() != WL_CONNECTED ) {
+        if (millis() - start_ms > WIFI_FAST_REJOIN_TIMEOUT_MS) {
+            log_warning("Fast rejoin on channel %u failed, scanning", channel);
+            WiFi.disconnect();
+            return(false);
+        }
+        delay(10);
+    }
+    return(true);
+}
+
+void Connection::_wifi_join_full()
+{
     WiFi.begin(_ssid.c_str(), _passwd.c_str());
-    int tries = 0;
-    while (WiFi.status() != WL_CONNECTED) { 
-        Serial.print(".");
-        digitalWrite(_wifi_led_pin, HIGH);
-        delay(200);
-        digitalWrite(_wifi_led_pin, LOW);
-        delay(800);
-        tries++;
-        if (tries > 1000) {
+    uint32_t start_ms = millis();
+    while (WiFi.status() != WL_CONNECTED) {
+        if (_wifi_led_pin != NO_LED_PIN) {
+            digitalWrite(_wifi_led_pin, (millis() / 500) % 2); // blink while waiting
+        }
+        delay(50);
+        if (millis() - start_ms > WIFI_CONNECT_TIMEOUT_MS) {
             log_critical("Cannot connect. Rebooting in 5 seconds...");
             delay(5000);
             ESP.restart();
         }
-        log_info("Connected to WiFi after %d tries", tries);
-        log_info("Time is: %s", get_time_string().c_str());
-        }
-    _wifi_ok = true;
-    set_status_leds();
+    }
+}
 
-    log_info("Wifi connected. IP: %s mac: %s", WiFi.localIP().toString(), WiFi.macAddress().c_str());
+void Connection::_save_access_point()
+{
+    // remember the access point for the next fast rejoin, NVS is only written when it changed
+    Preferences preferences;
+    uint8_t * bssid = WiFi.BSSID();
+    uint8_t channel = WiFi.channel();
+    if (bssid == nullptr || ! preferences.begin(WIFI_PREFERENCES_NAMESPACE, false)) {
+        return;
+    }
+    uint8_t stored_bssid[6];
+    size_t stored_length = preferences.getBytes("bssid", stored_bssid, sizeof(stored_bssid));
+    if (stored_length != sizeof(stored_bssid) || memcmp(stored_bssid, bssid, sizeof(stored_bssid)) != 0) {
+        preferences.putBytes("bssid", bssid, sizeof(stored_bssid));
+    }
+    if (preferences.getUChar("channel", 0) != channel) {
+        preferences.putUChar("channel", channel);
+    }
+    preferences.end();
+}
 
-    delay(2000); // letting wifi connection stabilize before connecting to MQTT - bugfix?
+void Connection::_check_buffer_size()
+{
+    // PubSubClient drops packets that do not fit its buffer. Grow it to fit the
+    // largest packet the transport has seen, so only the first one is lost.
+    uint32_t needed = _transport.get_max_incoming_packet();
+    uint16_t current = _mqtt_client.getBufferSize();
+    if (needed <= current) {
+        return;
+    }
+    if (current >= _buffer_limit) {
+        if (needed > _buffer_overflow_reported) {
+            _buffer_overflow_reported = needed;
+            log_warning("Dropped %lu byte MQTT packet, buffer limit is %u", (unsigned long)needed, _buffer_limit);
+        }
+        return;
+    }
+    uint32_t new_size = (needed + MQTT_BUFFER_STEP - 1) / MQTT_BUFFER_STEP * MQTT_BUFFER_STEP;
+    if (new_size > _buffer_limit) {
+        new_size = _buffer_limit;
+    }
+    log_heap("before MQTT buffer");
+    if ( _mqtt_client.setBufferSize(new_size) ) {
+        log_info("MQTT buffer grown from %u to %lu bytes for a %lu byte packet", current,
+            (unsigned long)new_size, (unsigned long)needed);
+    }
+    else {
+        // the old buffer is kept when realloc fails
+        _buffer_limit = current;
+        log_error("Could not grow MQTT buffer to %lu bytes", (unsigned long)new_size);
+    }
+    log_heap("after MQTT buffer");
+}
 
-    _mqtt_client.setBufferSize(4096); // overrides MQTT_MAX_PACKET_SIZE in PubSubClient.h
-    _mqtt_client.connect(_client_name.c_str() );
-    _mqtt_client.subscribe(_command_topic.c_str() );
-    log_info("Connected to broker as %s", _client_name.c_str());
+void Connection::log_heap(const char * context)
+{
+    // fragmentation is the share of free heap not in the largest free block
+    size_t free_heap = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t largest_block = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    unsigned fragmentation = free_heap == 0 ? 0 : 100 - (unsigned)(largest_block * 100 / free_heap);
+    log_info("Heap %s: free %u, largest block %u, %u%% fragmented", context,
+        (unsigned)free_heap, (unsigned)largest_block, fragmentation);
+}
 
-    // sync ESP clock with NTP server
-    //        GMT+1  Daylight saving
-    configTime(3600, 3600, "0.no.pool.ntp.org", "1.no.pool.ntp.org", "2.no.pool.ntp.org");
+void Connection::_resolve_broker()
+{
+    // TLS needs the host name to verify the broker certificate, so only plain
+    // TCP connections use the cached address
+    if (_use_ssl) {
+        return;
+    }
+    if ( ! _broker_ip_valid || millis() - _broker_ip_resolved_ms > BROKER_DNS_TTL_MS ) {
+        IPAddress broker_ip;
+        if ( WiFi.hostByName(_host.c_str(), broker_ip) == 1 ) {
+            _broker_ip = broker_ip;
+            _broker_ip_valid = true;
+            _broker_ip_resolved_ms = millis();
+            log_debug("Resolved %s to %s", _host.c_str(), _broker_ip.toString().c_str());
+        }
+        else {
+            log_warning("Could not resolve %s", _host.c_str());
+        }
+    }
+    if (_broker_ip_valid) {
+        _mqtt_client.setServer(_broker_ip, _port);
+    }
+    else {
+        _mqtt_client.setServer(_host.c_str(), _port);
+    }
 }
 
 void Connection::subscribe_mqtt_topic(etl::string<64> topic)
 {
+    if ( is_network_task_running() && xTaskGetCurrentTaskHandle() != _network_task_handle ) {
+        // the network task owns the client, let it do the subscription
+        MqttMessage request;
+        request.type = mqtt_message_type::SUBSCRIBE;
+        request.topic = topic;
+        if ( ! _queues->outbound.push(request) ) {
+            log_error("Outbound queue full, cannot subscribe to %s", topic.c_str());
+            return;
+        }
+        log_info("Subscribing to topic %s", topic.c_str());
+        return;
+    }
     _mqtt_client.subscribe(topic.c_str());
     log_info("Subscribing to topic %s", topic.c_str());
 }
@@ -239,16 +503,94 @@ bool Connection::is_connected() {
     return false;
 }
 
-void Connection::maintain()
+bool Connection::start_network_task(BaseType_t core, UBaseType_t priority)
 {
-    loop_mqtt();
+    // Moves all socket work (MQTT loop, publishing, reconnects) to a task pinned
+    // to the given core. Call after connect() and the begin() of all capabilities.
+    // The calling task becomes the application task that publishes and runs maintain().
+    if ( is_network_task_running() ) {
+        log_warning("Network task already running");
+        return(false);
+    }
+    if ( _queues == nullptr ) {
+        _queues = new (std::nothrow) NetworkQueues();
+        if ( _queues == nullptr ) {
+            log_error("No memory for the network queues");
+            return(false);
+        }
+    }
+    _app_task_handle = xTaskGetCurrentTaskHandle();
+    BaseType_t created = xTaskCreatePinnedToCore(
+        Connection::_network_task,
+        "mqtt_network",
+        NETWORK_TASK_STACK_SIZE,
+        this,
+        priority,
+        &_network_task_handle,
+        core
+    );
+    if ( created != pdPASS ) {
+        _network_task_handle = nullptr;
+        log_error("Could not start network task");
+        return(false);
+    }
+    log_info("Network task started on core %d", core);
+    return(true);
+}
+
+bool Connection::is_network_task_running() {
+    return(_network_task_handle != nullptr);
+}
 
+bool Connection::_is_client_task()
+{
+    // only the network task, or without one the task that called connect(),
+    // may call the PubSubClient
+    TaskHandle_t owner = is_network_task_running() ? _network_task_handle : _app_task_handle;
+    return(owner == nullptr || xTaskGetCurrentTaskHandle() == owner);
+}
+
+void Connection::_network_task(void * parameter)
+{
+    Connection * conn = static_cast<Connection *>(parameter);
+    for (;;) {
+        conn->_network_loop();
+        vTaskDelay(1); // let the idle task and WiFi stack run
+    }
+}
+
+void Connection::_network_loop()
+{
+    _mqtt_client.loop();
+    _check_connection();
+    _check_inflight();
+    _check_buffer_size();
+
+    // send what the application has queued since last iteration
+    MqttMessage message;
+    for (size_t i = 0; i < NETWORK_QUEUE_DEPTH && _queues->outbound.pop(message); i++) {
+        if ( message.type == mqtt_message_type::SUBSCRIBE ) {
+            _mqtt_client.subscribe(message.topic.c_str());
+        }
+        else if ( message.qos == mqtt_qos::AT_LEAST_ONCE ) {
+            _publish_qos1(message.topic.c_str(), (const uint8_t *)message.payload.data(), message.payload.size(), message.retained);
+        }
+        else {
+            _publish_now(message.topic.c_str(), (const uint8_t *)message.payload.data(), message.payload.size(), message.retained);
+        }
+    }
+    _transport.flush_writes(); // send everything from this iteration as full segments
+}
+
+void Connection::_check_connection()
+{
     // check mqtt connection
     if ( ! _mqtt_client.state() == 0 ) {
         log_info("MQTT disconnected in maintain()");
         _mqtt_ok = false;
         set_status_leds();
         log_error("MQTT connection failed with code %d. Reconnecting.", _mqtt_client.state() );
+        number_reconnects++;
         Connection::wifi_mqtt_connect();
     }
     else
@@ -263,6 +605,7 @@ void Connection::maintain()
         set_status_leds();
         log_error("Wifi not connected");
         log_error("Reconnecting");
+        number_reconnects++;
         Connection::wifi_mqtt_connect();
     }
     else
@@ -270,55 +613,374 @@ void Connection::maintain()
         _wifi_ok = true;
     }
     set_status_leds();
+}
+
+void Connection::_handle_message(etl::string<128> & topic, etl::string<256> & message, int64_t received_us)
+{
+    if (topic == _ping_topic) {
+        // echo the probe token with when it arrived and when it is answered (us since boot),
+        // the difference is the time spent waiting for the application loop
+        char pong[96];
+        int token_length = message.size() > 48 ? 48 : (int)message.size();
+        snprintf(pong, sizeof(pong), "%.*s,%lld,%lld", token_length, message.c_str(),
+            (long long)received_us, (long long)esp_timer_get_time());
+        publish(_pong_topic, pong);
+        return;
+    }
+    // handle commands from MQTT
+    if (topic == _command_topic) {
+        // message is a command, run from cmd.tick() outside maintain()
+        cmd.submit(message, this);
+    }
+    // Handle actions
+    // Run command corresponding to the action topic
+    for (size_t i = 0; i < _action_list.size(); i++) {
+        if (topic == _action_list[i].topic) {
+            log_debug("Running action for topic %s", topic.c_str());
+            _action_list[i].function(message);
+        }
+    }
+}
 
-    if ( new_mqtt_message) {
-        // check if any callbacks happened while parsing last message
-        if ( ! (number_mqtt_callbacks == _last_number_of_callbacks + 1) ) {
-            log_warning("%d mqtt callbacks ignored", number_mqtt_callbacks - _last_number_of_callbacks);
-        }
-        // handle commands from MQTT
-        if (received_mqtt_topic == _command_topic) {
-            // message is a command
-            cmd.parse(received_mqtt_message);
-        }
-        // Handle actions
-        // Run command corresponding to the action topic
-        for (size_t i = 0; i < _action_list.size(); i++) {
-            if (received_mqtt_topic == _action_list[i].topic) {
-                log_debug("Running action for topic %s", received_mqtt_topic.c_str());
-                _action_list[i].function(received_mqtt_message);
+void Connection::maintain()
+{
+    // maintain() runs once per main loop, time between calls is the loop latency
+    uint32_t now_us = micros();
+    if (_last_maintain_us != 0 && now_us - _last_maintain_us > _max_loop_us) {
+        _max_loop_us = now_us - _last_maintain_us;
+    }
+    _last_maintain_us = now_us;
+    _loop_count++;
+
+    if ( is_network_task_running() ) {
+        // the network task keeps the connection, only handle received messages here
+        MqttMessage message;
+        for (size_t i = 0; i < NETWORK_QUEUE_DEPTH && _queues->inbound.pop(message); i++) {
+            _handle_message(message.topic, message.payload, message.received_us);
+        }
+    }
+    else {
+        loop_mqtt();
+        _check_connection();
+        _check_inflight();
+        _check_buffer_size();
+
+        if ( new_mqtt_message) {
+            // check if any callbacks happened while parsing last message
+            if ( ! (number_mqtt_callbacks == _last_number_of_callbacks + 1) ) {
+                log_warning("%d mqtt callbacks ignored", number_mqtt_callbacks - _last_number_of_callbacks);
             }
+            _handle_message(received_mqtt_topic, received_mqtt_message, _received_us);
+            // clear variables and get ready for next message
+            _last_number_of_callbacks = number_mqtt_callbacks;
+            received_mqtt_message.clear();
+            received_mqtt_topic.clear();
+            new_mqtt_message = false;
         }
-        // clear variables and get ready for next message
-        _last_number_of_callbacks = number_mqtt_callbacks;
-        received_mqtt_message.clear();
-        received_mqtt_topic.clear();
-        new_mqtt_message = false;
     }
     // send heartbeat if it is time
     if ( (millis() - _last_heartbeat_millis) > HEARTBEAT_INTERVAL_MS ) {
-        etl::string<32> heartbeat_string;
-        etl::to_string(millis(), heartbeat_string);
-        publish(_heartbeat_topic, heartbeat_string);
-        _last_heartbeat_millis = millis();
+        _publish_heartbeat();
     }
+
+    if ( ! is_network_task_running() ) {
+        // send everything published during this loop iteration as full segments
+        _transport.flush_writes();
+    }
+}
+
+void Connection::set_sequence_envelope(etl::string_view topic_prefix) {
+    // lets the receiver count lost and reordered messages and measure latency,
+    // see the dobby stats mode. Only topics starting with topic_prefix are
+    // enveloped, keep it away from topics read by other consumers (state,
+    // heartbeat, responses). An empty prefix turns the envelope off.
+    // Streamed publishes (begin_publish) are not enveloped.
+    if ( topic_prefix.size() > _sequence_prefix.capacity() ) {
+        log_error("Sequence envelope prefix too long");
+        return;
+    }
+    _sequence_prefix.assign(topic_prefix.begin(), topic_prefix.end());
+    _sequence_envelope = ! topic_prefix.empty();
+}
+
+void Connection::set_heartbeat_mode(heartbeat_mode mode) {
+    _heartbeat_mode = mode;
+}
+
+void Connection::_publish_heartbeat()
+{
+    uint32_t now = millis();
+    etl::string<128> heartbeat_string;
+    if (_heartbeat_mode == heartbeat_mode::PLAIN) {
+        etl::to_string(now, heartbeat_string);
+    }
+    else {
+        uint32_t elapsed_ms = now - _last_heartbeat_millis;
+        uint32_t loops_per_s = elapsed_ms == 0 ? 0 : (uint32_t)((uint64_t)_loop_count * 1000 / elapsed_ms);
+        char buffer[128];
+        snprintf(buffer, sizeof(buffer), "%u,%lu,%lu,%lu,%lu,%lu,%d,%lu,%lu,%u,%lu,%d,%lu",
+            HEARTBEAT_VERSION,
+            (unsigned long)now,
+            (unsigned long)loops_per_s,
+            (unsigned long)_max_loop_us,
+            (unsigned long)ESP.getFreeHeap(),
+            (unsigned long)ESP.getMinFreeHeap(),
+            WiFi.RSSI(),
+            (unsigned long)number_published_messages,
+            (unsigned long)number_dropped_messages,
+            (unsigned)(_queues != nullptr ? _queues->inbound.size() : 0),
+            (unsigned long)number_reconnects,
+            (int)esp_reset_reason(),
+            (unsigned long)number_qos1_downgrades);
+        heartbeat_string.assign(buffer);
+    }
+    publish(_heartbeat_topic, heartbeat_string);
+    _last_heartbeat_millis = now;
+    _loop_count = 0;
+    _max_loop_us = 0;
 }
 
 void Connection::loop_mqtt() {
+    if ( is_network_task_running() || ! _is_client_task() ) {
+        return; // the network task pumps the client
+    }
     _mqtt_client.loop();
 }
 
+MqttTransport * Connection::get_transport()
+{
+    return(&_transport);
+}
+
+uint32_t Connection::get_max_loop_us()
+{
+    // longest time between maintain() calls since the last heartbeat
+    return(_max_loop_us);
+}
+
+int Connection::get_socket_fd()
+{
+    // broker socket for select(), -1 while disconnected
+    if ( ! _mqtt_client.connected() ) {
+        return(-1);
+    }
+    return(_use_ssl ? _wifi_secure_client.fd() : _wifi_client.fd());
+}
+
+bool Connection::has_buffered_input()
+{
+    // received bytes maintain() has not handled yet, including TLS records
+    // already read from the socket
+    if ( ! _mqtt_client.connected() ) {
+        return(false);
+    }
+    return(_transport.available() > 0);
+}
+
 PubSubClient Connection::get_mqtt_client()
 {
     return(_mqtt_client);
 }
 
-int Connection::publish(etl::string<128> topic, etl::string<256> message)
+int Connection::publish(etl::string_view topic, etl::string_view message, mqtt_qos qos, bool retained)
+{
+    // QoS 1 messages are kept in the in-flight window and retransmitted until
+    // the broker acknowledges them. Retained messages are kept by the broker and
+    // sent to new subscribers, use them for state.
+    return(_publish(topic, etl::string_view(), (const uint8_t *)message.data(), message.size(), qos, retained));
+}
+
+int Connection::publish(topic_handle_t topic, etl::string_view message, mqtt_qos qos, bool retained)
+{
+    if ( ! _topic_table.is_valid(topic) ) {
+        number_dropped_messages++;
+        return(1);
+    }
+    return(_publish(_topic_table.get(topic), etl::string_view(), (const uint8_t *)message.data(), message.size(), qos, retained));
+}
+
+int Connection::publish(etl::string_view topic_prefix, etl::string_view topic_suffix, etl::string_view message)
+{
+    // publishes to <topic_prefix>/<topic_suffix> without building the topic at the call site
+    return(_publish(topic_prefix, topic_suffix, (const uint8_t *)message.data(), message.size()));
+}
+
+int Connection::publish_bytes(etl::string_view topic, etl::span<const uint8_t> payload)
+{
+    return(_publish(topic, etl::string_view(), payload.data(), payload.size()));
+}
+
+bool Connection::begin_publish(etl::string_view topic, size_t length)
+{
+    // Streams a payload of known length directly to the socket: call write_publish()
+    // until length bytes are written, then end_publish(). Do not log in between,
+    // log messages are published on the same connection.
+    if ( ! _is_client_task() ) {
+        return(false); // the socket belongs to another task
+    }
+    etl::string<MQTT_MAX_TOPIC_LENGTH> full_topic;
+    if ( ! _join_topic(full_topic, topic, etl::string_view()) ) {
+        return(false);
+    }
+    if (_mqtt_led_pin != NO_LED_PIN) { digitalWrite(_mqtt_led_pin, LOW); }
+    return(_mqtt_client.beginPublish(full_topic.c_str(), length, false));
+}
+
+size_t Connection::write_publish(etl::span<const uint8_t> data)
+{
+    return(_mqtt_client.write(data.data(), data.size()));
+}
+
+bool Connection::end_publish()
+{
+    _mqtt_ok = _mqtt_client.endPublish();
+    set_status_leds();
+    return(_mqtt_ok);
+}
+
+bool Connection::_join_topic(etl::istring & topic, etl::string_view topic_prefix, etl::string_view topic_suffix)
+{
+    size_t length = topic_prefix.size();
+    if ( ! topic_suffix.empty() ) {
+        length += 1 + topic_suffix.size();
+    }
+    if ( length > topic.capacity() ) {
+        return(false);
+    }
+    topic.assign(topic_prefix.data(), topic_prefix.size());
+    if ( ! topic_suffix.empty() ) {
+        topic.push_back('/');
+        topic.append(topic_suffix.data(), topic_suffix.size());
+    }
+    return(true);
+}
+
+int Connection::_publish(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+    mqtt_qos qos, bool retained)
+{
+    if ( ! _routes.empty() && ! _route(topic_prefix, topic_suffix, payload, length, qos, retained) ) {
+        return(0); // only published on the route targets
+    }
+    return(_publish_local(topic_prefix, topic_suffix, payload, length, qos, retained));
+}
+
+bool Connection::add_route(etl::string_view topic_prefix, Connection * target, bool keep_local)
+{
+    // Messages published on this connection whose topic starts with topic_prefix
+    // are also published on target, or only there when keep_local is false.
+    // An empty prefix matches every topic. Run slow (WAN) targets with
+    // start_network_task() so publishing here only queues for them.
+    if (target == nullptr || target == this || _routes.full() || topic_prefix.size() > MQTT_MAX_TOPIC_LENGTH) {
+        log_error("Cannot add route for %.*s", (int)topic_prefix.size(), topic_prefix.data());
+        return(false);
+    }
+    Route route;
+    route.topic_prefix.assign(topic_prefix.begin(), topic_prefix.end());
+    route.target = target;
+    route.keep_local = keep_local;
+    _routes.push_back(route);
+    return(true);
+}
+
+bool Connection::_route(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+    mqtt_qos qos, bool retained)
+{
+    // returns false when the message should not be published on this connection
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    if ( ! _join_topic(topic, topic_prefix, topic_suffix) ) {
+        return(true); // let the local publish count the drop
+    }
+    bool keep_local = true;
+    for (Route & route : _routes) {
+        if ( strncmp(topic.c_str(), route.topic_prefix.c_str(), route.topic_prefix.size()) != 0 ) {
+            continue;
+        }
+        // targets publish locally only, so routes never loop
+        route.target->_publish_local(topic, etl::string_view(), payload, length, qos, retained);
+        keep_local = keep_local && route.keep_local;
+    }
+    return(keep_local);
+}
+
+bool Connection::_is_sequenced(etl::string_view topic_prefix, etl::string_view topic_suffix)
+{
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    if ( ! _join_topic(topic, topic_prefix, topic_suffix) ) {
+        return(false);
+    }
+    return(strncmp(topic.c_str(), _sequence_prefix.c_str(), _sequence_prefix.size()) == 0);
+}
+
+int Connection::_publish_local(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+    mqtt_qos qos, bool retained)
 {
-    digitalWrite(_mqtt_led_pin, LOW);
-    if (_mqtt_client.publish(topic.c_str(), message.c_str()) ) {
+    etl::string<MQTT_MAX_QUEUED_PAYLOAD_LENGTH> enveloped;
+    if ( _sequence_envelope && _is_sequenced(topic_prefix, topic_suffix) ) {
+        // "#<sequence>:<epoch ms>|" in front of the payload. Payloads that do not
+        // fit are sent as they are and do not use a sequence number.
+        char envelope[32];
+        int envelope_length = snprintf(envelope, sizeof(envelope), "#%lu:%llu|",
+            (unsigned long)(_sequence_number + 1), (unsigned long long)wall_clock.get_epoch_ms());
+        if ( envelope_length + length <= enveloped.capacity() ) {
+            _sequence_number++;
+            enveloped.assign(envelope, envelope_length);
+            enveloped.append((const char *)payload, length);
+            payload = (const uint8_t *)enveloped.data();
+            length = enveloped.size();
+        }
+    }
+
+    if ( ! _is_client_task() ) {
+        // queue the message for the network task. The queue has a single producer,
+        // so messages from other tasks (e.g. WiFi event logging, or the network
+        // task of another connection) are dropped, as are all messages from
+        // other tasks when this connection has no network task
+        MqttMessage queued;
+        queued.type = mqtt_message_type::PUBLISH;
+        queued.qos = qos;
+        queued.retained = retained;
+        if ( ! is_network_task_running()
+            || xTaskGetCurrentTaskHandle() != _app_task_handle
+            || length > queued.payload.capacity()
+            || ! _join_topic(queued.topic, topic_prefix, topic_suffix) ) {
+            number_dropped_messages++;
+            return(1);
+        }
+        queued.payload.assign((const char *)payload, length);
+        if ( ! _queues->outbound.push(queued) ) {
+            number_dropped_messages++;
+            return(1);
+        }
+        return(0);
+    }
+
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    if ( ! _join_topic(topic, topic_prefix, topic_suffix) ) {
+        number_dropped_messages++;
+        return(1);
+    }
+    if ( qos == mqtt_qos::AT_LEAST_ONCE ) {
+        return(_publish_qos1(topic.c_str(), payload, length, retained));
+    }
+    return(_publish_now(topic.c_str(), payload, length, retained));
+}
+
+int Connection::_publish_now(const char * topic, const uint8_t * payload, size_t length, bool retained)
+{
+    if (_mqtt_led_pin != NO_LED_PIN) { digitalWrite(_mqtt_led_pin, LOW); }
+    // stream the payload to the client instead of copying it into the packet buffer
+    bool published = _mqtt_client.beginPublish(topic, length, retained);
+    if ( published && length > 0 ) {
+        published = (_mqtt_client.write(payload, length) == length);
+    }
+    if ( published && _mqtt_client.endPublish() ) {
+        number_published_messages++;
         _mqtt_ok = true;
         set_status_leds();
+        if ( ! _first_publish_done ) {
+            _first_publish_done = true;
+            log_info("First publish %lums after power-on", (unsigned long)(esp_timer_get_time() / 1000));
+        }
         return(0);
     }
     else {
@@ -327,24 +989,168 @@ int Connection::publish(etl::string<128> topic, etl::string<256> message)
         set_status_leds();
         return(1);
     }
-    
 }
 
-void Connection::publish_log(etl::string<256> log_message) {
+topic_handle_t Connection::register_topic(etl::string_view topic_prefix, etl::string_view topic_suffix)
+{
+    // register a topic once, typically in begin(), and publish to it by handle
+    return(_topic_table.add(topic_prefix, topic_suffix));
+}
+
+etl::string_view Connection::get_topic(topic_handle_t topic)
+{
+    return(_topic_table.get(topic));
+}
+
+int Connection::_publish_qos1(const char * topic, const uint8_t * payload, size_t length, bool retained)
+{
+    // PubSubClient only publishes QoS 0, so QoS 1 packets are written to the
+    // transport here and acknowledged through _on_puback()
+    if ( length > MQTT_MAX_QUEUED_PAYLOAD_LENGTH ) {
+        return(_publish_now(topic, payload, length, retained));
+    }
+
+    _remove_acked_inflight();
+    if ( _inflight.full() ) {
+        // window full, send without delivery guarantee rather than wait for acks
+        number_qos1_downgrades++;
+        log_warning("QoS 1 window full, %s sent as QoS 0", topic);
+        return(_publish_now(topic, payload, length, retained));
+    }
+
+    _last_packet_id = (_last_packet_id == 0xffff) ? MQTT_FIRST_PACKET_ID : _last_packet_id + 1;
+    InFlightMessage message;
+    message.packet_id = _last_packet_id;
+    message.retries = 0;
+    message.retained = retained;
+    message.acked = false;
+    message.topic.assign(topic);
+    message.payload.assign((const char *)payload, length);
+    message.sent_ms = millis();
+    _inflight.push_back(message);
+    number_published_messages++;
+    _send_qos1(_inflight.back(), false);
+    return(0); // retransmitted from _check_inflight() or after a reconnect if the send failed
+}
+
+int Connection::_send_qos1(InFlightMessage & message, bool duplicate)
+{
+    if ( ! _mqtt_client.connected() ) {
+        return(1);
+    }
+    message.sent_ms = millis();
+    if (_mqtt_led_pin != NO_LED_PIN) { digitalWrite(_mqtt_led_pin, LOW); }
+
+    size_t topic_length = message.topic.size();
+    size_t payload_length = message.payload.size();
+    uint32_t remaining_length = 2 + topic_length + 2 + payload_length;
+
+    uint8_t header[7]; // fixed header, up to 4 length bytes and topic length
+    size_t header_length = 0;
+    header[header_length++] = 0x32 | (duplicate ? 0x08 : 0x00) | (message.retained ? 0x01 : 0x00); // PUBLISH, QoS 1
+    do {
+        uint8_t digit = remaining_length % 128;
+        remaining_length /= 128;
+        if (remaining_length > 0) {
+            digit |= 0x80;
+        }
+        header[header_length++] = digit;
+    } while (remaining_length > 0);
+    header[header_length++] = topic_length >> 8;
+    header[header_length++] = topic_length & 0xff;
+    uint8_t packet_id[2] = { (uint8_t)(message.packet_id >> 8), (uint8_t)(message.packet_id & 0xff) };
+
+    size_t written = _transport.write(header, header_length);
+    written += _transport.write((const uint8_t *)message.topic.data(), topic_length);
+    written += _transport.write(packet_id, 2);
+    written += _transport.write((const uint8_t *)message.payload.data(), payload_length);
+
+    _mqtt_ok = (written == header_length + topic_length + 2 + payload_length);
+    set_status_leds();
+    return(_mqtt_ok ? 0 : 1);
+}
+
+void Connection::_check_inflight()
+{
+    // retransmit unacknowledged QoS 1 messages, give up after MQTT_MAX_RETRIES.
+    // Nothing is retried while disconnected, _resend_inflight() sends it all on reconnect
+    _remove_acked_inflight();
+    if ( ! _mqtt_client.connected() ) {
+        return;
+    }
+    uint8_t given_up = 0;
+    size_t i = 0;
+    while (i < _inflight.size()) {
+        InFlightMessage & message = _inflight[i];
+        if ( millis() - message.sent_ms < MQTT_RETRY_INTERVAL_MS ) {
+            i++;
+            continue;
+        }
+        if ( message.retries >= MQTT_MAX_RETRIES ) {
+            _inflight.erase(_inflight.begin() + i);
+            number_dropped_messages++;
+            given_up++;
+            continue;
+        }
+        message.retries++;
+        number_retransmissions++;
+        _send_qos1(message, true);
+        i++;
+    }
+    if ( given_up > 0 ) {
+        log_warning("%d QoS 1 messages not acknowledged after %d retries", given_up, MQTT_MAX_RETRIES);
+    }
+}
+
+void Connection::_resend_inflight()
+{
+    // the link was down, so these do not use up a retry
+    _remove_acked_inflight();
+    for (InFlightMessage & message : _inflight) {
+        number_retransmissions++;
+        _send_qos1(message, true);
+    }
+}
+
+void Connection::_remove_acked_inflight()
+{
+    size_t i = 0;
+    while (i < _inflight.size()) {
+        if (_inflight[i].acked) {
+            _inflight.erase(_inflight.begin() + i);
+        }
+        else {
+            i++;
+        }
+    }
+}
+
+void Connection::_on_puback(uint16_t packet_id)
+{
+    // called from inside the client loop, so only mark the message here.
+    // Acks for unknown packet ids (duplicates) are ignored.
+    for (size_t i = 0; i < _inflight.size(); i++) {
+        if (_inflight[i].packet_id == packet_id) {
+            _inflight[i].acked = true;
+            return;
+        }
+    }
+}
+
+void Connection::publish_log(etl::string_view log_message) {
     publish(_log_topic, log_message);
 }
 
+void Connection::publish_response(etl::string_view correlation, etl::string_view line) {
+    etl::string<MQTT_MAX_QUEUED_PAYLOAD_LENGTH> response(correlation.begin(), correlation.end());
+    response.push_back('|');
+    response.append(line.begin(), line.end());
+    publish(_response_topic, response);
+}
+
 etl::string<64> Connection::get_time_string() {
-    struct tm timeinfo;
-    // Get the local time, with a 1 second timeout for initial sync
-    if (!getLocalTime(&timeinfo, 1000)) { 
-        log_error("Failed to obtain time");
-    }
-    char timeString[100]; // Buffer to hold the formatted time string
-    // Format the time using strftime
-    strftime(timeString, sizeof(timeString), "%A, %B %d %Y %H:%M:%S", &timeinfo);
-    return(timeString);
-    
+    // never blocks, see WallClock
+    return(wall_clock.get_time_string());
 }
 
 void Connection::register_action(etl::string<64> topic, std::function<void(etl::string<16>)> func) {
@@ -381,6 +1187,7 @@ void WiFiStationConnected(WiFiEvent_t event, WiFiEventInfo_t info) {
 }
 
 void WiFiStationDisconnected(WiFiEvent_t event, WiFiEventInfo_t info) {
+    wifi_got_ip = false;
     log_debug("ARDUINO_EVENT_WIFI_STA_DISCONNECTED");
 }
 
@@ -389,6 +1196,7 @@ void WiFiStationAuthmodeChange(WiFiEvent_t event, WiFiEventInfo_t info) {
 }
 
 void WiFiStationGotIp(WiFiEvent_t event, WiFiEventInfo_t info) {
+    wifi_got_ip = true;
     log_debug("ARDUINO_EVENT_WIFI_STA_GOT_IP");
 }
 
@@ -397,6 +1205,7 @@ void WiFiStationGotIp6(WiFiEvent_t event, WiFiEventInfo_t info) {
 }
 
 void WiFiStationLostIp(WiFiEvent_t event, WiFiEventInfo_t info) {
+    wifi_got_ip = false;
     log_debug("ARDUINO_EVENT_WIFI_STA_LOST_IP");
 }
 
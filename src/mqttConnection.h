@@ -5,15 +5,106 @@
 #include <WiFi.h>
 #include <WiFiClientSecure.h>
 #include <WiFiClient.h>
+#include <Preferences.h>
 #include "logging.h"
 #include <etl/string.h>
 #include <etl/to_arithmetic.h>
+#include <etl/string_view.h>
+#include <etl/span.h>
 #include "command.h"
+#include "spsc_queue.h"
+#include "topic_table.h"
+#include "mqtt_transport.h"
+#include "wall_clock.h"
 #include <functional>
+#include <mutex>
 #include <time.h>
 
 // #define ARDUINO_IOT_USE_SSL
 #define HEARTBEAT_INTERVAL_MS 5000
+#define HEARTBEAT_VERSION 2
+
+// Heartbeat payload on <topic>/heartbeat. PLAIN is the uptime in ms. HEALTH is
+// one CSV line: version,uptime_ms,loops_per_s,max_loop_us,free_heap,min_free_heap,
+// rssi,published,dropped,inbound_queue,reconnects,reset_reason,qos1_downgrades
+enum class heartbeat_mode : uint8_t {
+    PLAIN,
+    HEALTH
+};
+
+// Network task settings, used when start_network_task() is called
+#define NETWORK_TASK_STACK_SIZE 8192
+#define NETWORK_TASK_PRIORITY 1
+#define NETWORK_QUEUE_DEPTH 16 // messages buffered in each direction, allocated by start_network_task()
+
+#define MQTT_MAX_QUEUED_PAYLOAD_LENGTH 256
+
+// QoS 1 settings
+#define MQTT_INFLIGHT_WINDOW 8 // unacknowledged QoS 1 messages kept for retransmission
+#define MQTT_RETRY_INTERVAL_MS 5000
+#define MQTT_MAX_RETRIES 5
+#define MQTT_FIRST_PACKET_ID 0x8000 // PubSubClient numbers its subscriptions from 1
+
+// PubSubClient packet buffer. It starts small and grows, once, to fit the
+// largest incoming packet seen, up to the limit. Larger packets are dropped,
+// send big payloads with begin_publish() instead.
+#define MQTT_BUFFER_INITIAL_SIZE 512
+#define MQTT_BUFFER_MAX_SIZE 4096
+#define MQTT_BUFFER_STEP 256
+
+#define MQTT_MAX_ROUTES 8
+#define NO_LED_PIN -1 // pass as LED pin for connections without status LEDs
+
+// WiFi join and broker lookup
+#define WIFI_PREFERENCES_NAMESPACE "wifi"   // NVS namespace holding the last access point
+#define WIFI_FAST_REJOIN_TIMEOUT_MS 3000    // fall back to a full scan after this
+#define WIFI_CONNECT_TIMEOUT_MS 1000000     // reboot if WiFi is not up after this
+#define WIFI_GOT_IP_TIMEOUT_MS 2000
+#define BROKER_DNS_TTL_MS 3600000           // re-resolve the broker host after this
+
+enum class mqtt_qos : uint8_t {
+    AT_MOST_ONCE = 0,
+    AT_LEAST_ONCE = 1
+};
+
+enum class mqtt_message_type : uint8_t {
+    PUBLISH,
+    SUBSCRIBE
+};
+
+struct MqttMessage {
+    mqtt_message_type type;
+    mqtt_qos qos;
+    bool retained;
+    int64_t received_us; // esp_timer time of arrival, inbound messages only
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    etl::string<MQTT_MAX_QUEUED_PAYLOAD_LENGTH> payload;
+};
+
+// Queues between the application and the network task. About 7 KB each at the
+// default depth, so they only exist once start_network_task() is called.
+struct NetworkQueues {
+    SpscQueue<MqttMessage, NETWORK_QUEUE_DEPTH> outbound; // application -> network task
+    SpscQueue<MqttMessage, NETWORK_QUEUE_DEPTH> inbound;  // network task -> application
+};
+
+class Connection;
+
+struct Route {
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic_prefix;
+    Connection * target;
+    bool keep_local;
+};
+
+struct InFlightMessage {
+    uint16_t packet_id;
+    uint32_t sent_ms;
+    uint8_t retries;
+    bool retained;
+    bool acked;
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    etl::string<MQTT_MAX_QUEUED_PAYLOAD_LENGTH> payload;
+};
 
 class Connection 
 {
@@ -24,9 +115,9 @@ class Connection
             etl::string<64> wifi_passwd, 
             etl::string<64> mqtt_host, 
             etl::string<64> main_topic, 
-            etl::string<512> sslRootCa = "",
-            etl::string<512> sslCert = "",
-            etl::string<512> sslKey = "",
+            const char * ssl_root_ca = nullptr,
+            const char * ssl_cert = nullptr,
+            const char * ssl_key = nullptr,
             uint16_t mqtt_port = 1883, 
             etl::string<64> mqtt_client_name = "MqttClient", 
             int wifi_led_pin = 4, 
@@ -34,11 +125,25 @@ class Connection
             bool use_ssl= false
         );
         void wifi_mqtt_connect();
+        bool start_network_task(BaseType_t core = 0, UBaseType_t priority = NETWORK_TASK_PRIORITY);
+        bool is_network_task_running();
         void maintain();
         PubSubClient get_mqtt_client();
+        MqttTransport * get_transport();
+        int get_socket_fd();
+        bool has_buffered_input();
         void log_status();
-        int publish(etl::string<128> topic, etl::string<256> message);
-        void publish_log(etl::string<256>);
+        topic_handle_t register_topic(etl::string_view topic_prefix, etl::string_view topic_suffix = etl::string_view());
+        etl::string_view get_topic(topic_handle_t topic);
+        int publish(topic_handle_t topic, etl::string_view message, mqtt_qos qos = mqtt_qos::AT_MOST_ONCE, bool retained = false);
+        int publish(etl::string_view topic, etl::string_view message, mqtt_qos qos = mqtt_qos::AT_MOST_ONCE, bool retained = false);
+        int publish(etl::string_view topic_prefix, etl::string_view topic_suffix, etl::string_view message);
+        int publish_bytes(etl::string_view topic, etl::span<const uint8_t> payload);
+        bool begin_publish(etl::string_view topic, size_t length);
+        size_t write_publish(etl::span<const uint8_t> data);
+        bool end_publish();
+        void publish_log(etl::string_view log_message);
+        void publish_response(etl::string_view correlation, etl::string_view line);
         void set_status_leds();
         etl::string<64> get_time_string();
         void set_wifi_ssid(etl::string<64> ssid);
@@ -49,15 +154,27 @@ class Connection
         void set_mqtt_client_name(etl::string<64> clientName);
         etl::string<64> get_mqtt_client_name();
         void set_mqtt_main_topic(etl::string<64> mainTopic);
+        etl::string<64> get_mqtt_main_topic();
         void subscribe_mqtt_topic(etl::string<64> topic);
-        // void set_ssl_ca(etl::string<64> ca);
-        // void set_ssl_cert(etl::string<64> cert);
-        // void set_ssl_key(etl::string<64> key);
+        void set_ssl_ca(const char * ca);
+        void set_ssl_cert(const char * cert);
+        void set_ssl_key(const char * key);
+        void set_mqtt_buffer_limit(uint16_t max_size);
+        void log_heap(const char * context);
+        void set_static_ip(IPAddress ip, IPAddress gateway, IPAddress subnet, IPAddress dns);
         bool is_connected();
+        uint32_t get_max_loop_us();
         etl::string<128> received_mqtt_topic;
         etl::string<256> received_mqtt_message; // mqtt callback stores payload in this variable
         bool new_mqtt_message;
         uint32_t number_mqtt_callbacks;
+        uint32_t number_dropped_messages;
+        uint32_t number_qos1_downgrades;    // QoS 1 publishes sent as QoS 0 because the window was full
+        uint32_t number_retransmissions;
+        uint32_t number_published_messages;
+        uint32_t number_reconnects;
+        void set_heartbeat_mode(heartbeat_mode mode);
+        void set_sequence_envelope(etl::string_view topic_prefix);
         void loop_mqtt();
         struct Action {
             // size_t index;
@@ -67,9 +184,36 @@ class Connection
             // bool new_action;
         };
         void register_action(etl::string<64> topic, std::function<void(etl::string<16>)> func);
+        bool add_route(etl::string_view topic_prefix, Connection * target, bool keep_local = true);
 
     private:
         void _mqtt_callback(char *callbackTopic, byte *payload, unsigned int payloadLength);
+        void _check_connection();
+        void _handle_message(etl::string<128> & topic, etl::string<256> & message, int64_t received_us);
+        bool _join_topic(etl::istring & topic, etl::string_view topic_prefix, etl::string_view topic_suffix);
+        int _publish(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+            mqtt_qos qos = mqtt_qos::AT_MOST_ONCE, bool retained = false);
+        bool _is_sequenced(etl::string_view topic_prefix, etl::string_view topic_suffix);
+        int _publish_local(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+            mqtt_qos qos, bool retained);
+        bool _route(etl::string_view topic_prefix, etl::string_view topic_suffix, const uint8_t * payload, size_t length,
+            mqtt_qos qos, bool retained);
+        int _publish_now(const char * topic, const uint8_t * payload, size_t length, bool retained = false);
+        int _publish_qos1(const char * topic, const uint8_t * payload, size_t length, bool retained);
+        int _send_qos1(InFlightMessage & message, bool duplicate);
+        void _check_inflight();
+        bool _is_client_task();
+        void _resend_inflight();
+        void _remove_acked_inflight();
+        void _on_puback(uint16_t packet_id);
+        void _publish_heartbeat();
+        bool _wifi_join_fast();
+        void _wifi_join_full();
+        void _save_access_point();
+        void _resolve_broker();
+        void _check_buffer_size();
+        static void _network_task(void * parameter);
+        void _network_loop();
         etl::string<64> _ssid;
         etl::string<64> _passwd;
         etl::string<64> _host;
@@ -85,20 +229,51 @@ class Connection
         WiFiClientSecure _wifi_secure_client = WiFiClientSecure();
         // #endif
 
+        MqttTransport _transport;
         PubSubClient _mqtt_client;
         etl::string<64> _command_topic;
-        etl::string<64> _log_topic;
-        etl::string<64> _heartbeat_topic;
-        etl::string<64> _ssl_root_ca;
-        etl::string<64> _ssl_key;
-        etl::string<64> _ssl_cert;
-        bool _mqtt_ok;
-        bool _wifi_ok;
+        etl::string<64> _ping_topic;
+        topic_handle_t _pong_topic;
+        topic_handle_t _response_topic;
+        int64_t _received_us; // arrival of received_mqtt_message
+        topic_handle_t _log_topic;
+        topic_handle_t _heartbeat_topic;
+        // PEM strings in flash, the secure client keeps the pointers (no copies)
+        const char * _ssl_root_ca;
+        const char * _ssl_key;
+        const char * _ssl_cert;
+        volatile bool _mqtt_ok;
+        volatile bool _wifi_ok;
+        bool _use_static_ip;
+        IPAddress _static_ip;
+        IPAddress _gateway;
+        IPAddress _subnet;
+        IPAddress _dns;
+        IPAddress _broker_ip;
+        bool _broker_ip_valid;
+        uint32_t _broker_ip_resolved_ms;
+        bool _first_publish_done;
+        uint16_t _buffer_limit;
+        uint32_t _buffer_overflow_reported; // largest dropped packet that was logged
         int _wifi_led_pin;
         int _mqtt_led_pin;
         uint32_t _last_number_of_callbacks;
         uint32_t _last_heartbeat_millis;
+        heartbeat_mode _heartbeat_mode;
+        uint32_t _loop_count;        // maintain() calls since the last heartbeat
+        uint32_t _max_loop_us;       // longest time between maintain() calls since the last heartbeat
+        uint32_t _last_maintain_us;
+        bool _sequence_envelope;
+        etl::string<MQTT_MAX_TOPIC_LENGTH> _sequence_prefix; // only topics under it are enveloped
+        uint32_t _sequence_number;
         etl::vector<Action, 20> _action_list;
+        TopicTable _topic_table;
+        etl::vector<InFlightMessage, MQTT_INFLIGHT_WINDOW> _inflight;
+        etl::vector<Route, MQTT_MAX_ROUTES> _routes;
+        uint16_t _last_packet_id;
+        TaskHandle_t _network_task_handle;
+        TaskHandle_t _app_task_handle;
+        NetworkQueues * _queues;     // nullptr until start_network_task()
 };
 
 void WiFiStationWifiReady(WiFiEvent_t event, WiFiEventInfo_t info);
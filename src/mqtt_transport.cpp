@@ -0,0 +1,254 @@
+#include "mqtt_transport.h"
+
+MqttTransport::MqttTransport() {
+    _client = nullptr;
+    _puback_handler = nullptr;
+    _write_length = 0;
+    _flush_threshold = MQTT_TRANSPORT_BUFFER_SIZE;
+    _flush_on_read = false;
+    _bytes_written = 0;
+    _segments_written = 0;
+    _write_calls = 0;
+    _last_connect_ms = 0;
+    _max_connect_ms = 0;
+    _connect_count = 0;
+    _max_incoming_packet = 0;
+    _reset_parser();
+}
+
+void MqttTransport::set_client(Client * client) {
+    _client = client;
+    _reset_parser();
+}
+
+void MqttTransport::set_puback_handler(std::function<void(uint16_t)> handler) {
+    _puback_handler = handler;
+}
+
+void MqttTransport::set_flush_threshold(size_t bytes) {
+    if (bytes > MQTT_TRANSPORT_BUFFER_SIZE) {
+        bytes = MQTT_TRANSPORT_BUFFER_SIZE;
+    }
+    _flush_threshold = bytes;
+}
+
+size_t MqttTransport::flush_writes() {
+    // sends everything gathered since the last flush as one write. What a
+    // short write leaves is kept for the next flush; when nothing could be
+    // sent the connection is closed, so PubSubClient reconnects instead of
+    // carrying on in the middle of a packet
+    if (_write_length == 0) {
+        return(0);
+    }
+    size_t written = _client->write(_write_buffer, _write_length);
+    _bytes_written += written;
+    _segments_written++;
+    if (written == 0) {
+        stop();
+        return(0);
+    }
+    if (written < _write_length) {
+        memmove(_write_buffer, _write_buffer + written, _write_length - written);
+    }
+    _write_length -= written;
+    return(written);
+}
+
+uint32_t MqttTransport::get_bytes_written() {
+    return(_bytes_written);
+}
+
+uint32_t MqttTransport::get_segments_written() {
+    return(_segments_written);
+}
+
+uint32_t MqttTransport::get_write_calls() {
+    return(_write_calls);
+}
+
+uint32_t MqttTransport::get_last_connect_ms() {
+    return(_last_connect_ms);
+}
+
+uint32_t MqttTransport::get_max_connect_ms() {
+    return(_max_connect_ms);
+}
+
+uint32_t MqttTransport::get_connect_count() {
+    return(_connect_count);
+}
+
+uint32_t MqttTransport::get_max_incoming_packet() {
+    return(_max_incoming_packet);
+}
+
+int MqttTransport::_timed_connect(int result, uint32_t start_ms) {
+    // for a secure client this is DNS, TCP and the full TLS handshake
+    _last_connect_ms = millis() - start_ms;
+    if (_last_connect_ms > _max_connect_ms) {
+        _max_connect_ms = _last_connect_ms;
+    }
+    _connect_count++;
+    return(result);
+}
+
+int MqttTransport::connect(IPAddress ip, uint16_t port) {
+    _reset_parser();
+    _write_length = 0;
+    _flush_on_read = true;
+    uint32_t start_ms = millis();
+    return(_timed_connect(_client->connect(ip, port), start_ms));
+}
+
+int MqttTransport::connect(const char * host, uint16_t port) {
+    _reset_parser();
+    _write_length = 0;
+    _flush_on_read = true;
+    uint32_t start_ms = millis();
+    return(_timed_connect(_client->connect(host, port), start_ms));
+}
+
+size_t MqttTransport::write(uint8_t byte) {
+    return(write(&byte, 1));
+}
+
+size_t MqttTransport::write(const uint8_t * buffer, size_t size) {
+    _write_calls++;
+    size_t remaining = size;
+    while (remaining > 0) {
+        if (_write_length == 0 && remaining >= _flush_threshold) {
+            // large write with nothing pending, no point in copying it
+            size_t written = _client->write(buffer, remaining);
+            _bytes_written += written;
+            _segments_written++;
+            if (written == 0) {
+                stop(); // stalled in the middle of a packet
+                return(size - remaining);
+            }
+            buffer += written;
+            remaining -= written;
+            continue;
+        }
+        if (_write_length >= _flush_threshold) {
+            // the rest of a short write is still waiting
+            if (flush_writes() == 0) {
+                return(size - remaining); // connection closed
+            }
+            continue;
+        }
+        size_t chunk = _flush_threshold - _write_length;
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+        memcpy(_write_buffer + _write_length, buffer, chunk);
+        _write_length += chunk;
+        buffer += chunk;
+        remaining -= chunk;
+        if (_write_length >= _flush_threshold && flush_writes() == 0) {
+            return(size - remaining); // connection closed
+        }
+    }
+    return(size);
+}
+
+int MqttTransport::available() {
+    _flush_before_read();
+    return(_client->available());
+}
+
+int MqttTransport::read() {
+    _flush_before_read();
+    int byte = _client->read();
+    if (byte >= 0) {
+        _parse_incoming(byte);
+    }
+    return(byte);
+}
+
+int MqttTransport::read(uint8_t * buffer, size_t size) {
+    _flush_before_read();
+    int length = _client->read(buffer, size);
+    for (int i = 0; i < length; i++) {
+        _parse_incoming(buffer[i]);
+    }
+    return(length);
+}
+
+int MqttTransport::peek() {
+    return(_client->peek());
+}
+
+void MqttTransport::flush() {
+    flush_writes();
+    _client->flush();
+}
+
+void MqttTransport::stop() {
+    _write_length = 0;
+    _client->stop();
+    _reset_parser();
+}
+
+uint8_t MqttTransport::connected() {
+    return(_client != nullptr && _client->connected());
+}
+
+MqttTransport::operator bool() {
+    return(_client != nullptr && *_client);
+}
+
+void MqttTransport::_reset_parser() {
+    _state = HEADER;
+    _packet_type = 0;
+    _remaining_length = 0;
+    _length_multiplier = 1;
+    _length_bytes = 0;
+    _body_position = 0;
+    _packet_id = 0;
+}
+
+void MqttTransport::_flush_before_read() {
+    // while connecting the client waits for CONNACK, so CONNECT has to go out first
+    if (_flush_on_read) {
+        flush_writes();
+    }
+}
+
+void MqttTransport::_parse_incoming(uint8_t byte) {
+    // follows the MQTT framing: fixed header, variable length, body
+    switch (_state) {
+        case HEADER:
+            _flush_on_read = false; // first byte of CONNACK received
+            _packet_type = byte >> 4;
+            _remaining_length = 0;
+            _length_multiplier = 1;
+            _length_bytes = 0;
+            _body_position = 0;
+            _packet_id = 0;
+            _state = LENGTH;
+            break;
+        case LENGTH:
+            _remaining_length += (byte & 0x7f) * _length_multiplier;
+            _length_multiplier *= 128;
+            _length_bytes++;
+            if ( (byte & 0x80) == 0 ) {
+                if (1 + _length_bytes + _remaining_length > _max_incoming_packet) {
+                    _max_incoming_packet = 1 + _length_bytes + _remaining_length;
+                }
+                _state = (_remaining_length == 0) ? HEADER : BODY;
+            }
+            break;
+        case BODY:
+            if (_packet_type == MQTT_PACKET_TYPE_PUBACK && _body_position < 2) {
+                _packet_id = (_packet_id << 8) | byte;
+            }
+            _body_position++;
+            if (_body_position >= _remaining_length) {
+                if (_packet_type == MQTT_PACKET_TYPE_PUBACK && _puback_handler) {
+                    _puback_handler(_packet_id);
+                }
+                _state = HEADER;
+            }
+            break;
+    }
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Client.h>
+#include <functional>
+
+#define MQTT_PACKET_TYPE_PUBACK 4
+#define MQTT_TRANSPORT_BUFFER_SIZE 1436 // one TCP segment (lwIP TCP_MSS)
+
+// Client placed between PubSubClient and the WiFi client.
+// Writes are gathered in a segment sized buffer and sent when it is full or
+// when flush_writes() is called (once per Connection::maintain()), so bursts
+// of small publishes go out as a few full TCP segments. Bytes are never
+// dropped from the buffer: a short write keeps the rest for the next flush,
+// a write that sends nothing closes the connection.
+// Incoming bytes are followed packet by packet so that acknowledgements
+// PubSubClient does not handle (PUBACK) can be reported.
+class MqttTransport : public Client
+{
+    public:
+        MqttTransport();
+        void set_client(Client * client);
+        void set_puback_handler(std::function<void(uint16_t)> handler);
+        void set_flush_threshold(size_t bytes);
+        size_t flush_writes();
+        uint32_t get_bytes_written();
+        uint32_t get_segments_written();
+        uint32_t get_write_calls();
+        uint32_t get_last_connect_ms();
+        uint32_t get_max_connect_ms();
+        uint32_t get_connect_count();
+        uint32_t get_max_incoming_packet();
+
+        int connect(IPAddress ip, uint16_t port) override;
+        int connect(const char * host, uint16_t port) override;
+        size_t write(uint8_t byte) override;
+        size_t write(const uint8_t * buffer, size_t size) override;
+        int available() override;
+        int read() override;
+        int read(uint8_t * buffer, size_t size) override;
+        int peek() override;
+        void flush() override;
+        void stop() override;
+        uint8_t connected() override;
+        operator bool() override;
+
+    private:
+        void _parse_incoming(uint8_t byte);
+        void _reset_parser();
+        void _flush_before_read();
+
+        enum parser_state {
+            HEADER,
+            LENGTH,
+            BODY
+        };
+
+        Client * _client;
+        std::function<void(uint16_t)> _puback_handler;
+        parser_state _state;
+        uint8_t _packet_type;
+        uint32_t _remaining_length;
+        uint32_t _length_multiplier;
+        uint8_t _length_bytes;
+        uint32_t _max_incoming_packet; // largest packet seen, fixed header included
+        uint32_t _body_position;
+        uint16_t _packet_id;
+
+        uint8_t _write_buffer[MQTT_TRANSPORT_BUFFER_SIZE];
+        size_t _write_length;
+        size_t _flush_threshold;
+        bool _flush_on_read; // set while connecting, CONNECT must be sent before CONNACK is awaited
+        uint32_t _bytes_written;
+        uint32_t _segments_written;
+        uint32_t _write_calls;
+
+        // duration of the underlying connect(), including the TLS handshake
+        uint32_t _last_connect_ms;
+        uint32_t _max_connect_ms;
+        uint32_t _connect_count;
+        int _timed_connect(int result, uint32_t start_ms);
+};
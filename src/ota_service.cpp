@@ -0,0 +1,218 @@
+#include "ota_service.h"
+
+OtaService::OtaService(Connection * conn)
+{
+    _conn = conn;
+    _ota_topic = INVALID_TOPIC_HANDLE;
+    _task_handle = nullptr;
+    _listening = false;
+    _enable_requested = false;
+    _state = ota_state::IDLE;
+    _progress = 0;
+    _error = OTA_AUTH_ERROR;
+    _pull_requested = false;
+    _http_failure = false;
+    _reported_state = ota_state::IDLE;
+    _reported_progress = 0;
+    _window_ms = OTA_DEFAULT_WINDOW_S * 1000;
+    _enabled_ms = 0;
+    _restart_at_ms = 0;
+}
+
+void OtaService::begin()
+{
+    // call after conn.connect(). The callbacks run inside ArduinoOTA.handle(),
+    // they only record state which tick() reports
+    _ota_topic = _conn->register_topic(_conn->get_mqtt_main_topic(), "ota");
+    ArduinoOTA.setRebootOnSuccess(false); // reboot from tick() once "done" is published
+    ArduinoOTA
+        .onStart([this]() {
+            _progress = 0;
+            _state = ota_state::UPDATING;
+        })
+        .onEnd([this]() {
+            _progress = 100;
+            _state = ota_state::DONE;
+        })
+        .onProgress([this](unsigned int progress, unsigned int total) {
+            if (total > 0) {
+                _progress = (uint8_t)((uint64_t)progress * 100 / total);
+            }
+        })
+        .onError([this](ota_error_t error) {
+            _error = error;
+            _state = ota_state::FAILED;
+        });
+}
+
+bool OtaService::start_task(BaseType_t core, UBaseType_t priority)
+{
+    if (_task_handle != nullptr) {
+        return(true);
+    }
+    BaseType_t result = xTaskCreatePinnedToCore(
+        _task, "ota", OTA_TASK_STACK_SIZE, this, priority, &_task_handle, core);
+    if (result != pdPASS) {
+        _task_handle = nullptr;
+        log_error("Could not start OTA task");
+        return(false);
+    }
+    log_info("OTA task running on core %d", core);
+    return(true);
+}
+
+void OtaService::enable(uint32_t window_s)
+{
+    // opens (or extends) the window, ArduinoOTA is started by _service()
+    _window_ms = window_s * 1000;
+    _enable_requested = true;
+}
+
+bool OtaService::pull(etl::string_view url)
+{
+    // the download is started and run by _service()
+    if (_pull_requested || _state == ota_state::UPDATING || url.size() > _pull_url.capacity()) {
+        return(false);
+    }
+    _pull_url.assign(url.begin(), url.end());
+    _pull_requested = true;
+    return(true);
+}
+
+bool OtaService::is_pull_pending()
+{
+    // true until _service() has started the download
+    return(_pull_requested);
+}
+
+ota_state OtaService::get_state()
+{
+    return(_state);
+}
+
+uint8_t OtaService::get_progress()
+{
+    return(_progress);
+}
+
+void OtaService::tick()
+{
+    if (_task_handle == nullptr) {
+        _service();
+    }
+    _report();
+}
+
+void OtaService::_task(void * parameter)
+{
+    OtaService * ota = static_cast<OtaService *>(parameter);
+    for (;;) {
+        ota->_service();
+        bool active = (ota->_state == ota_state::WAITING || ota->_state == ota_state::UPDATING);
+        vTaskDelay(pdMS_TO_TICKS(active ? OTA_ACTIVE_POLL_MS : OTA_IDLE_POLL_MS));
+    }
+}
+
+void OtaService::_service()
+{
+    // all ArduinoOTA and HttpUpdater calls are made from here, in the OTA task when it runs
+    if (_pull_requested) {
+        _pull_requested = false;
+        if (_listening) {
+            // both would write the same partition
+            ArduinoOTA.end();
+            _listening = false;
+        }
+        if (_http_updater.start(_pull_url)) {
+            _progress = 0;
+            _state = ota_state::UPDATING;
+        }
+    }
+    if (_http_updater.is_active()) {
+        _http_updater.step();
+        _progress = _http_updater.get_progress();
+        if (_http_updater.get_state() == http_update_state::DONE) {
+            _state = ota_state::DONE;
+        }
+        else if (_http_updater.get_state() == http_update_state::FAILED) {
+            _http_failure = true;
+            _state = ota_state::FAILED;
+        }
+        return;
+    }
+    if (_enable_requested) {
+        _enable_requested = false;
+        if ( ! _listening ) {
+            ArduinoOTA.begin();
+            _listening = true;
+        }
+        _enabled_ms = millis();
+        if (_state != ota_state::UPDATING) {
+            _http_failure = false;
+            _state = ota_state::WAITING;
+        }
+    }
+    if ( ! _listening ) {
+        return;
+    }
+    ArduinoOTA.handle(); // blocks while an upload is transferred
+
+    bool window_expired = (_state == ota_state::WAITING && millis() - _enabled_ms > _window_ms);
+    if (window_expired || _state == ota_state::FAILED) {
+        ArduinoOTA.end();
+        _listening = false;
+        if (window_expired) {
+            _state = ota_state::IDLE;
+        }
+    }
+}
+
+void OtaService::_report()
+{
+    ota_state state = _state;
+    if (state == ota_state::UPDATING && _progress != _reported_progress) {
+        _reported_progress = _progress;
+        char message[16];
+        snprintf(message, sizeof(message), "progress %u", _reported_progress);
+        _conn->publish(_ota_topic, message);
+    }
+    if (state != _reported_state) {
+        char message[32];
+        switch (state) {
+            case ota_state::IDLE:
+                snprintf(message, sizeof(message), "closed");
+                log_info("OTA window closed, no new firmware received");
+                break;
+            case ota_state::WAITING:
+                snprintf(message, sizeof(message), "waiting %lu", (unsigned long)(_window_ms / 1000));
+                log_info("OTA window open for %lu seconds", (unsigned long)(_window_ms / 1000));
+                break;
+            case ota_state::UPDATING:
+                snprintf(message, sizeof(message), "started");
+                log_info("OTA update started");
+                _reported_progress = 0;
+                break;
+            case ota_state::DONE:
+                snprintf(message, sizeof(message), "done");
+                log_info("OTA update written, rebooting");
+                _restart_at_ms = millis() + OTA_RESTART_DELAY_MS;
+                break;
+            case ota_state::FAILED:
+                if (_http_failure) {
+                    snprintf(message, sizeof(message), "failed http %u", (unsigned)_http_updater.get_error());
+                    log_error("Pull update failed with error %u after %lu resumes",
+                        (unsigned)_http_updater.get_error(), (unsigned long)_http_updater.get_resumes());
+                }
+                else {
+                    snprintf(message, sizeof(message), "failed %u", (unsigned)_error);
+                    log_error("OTA update failed with error %u", (unsigned)_error);
+                }
+                break;
+        }
+        _conn->publish(_ota_topic, message, mqtt_qos::AT_LEAST_ONCE);
+        _reported_state = state;
+    }
+    if (state == ota_state::DONE && (int32_t)(millis() - _restart_at_ms) >= 0) {
+        ESP.restart();
+    }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Arduino.h>
+#include <ArduinoOTA.h>
+#include "mqttConnection.h"
+#include "http_updater.h"
+#include "logging.h"
+
+#define OTA_DEFAULT_WINDOW_S 60
+#define OTA_TASK_STACK_SIZE 8192
+#define OTA_TASK_PRIORITY 1
+#define OTA_IDLE_POLL_MS 100   // task poll interval while no window is open
+#define OTA_ACTIVE_POLL_MS 10  // task poll interval while waiting for an upload
+#define OTA_RESTART_DELAY_MS 1000 // time to publish "done" before rebooting
+
+enum class ota_state : uint8_t {
+    IDLE,
+    WAITING,    // window open, listening for an upload
+    UPDATING,
+    DONE,       // new firmware written, reboots shortly
+    FAILED
+};
+
+// ArduinoOTA as a background service. enable() opens a window in which an
+// upload is accepted, pull() downloads a package with HttpUpdater instead.
+// ArduinoOTA.handle() blocks for the whole transfer, so start_task() should
+// be used to keep the application running during updates. Without the task,
+// tick() services both from the main loop.
+// State and progress are published on <topic>/ota from tick(), never from
+// the OTA task.
+class OtaService
+{
+    public:
+        OtaService(Connection * conn);
+        void begin();
+        bool start_task(BaseType_t core = 0, UBaseType_t priority = OTA_TASK_PRIORITY);
+        void enable(uint32_t window_s = OTA_DEFAULT_WINDOW_S);
+        bool pull(etl::string_view url);
+        bool is_pull_pending();
+        void tick();
+        ota_state get_state();
+        uint8_t get_progress();
+
+    private:
+        static void _task(void * parameter);
+        void _service();
+        void _report();
+
+        Connection * _conn;
+        topic_handle_t _ota_topic;
+        TaskHandle_t _task_handle;
+        bool _listening;
+        volatile bool _enable_requested;
+        volatile ota_state _state;
+        volatile uint8_t _progress;
+        volatile ota_error_t _error;
+        HttpUpdater _http_updater;
+        etl::string<HTTP_UPDATE_URL_LENGTH> _pull_url;
+        volatile bool _pull_requested;
+        bool _http_failure; // FAILED came from the pull update
+        ota_state _reported_state;
+        uint8_t _reported_progress;
+        uint32_t _window_ms;
+        uint32_t _enabled_ms;
+        uint32_t _restart_at_ms;
+};
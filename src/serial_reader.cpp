@@ -0,0 +1,140 @@
+#include "serial_reader.h"
+
+static uint16_t crc16_ccitt(const char * data, size_t length)
+{
+    uint16_t crc = 0xFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)(uint8_t)data[i] << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+        }
+    }
+    return(crc);
+}
+
+SerialCommandReader::SerialCommandReader(Stream & stream) : _stream(stream)
+{
+    _last_cr = false;
+    _last_byte_ms = 0;
+    _reset();
+}
+
+void SerialCommandReader::_reset()
+{
+    _state = LINE;
+    _length = 0;
+    _field_length = 0;
+    _frame_length = 0;
+    _skip = 0;
+}
+
+void SerialCommandReader::reply(serial_frame_status status)
+{
+    _stream.write(status == serial_frame_status::OK ? SERIAL_FRAME_ACK : SERIAL_FRAME_NAK);
+    _stream.write((uint8_t)status);
+}
+
+int SerialCommandReader::available()
+{
+    return(_stream.available());
+}
+
+serial_item SerialCommandReader::poll(etl::string_view & item, size_t & budget)
+{
+    // Reads until a line or frame is complete, the stream is empty or budget
+    // bytes have been read. item points into the buffer until the next call.
+    if (_state != LINE && _state != DISCARD && millis() - _last_byte_ms > SERIAL_READER_FRAME_TIMEOUT_MS) {
+        _reset();
+        reply(serial_frame_status::TIMEOUT);
+    }
+
+    while (budget > 0) {
+        int c = _stream.read();
+        if (c < 0) {
+            break;
+        }
+        budget--;
+        _last_byte_ms = millis();
+
+        switch (_state) {
+            case LINE:
+                if (c == '\n' && _last_cr) {
+                    _last_cr = false; // LF of a CRLF
+                    continue;
+                }
+                _last_cr = (c == '\r');
+                if (c == '\r' || c == '\n') {
+                    if (_length == 0) {
+                        continue;
+                    }
+                    item = etl::string_view(_buffer, _length);
+                    _length = 0;
+                    return(serial_item::LINE);
+                }
+                if (_length == 0 && c == SERIAL_FRAME_START) {
+                    _state = FRAME_HEADER;
+                    continue;
+                }
+                if (_length == SERIAL_READER_BUFFER_SIZE) {
+                    log_error("Serial line longer than %d characters, discarded", SERIAL_READER_BUFFER_SIZE);
+                    _length = 0;
+                    _state = DISCARD;
+                    continue;
+                }
+                _buffer[_length++] = c;
+                break;
+
+            case DISCARD:
+                if (c == '\r' || c == '\n') {
+                    _last_cr = (c == '\r');
+                    _state = LINE;
+                }
+                break;
+
+            case FRAME_HEADER:
+                _field[_field_length++] = c;
+                if (_field_length == 2) {
+                    _field_length = 0;
+                    _frame_length = _field[0] | (_field[1] << 8);
+                    if (_frame_length > SERIAL_READER_BUFFER_SIZE) {
+                        _skip = _frame_length + 2; // payload and CRC
+                        _state = FRAME_SKIP;
+                    }
+                    else {
+                        _state = (_frame_length > 0) ? FRAME_DATA : FRAME_CRC;
+                    }
+                }
+                break;
+
+            case FRAME_DATA:
+                _buffer[_length++] = c;
+                if (_length == _frame_length) {
+                    _state = FRAME_CRC;
+                }
+                break;
+
+            case FRAME_CRC:
+                _field[_field_length++] = c;
+                if (_field_length == 2) {
+                    uint16_t crc = _field[0] | (_field[1] << 8);
+                    size_t length = _length;
+                    _reset();
+                    if (crc != crc16_ccitt(_buffer, length)) {
+                        reply(serial_frame_status::CRC);
+                        continue;
+                    }
+                    item = etl::string_view(_buffer, length);
+                    return(serial_item::FRAME);
+                }
+                break;
+
+            case FRAME_SKIP:
+                if (--_skip == 0) {
+                    _reset();
+                    reply(serial_frame_status::TOO_LONG);
+                }
+                break;
+        }
+    }
+    return(serial_item::NONE);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <Arduino.h>
+#include <etl/string_view.h>
+#include "logging.h"
+
+#define SERIAL_READER_BUFFER_SIZE 512       // longest line or frame payload
+#define SERIAL_READER_MAX_BYTES_PER_TICK 256
+#define SERIAL_READER_FRAME_TIMEOUT_MS 500  // a frame with a gap this long is dropped
+
+#define SERIAL_FRAME_START 0x02 // STX
+#define SERIAL_FRAME_ACK 0x06
+#define SERIAL_FRAME_NAK 0x15
+
+enum class serial_item : uint8_t {
+    NONE,
+    LINE,
+    FRAME
+};
+
+enum class serial_frame_status : uint8_t {
+    OK,
+    COMMAND_FAILED,
+    CRC,
+    TOO_LONG,
+    TIMEOUT
+};
+
+// Reads commands from a serial stream. Text lines end with CR, LF or CRLF.
+// A line that does not fit the buffer is reported and discarded up to its
+// end. For bulk transfers from a host a binary frame can be sent instead:
+//   STX <u16 length> <payload> <u16 CRC-16/CCITT-FALSE of the payload>
+// with little endian fields, answered by ACK or NAK followed by a
+// serial_frame_status byte. tools/serial_provision.py sends such frames.
+class SerialCommandReader
+{
+    public:
+        SerialCommandReader(Stream & stream);
+        serial_item poll(etl::string_view & item, size_t & budget);
+        void reply(serial_frame_status status);
+        int available();
+
+    private:
+        void _reset();
+
+        enum reader_state : uint8_t {
+            LINE,
+            DISCARD,        // rest of a line that was too long
+            FRAME_HEADER,
+            FRAME_DATA,
+            FRAME_CRC,
+            FRAME_SKIP      // payload of a frame that was too long
+        };
+
+        Stream & _stream;
+        reader_state _state;
+        char _buffer[SERIAL_READER_BUFFER_SIZE];
+        size_t _length;
+        bool _last_cr;
+        uint8_t _field[2];
+        uint8_t _field_length;
+        uint16_t _frame_length;
+        uint32_t _skip;
+        uint32_t _last_byte_ms;
+};
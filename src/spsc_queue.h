@@ -0,0 +1,58 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Lock-free single producer / single consumer ring buffer.
+// One task may call push() and one (other) task may call pop(). The queue
+// holds SIZE elements, the buffer has one more slot to tell full from empty.
+template <typename T, size_t SIZE>
+class SpscQueue
+{
+    public:
+        SpscQueue() : _head(0), _tail(0) {}
+
+        bool push(const T & item) {
+            size_t head = _head.load(std::memory_order_relaxed);
+            size_t next = _next(head);
+            if (next == _tail.load(std::memory_order_acquire)) {
+                return(false); // full
+            }
+            _buffer[head] = item;
+            _head.store(next, std::memory_order_release);
+            return(true);
+        }
+
+        bool pop(T & item) {
+            size_t tail = _tail.load(std::memory_order_relaxed);
+            if (tail == _head.load(std::memory_order_acquire)) {
+                return(false); // empty
+            }
+            item = _buffer[tail];
+            _tail.store(_next(tail), std::memory_order_release);
+            return(true);
+        }
+
+        bool empty() const {
+            return(_head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire));
+        }
+
+        size_t size() const {
+            size_t head = _head.load(std::memory_order_acquire);
+            size_t tail = _tail.load(std::memory_order_acquire);
+            return((head + SIZE + 1 - tail) % (SIZE + 1));
+        }
+
+        size_t capacity() const {
+            return(SIZE);
+        }
+
+    private:
+        static size_t _next(size_t index) {
+            return((index + 1) % (SIZE + 1));
+        }
+
+        T _buffer[SIZE + 1];
+        std::atomic<size_t> _head;
+        std::atomic<size_t> _tail;
+};
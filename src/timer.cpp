@@ -26,18 +26,17 @@ void Timer::set(float time, char unit)
 void Timer::start() 
 {
     _start_time_ms = millis();
-    log_debug("Timer started at %lu", _start_time_ms);
 }
 
 void Timer::reset()
 {
     _start_time_ms = millis();
-    log_debug("Timer reset at %lu", _start_time_ms);
 }
 
 bool Timer::is_done()
 {
-    if (millis() > (_start_time_ms + _wait_time_ms)) {
+    // elapsed time is a difference, so millis() wrapping does not matter
+    if (millis() - _start_time_ms > _wait_time_ms) {
         Timer::reset();
         return(true);
     }
@@ -46,7 +45,8 @@ bool Timer::is_done()
 
 unsigned long Timer::remaining()
 {
-    return((_start_time_ms + _wait_time_ms) - millis());
+    unsigned long elapsed = millis() - _start_time_ms;
+    return((elapsed < _wait_time_ms) ? _wait_time_ms - elapsed : 0);
 }
 
 // etl::string<32> Timer::get_set_time() {
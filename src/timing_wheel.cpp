@@ -0,0 +1,230 @@
+#include "timing_wheel.h"
+
+#define LEVEL_NONE 0xFF
+#define LEVEL_EXPIRED 0xFE
+
+static uint32_t slots_until(uint64_t occupied, uint8_t slot)
+{
+    // distance (1..64) from slot to the next occupied slot, wrapping around
+    uint8_t from = (slot + 1) & TIMING_WHEEL_SLOT_MASK;
+    uint64_t rotated = (from == 0) ? occupied : (occupied >> from) | (occupied << (TIMING_WHEEL_SLOTS - from));
+    return(__builtin_ctzll(rotated) + 1);
+}
+
+WheelTimer::WheelTimer()
+{
+    _next = nullptr;
+    _prev = nullptr;
+    _deadline_ms = 0;
+    _period_ms = 0;
+    _level = LEVEL_NONE;
+    _slot = 0;
+}
+
+bool WheelTimer::is_scheduled()
+{
+    return(_level != LEVEL_NONE);
+}
+
+uint32_t WheelTimer::get_deadline_ms()
+{
+    return(_deadline_ms);
+}
+
+TimingWheel::TimingWheel()
+{
+    for (uint8_t level = 0; level < TIMING_WHEEL_LEVELS; level++) {
+        for (uint8_t slot = 0; slot < TIMING_WHEEL_SLOTS; slot++) {
+            _slots[level][slot] = nullptr;
+        }
+        _occupied[level] = 0;
+    }
+    _expired = nullptr;
+    _now_ms = 0;
+    _size = 0;
+}
+
+void TimingWheel::schedule(WheelTimer & timer, uint32_t delay_ms, std::function<void()> callback, uint32_t period_ms)
+{
+    cancel(timer);
+    if (_size == 0) {
+        _now_ms = millis(); // nothing to catch up on
+    }
+    timer._deadline_ms = millis() + delay_ms;
+    timer._period_ms = period_ms;
+    timer._callback = callback;
+    _insert(timer);
+    _size++;
+}
+
+void TimingWheel::schedule_every(WheelTimer & timer, uint32_t period_ms, std::function<void()> callback)
+{
+    schedule(timer, period_ms, callback, period_ms);
+}
+
+void TimingWheel::cancel(WheelTimer & timer)
+{
+    if (timer.is_scheduled()) {
+        _unlink(timer);
+        _size--;
+    }
+}
+
+size_t TimingWheel::size()
+{
+    return(_size);
+}
+
+void TimingWheel::_insert(WheelTimer & timer, bool slot_has_run)
+{
+    // the level is chosen by the time left, the slot by the deadline itself
+    int32_t left = (int32_t)(timer._deadline_ms - _now_ms);
+    uint32_t delay = (left < 0) ? 0 : left;
+    if (delay > TIMING_WHEEL_MAX_DELAY_MS) {
+        delay = TIMING_WHEEL_MAX_DELAY_MS; // comes back to _expire() early and is inserted again
+    }
+    uint32_t target = _now_ms + delay;
+    uint8_t level = 0;
+    while (level < TIMING_WHEEL_LEVELS - 1 && delay >= (1UL << (TIMING_WHEEL_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+    uint8_t slot = (target >> (TIMING_WHEEL_SLOT_BITS * level)) & TIMING_WHEEL_SLOT_MASK;
+    if (delay == 0 && slot_has_run) {
+        // due now but the current slot has run already, take the next one
+        slot = (slot + 1) & TIMING_WHEEL_SLOT_MASK;
+    }
+
+    timer._level = level;
+    timer._slot = slot;
+    timer._prev = nullptr;
+    timer._next = _slots[level][slot];
+    if (timer._next != nullptr) {
+        timer._next->_prev = &timer;
+    }
+    _slots[level][slot] = &timer;
+    _occupied[level] |= (1ULL << slot);
+}
+
+void TimingWheel::_unlink(WheelTimer & timer)
+{
+    if (timer._prev != nullptr) {
+        timer._prev->_next = timer._next;
+    }
+    else if (timer._level == LEVEL_EXPIRED) {
+        _expired = timer._next;
+    }
+    else {
+        _slots[timer._level][timer._slot] = timer._next;
+        if (timer._next == nullptr) {
+            _occupied[timer._level] &= ~(1ULL << timer._slot);
+        }
+    }
+    if (timer._next != nullptr) {
+        timer._next->_prev = timer._prev;
+    }
+    timer._next = nullptr;
+    timer._prev = nullptr;
+    timer._level = LEVEL_NONE;
+}
+
+void TimingWheel::_cascade(uint8_t level)
+{
+    // the slot's span has started, move its timers to lower levels
+    uint8_t slot = (_now_ms >> (TIMING_WHEEL_SLOT_BITS * level)) & TIMING_WHEEL_SLOT_MASK;
+    WheelTimer * timer = _slots[level][slot];
+    _slots[level][slot] = nullptr;
+    _occupied[level] &= ~(1ULL << slot);
+    while (timer != nullptr) {
+        WheelTimer * next = timer->_next;
+        _insert(*timer, false); // _expire() runs the current slot next
+        timer = next;
+    }
+}
+
+void TimingWheel::_expire()
+{
+    uint8_t slot = _now_ms & TIMING_WHEEL_SLOT_MASK;
+    if ((_occupied[0] & (1ULL << slot)) == 0) {
+        return;
+    }
+    // the list is moved to _expired so callbacks can cancel timers in it
+    _expired = _slots[0][slot];
+    _slots[0][slot] = nullptr;
+    _occupied[0] &= ~(1ULL << slot);
+    for (WheelTimer * timer = _expired; timer != nullptr; timer = timer->_next) {
+        timer->_level = LEVEL_EXPIRED;
+    }
+
+    while (_expired != nullptr) {
+        WheelTimer & timer = *_expired;
+        _unlink(timer);
+        if ((int32_t)(timer._deadline_ms - _now_ms) > 0) {
+            _insert(timer); // longer than the wheel, not due yet
+            continue;
+        }
+        std::function<void()> callback = timer._callback; // the callback may schedule its timer again
+        if (timer._period_ms > 0) {
+            timer._deadline_ms += timer._period_ms;
+            if ((int32_t)(timer._deadline_ms - _now_ms) <= 0) {
+                timer._deadline_ms = _now_ms + timer._period_ms; // fell behind, skip the missed periods
+            }
+            _insert(timer);
+        }
+        else {
+            _size--;
+        }
+        callback();
+    }
+}
+
+void TimingWheel::tick()
+{
+    // runs every timer that is due, in deadline order
+    uint32_t now_ms = millis();
+    if (_size == 0) {
+        _now_ms = now_ms;
+        return;
+    }
+    while ((int32_t)(now_ms - _now_ms) > 0) {
+        if (_occupied[0] == 0) {
+            // nothing in the lowest level, skip to the end of its span
+            uint32_t last_in_span = _now_ms | TIMING_WHEEL_SLOT_MASK;
+            if ((int32_t)(now_ms - last_in_span) <= 0) {
+                _now_ms = now_ms;
+                break;
+            }
+            _now_ms = last_in_span;
+        }
+        _now_ms++;
+        for (uint8_t level = TIMING_WHEEL_LEVELS - 1; level > 0; level--) {
+            if ((_now_ms & ((1UL << (TIMING_WHEEL_SLOT_BITS * level)) - 1)) == 0) {
+                _cascade(level);
+            }
+        }
+        _expire();
+    }
+}
+
+uint32_t TimingWheel::next_deadline_ms()
+{
+    // time until tick() has work to do; may be early for timers in the upper
+    // levels, which only move down a level at that point
+    if (_size == 0) {
+        return(TIMING_WHEEL_IDLE);
+    }
+    uint32_t next = TIMING_WHEEL_IDLE;
+    for (uint8_t level = 0; level < TIMING_WHEEL_LEVELS; level++) {
+        if (_occupied[level] == 0) {
+            continue;
+        }
+        uint8_t shift = TIMING_WHEEL_SLOT_BITS * level;
+        uint32_t span = _now_ms >> shift;
+        uint32_t start = (span + slots_until(_occupied[level], span & TIMING_WHEEL_SLOT_MASK)) << shift;
+        uint32_t wait = start - _now_ms;
+        if (wait < next) {
+            next = wait;
+        }
+    }
+    uint32_t behind = millis() - _now_ms;
+    return((next > behind) ? next - behind : 0);
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#define TIMING_WHEEL_LEVELS 4
+#define TIMING_WHEEL_SLOT_BITS 6
+#define TIMING_WHEEL_SLOTS (1 << TIMING_WHEEL_SLOT_BITS)
+#define TIMING_WHEEL_SLOT_MASK (TIMING_WHEEL_SLOTS - 1)
+#define TIMING_WHEEL_MAX_DELAY_MS ((1UL << (TIMING_WHEEL_LEVELS * TIMING_WHEEL_SLOT_BITS)) - 1) // about 4.6 hours
+#define TIMING_WHEEL_IDLE 0xFFFFFFFF // next_deadline_ms() with no timers scheduled
+
+class TimingWheel;
+
+// A deadline registered with a TimingWheel. The owner keeps it alive while it
+// is scheduled (usually as a member), the wheel only links it into its slots.
+class WheelTimer
+{
+    public:
+        WheelTimer();
+        bool is_scheduled();
+        uint32_t get_deadline_ms();
+
+    private:
+        friend class TimingWheel;
+        WheelTimer * _next;
+        WheelTimer * _prev;
+        uint32_t _deadline_ms;
+        uint32_t _period_ms;    // 0 for one-shot timers
+        uint8_t _level;
+        uint8_t _slot;
+        std::function<void()> _callback;
+};
+
+// Hierarchical timing wheel in milliseconds: four levels of 64 slots, each
+// level 64 times coarser than the one below. Scheduling and cancelling are
+// O(1), timers move down a level when their slot comes up. Deadlines are
+// compared as differences, so millis() wrapping after 49 days is harmless.
+// Delays longer than TIMING_WHEEL_MAX_DELAY_MS are rescheduled on the way.
+// Callbacks run from tick() and may schedule or cancel any timer.
+class TimingWheel
+{
+    public:
+        TimingWheel();
+        void schedule(WheelTimer & timer, uint32_t delay_ms, std::function<void()> callback, uint32_t period_ms = 0);
+        void schedule_every(WheelTimer & timer, uint32_t period_ms, std::function<void()> callback);
+        void cancel(WheelTimer & timer);
+        void tick();
+        uint32_t next_deadline_ms();
+        size_t size();
+
+    private:
+        void _insert(WheelTimer & timer, bool slot_has_run = true);
+        void _unlink(WheelTimer & timer);
+        void _cascade(uint8_t level);
+        void _expire();
+
+        WheelTimer * _slots[TIMING_WHEEL_LEVELS][TIMING_WHEEL_SLOTS];
+        uint64_t _occupied[TIMING_WHEEL_LEVELS]; // one bit per non-empty slot
+        WheelTimer * _expired;                   // slot being run by tick()
+        uint32_t _now_ms;                        // wheel time, trails millis()
+        size_t _size;
+};
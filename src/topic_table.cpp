@@ -0,0 +1,56 @@
+#include "topic_table.h"
+
+TopicTable::TopicTable() {
+    _pool.clear();
+    _topics.clear();
+}
+
+topic_handle_t TopicTable::add(etl::string_view topic_prefix, etl::string_view topic_suffix)
+{
+    // returns the handle of <topic_prefix>/<topic_suffix>, or INVALID_TOPIC_HANDLE
+    // if the topic does not fit. Registering the same topic twice returns the same handle.
+    size_t length = topic_prefix.size();
+    if ( ! topic_suffix.empty() ) {
+        length += 1 + topic_suffix.size();
+    }
+    etl::string<MQTT_MAX_TOPIC_LENGTH> topic;
+    if ( length > topic.capacity() ) {
+        log_error("Topic %.*s/%.*s is %d characters, max is %d",
+            (int)topic_prefix.size(), topic_prefix.data(), (int)topic_suffix.size(), topic_suffix.data(),
+            length, MQTT_MAX_TOPIC_LENGTH);
+        return(INVALID_TOPIC_HANDLE);
+    }
+    topic.assign(topic_prefix.data(), topic_prefix.size());
+    if ( ! topic_suffix.empty() ) {
+        topic.push_back('/');
+        topic.append(topic_suffix.data(), topic_suffix.size());
+    }
+
+    for (size_t i = 0; i < _topics.size(); i++) {
+        if (get(i) == etl::string_view(topic.data(), topic.size())) {
+            return(i);
+        }
+    }
+    if ( _topics.full() || topic.size() > _pool.available() ) {
+        log_error("Topic table full, cannot register %s", topic.c_str());
+        return(INVALID_TOPIC_HANDLE);
+    }
+    _topics.push_back({(uint16_t)_pool.size(), (uint8_t)topic.size()});
+    _pool.append(topic);
+    return(_topics.size() - 1);
+}
+
+etl::string_view TopicTable::get(topic_handle_t handle) {
+    if ( ! is_valid(handle) ) {
+        return(etl::string_view());
+    }
+    return(etl::string_view(_pool.data() + _topics[handle].start, _topics[handle].length));
+}
+
+bool TopicTable::is_valid(topic_handle_t handle) {
+    return(handle < _topics.size());
+}
+
+size_t TopicTable::size() {
+    return(_topics.size());
+}
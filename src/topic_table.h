@@ -0,0 +1,38 @@
+#pragma once
+
+#include <Arduino.h>
+#include <etl/string.h>
+#include <etl/string_view.h>
+#include <etl/vector.h>
+#include "logging.h"
+
+#define MQTT_TOPIC_STRING_LENGTH 64
+#define MQTT_MAX_TOPIC_LENGTH 128
+#define TOPIC_TABLE_SIZE 64
+#define TOPIC_TABLE_POOL_SIZE 4096 // characters of all registered topics together
+#define INVALID_TOPIC_HANDLE 0xFF
+
+typedef uint8_t topic_handle_t;
+
+// Interned MQTT topics. Capabilities register their full topics once in
+// begin() and publish with the returned handle, so the hot publish path
+// never concatenates topic strings. The topics are stored back to back in
+// one pool, so a topic may be up to MQTT_MAX_TOPIC_LENGTH without every
+// entry taking that much.
+class TopicTable
+{
+    public:
+        TopicTable();
+        topic_handle_t add(etl::string_view topic_prefix, etl::string_view topic_suffix = etl::string_view());
+        etl::string_view get(topic_handle_t handle);
+        bool is_valid(topic_handle_t handle);
+        size_t size();
+
+    private:
+        struct TopicEntry {
+            uint16_t start;
+            uint8_t length;
+        };
+        etl::string<TOPIC_TABLE_POOL_SIZE> _pool; // only appended to, views stay valid
+        etl::vector<TopicEntry, TOPIC_TABLE_SIZE> _topics;
+};
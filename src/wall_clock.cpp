@@ -0,0 +1,94 @@
+#include "wall_clock.h"
+#include <sys/time.h>
+#include <esp_timer.h>
+#include <esp_sntp.h>
+
+WallClock wall_clock;
+
+// set from the SNTP task when the system time has been (re)synced
+static volatile bool time_sync_event = false;
+
+// the 64 bit offset is written and read from more than one task
+static portMUX_TYPE epoch_offset_lock = portMUX_INITIALIZER_UNLOCKED;
+
+static void on_time_sync(struct timeval * tv) {
+    time_sync_event = true;
+}
+
+WallClock::WallClock() {
+    _started = false;
+    _synced = false;
+    _epoch_offset_us = 0;
+}
+
+void WallClock::begin(long gmt_offset_s, int daylight_offset_s) {
+    // configTime() restarts SNTP, so it is only called once and not on every reconnect
+    if (_started) {
+        return;
+    }
+    sntp_set_time_sync_notification_cb(on_time_sync);
+    configTime(gmt_offset_s, daylight_offset_s, NTP_SERVER_1, NTP_SERVER_2, NTP_SERVER_3);
+    _started = true;
+}
+
+void WallClock::_update() {
+    if (_synced && !time_sync_event) {
+        return;
+    }
+    struct timeval now;
+    gettimeofday(&now, nullptr);
+    if (now.tv_sec < MIN_VALID_EPOCH_S) {
+        return; // still waiting for the first sync
+    }
+    time_sync_event = false;
+    int64_t offset_us = (int64_t)now.tv_sec * 1000000LL + now.tv_usec - esp_timer_get_time();
+    portENTER_CRITICAL(&epoch_offset_lock);
+    _epoch_offset_us = offset_us;
+    _synced = true;
+    portEXIT_CRITICAL(&epoch_offset_lock);
+}
+
+bool WallClock::is_synced() {
+    _update();
+    return(_synced);
+}
+
+uint64_t WallClock::get_epoch_ms() {
+    // returns 0 until the clock is synced
+    if (!is_synced()) {
+        return(0);
+    }
+    portENTER_CRITICAL(&epoch_offset_lock);
+    int64_t offset_us = _epoch_offset_us;
+    portEXIT_CRITICAL(&epoch_offset_lock);
+    return((esp_timer_get_time() + offset_us) / 1000);
+}
+
+etl::string<64> WallClock::get_time_string() {
+    if (!is_synced()) {
+        return("Time not synced");
+    }
+    time_t seconds = get_epoch_ms() / 1000;
+    struct tm timeinfo;
+    localtime_r(&seconds, &timeinfo);
+    char time_string[64];
+    strftime(time_string, sizeof(time_string), "%A, %B %d %Y %H:%M:%S", &timeinfo);
+    return(time_string);
+}
+
+void WallClock::get_log_timestamp(etl::istring & timestamp) {
+    // HH:MM:SS.mmm local time, or seconds since boot when not synced
+    timestamp.clear();
+    if (!is_synced()) {
+        etl::to_string((float)millis() / 1000.0f, timestamp, etl::format_spec().precision(1), false);
+        return;
+    }
+    uint64_t epoch_ms = get_epoch_ms();
+    time_t seconds = epoch_ms / 1000;
+    struct tm timeinfo;
+    localtime_r(&seconds, &timeinfo);
+    char time_string[16];
+    snprintf(time_string, sizeof(time_string), "%02d:%02d:%02d.%03d",
+        timeinfo.tm_hour, timeinfo.tm_min, timeinfo.tm_sec, (int)(epoch_ms % 1000));
+    timestamp.assign(time_string);
+}
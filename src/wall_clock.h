@@ -0,0 +1,33 @@
+#pragma once
+
+#include <Arduino.h>
+#include <etl/string.h>
+#include <etl/to_string.h>
+#include <time.h>
+
+#define NTP_SERVER_1 "0.no.pool.ntp.org"
+#define NTP_SERVER_2 "1.no.pool.ntp.org"
+#define NTP_SERVER_3 "2.no.pool.ntp.org"
+#define MIN_VALID_EPOCH_S 1700000000 // anything earlier means the clock is not synced
+
+// Non-blocking wall clock. SNTP runs in the background after begin(); when
+// it has synced, the offset between the monotonic esp_timer clock and the
+// epoch is stored, so reading the time is an addition and never waits.
+class WallClock
+{
+    public:
+        WallClock();
+        void begin(long gmt_offset_s = 3600, int daylight_offset_s = 3600);
+        bool is_synced();
+        uint64_t get_epoch_ms();
+        etl::string<64> get_time_string();
+        void get_log_timestamp(etl::istring & timestamp);
+
+    private:
+        void _update();
+        bool _started;
+        bool _synced;
+        int64_t _epoch_offset_us; // epoch time minus esp_timer_get_time()
+};
+
+extern WallClock wall_clock;
@@ -0,0 +1,130 @@
+#include "work_item.h"
+#include "logging.h"
+
+WorkItem * WorkItem::_items = nullptr;
+
+uint32_t run_slice(const std::function<bool()> & step, uint32_t budget_us)
+{
+    uint32_t start_us = micros();
+    while (step() && micros() - start_us < budget_us) {
+    }
+    return(micros() - start_us);
+}
+
+WorkItem::WorkItem(const char * name, work_step_function_t step, uint32_t budget_us)
+{
+    _name = name;
+    _step = step;
+    _budget_us = budget_us;
+    _running = false;
+    _next_step = 0;
+    _ticks = 0;
+    _started_ms = 0;
+    _stats = WorkItemStats();
+    _next_item = _items;
+    _items = this;
+}
+
+WorkItem::~WorkItem()
+{
+    for (WorkItem ** item = &_items; *item != nullptr; item = &(*item)->_next_item) {
+        if (*item == this) {
+            *item = _next_item;
+            break;
+        }
+    }
+}
+
+bool WorkItem::start()
+{
+    // a run in progress carries on, it picks up newer values in later steps
+    if (_running) {
+        _stats.skipped++;
+        return(false);
+    }
+    _running = true;
+    _next_step = 0;
+    _ticks = 0;
+    _started_ms = millis();
+    return(true);
+}
+
+void WorkItem::cancel()
+{
+    _running = false;
+}
+
+bool WorkItem::is_running()
+{
+    return(_running);
+}
+
+void WorkItem::set_budget_us(uint32_t budget_us)
+{
+    _budget_us = budget_us;
+}
+
+WorkItemStats WorkItem::get_stats()
+{
+    return(_stats);
+}
+
+void WorkItem::tick()
+{
+    if ( ! _running ) {
+        return;
+    }
+    _ticks++;
+    uint32_t slice_us = run_slice([this]() {
+        work_step result = _step(_next_step);
+        if ( ! _running ) {
+            return(false); // cancelled by the step
+        }
+        if (result == work_step::WAIT) {
+            return(false);
+        }
+        if (result == work_step::DONE) {
+            _finish();
+            return(false);
+        }
+        _next_step++;
+        return(true);
+    }, _budget_us);
+
+    if (slice_us > _stats.max_slice_us) {
+        _stats.max_slice_us = slice_us;
+    }
+}
+
+void WorkItem::_finish()
+{
+    _running = false;
+    _stats.runs++;
+    if (_ticks > _stats.max_ticks) {
+        _stats.max_ticks = _ticks;
+    }
+    uint32_t run_ms = millis() - _started_ms;
+    if (run_ms > _stats.max_run_ms) {
+        _stats.max_run_ms = run_ms;
+    }
+}
+
+void WorkItem::log_all()
+{
+    if (_items == nullptr) {
+        log_response("No work items");
+        return;
+    }
+    for (WorkItem * item = _items; item != nullptr; item = item->_next_item) {
+        WorkItemStats & stats = item->_stats;
+        log_response("%s: %lu runs, %lu skipped, max %lu us per tick (budget %lu us), max %lu ticks, max %lu ms per run%s",
+            item->_name,
+            (unsigned long)stats.runs,
+            (unsigned long)stats.skipped,
+            (unsigned long)stats.max_slice_us,
+            (unsigned long)item->_budget_us,
+            (unsigned long)stats.max_ticks,
+            (unsigned long)stats.max_run_ms,
+            item->_running ? ", running" : "");
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+#include <functional>
+
+#define WORK_ITEM_BUDGET_US 2000 // default time per tick(), one step always runs
+
+enum class work_step : uint8_t {
+    NEXT,   // step done, go on with the next one
+    WAIT,   // not ready, run the same step again on a later tick()
+    DONE    // run finished
+};
+
+typedef std::function<work_step(uint16_t step)> work_step_function_t;
+
+// Calls step() until it returns false or budget_us has passed, at least
+// once. Returns the time used. Shared by WorkItem and command jobs.
+uint32_t run_slice(const std::function<bool()> & step, uint32_t budget_us);
+
+struct WorkItemStats {
+    uint32_t runs;          // runs that reached DONE
+    uint32_t skipped;       // start() while a run was still going
+    uint32_t max_slice_us;  // longest tick()
+    uint32_t max_ticks;     // most tick() calls for one run
+    uint32_t max_run_ms;    // longest time from start() to DONE
+};
+
+// A burst of work, like publishing a set of readings, split into numbered
+// steps so it spreads over several loop iterations. The owner calls start()
+// when there is work and tick() from its own tick(); each tick() runs steps
+// until the budget is used up, a step waits, or the run is done.
+// Steps keep their state in the owner, the item only counts them.
+class WorkItem
+{
+    public:
+        WorkItem(const char * name, work_step_function_t step, uint32_t budget_us = WORK_ITEM_BUDGET_US);
+        ~WorkItem();
+        bool start();
+        void cancel();
+        bool is_running();
+        void tick();
+        void set_budget_us(uint32_t budget_us);
+        WorkItemStats get_stats();
+        static void log_all();
+
+    private:
+        void _finish();
+
+        const char * _name;
+        work_step_function_t _step;
+        uint32_t _budget_us;
+        bool _running;
+        uint16_t _next_step;
+        uint32_t _ticks;        // in the current run
+        uint32_t _started_ms;
+        WorkItemStats _stats;
+        WorkItem * _next_item;  // all items, for log_all()
+        static WorkItem * _items;
+};
@@ -7,6 +7,9 @@ use rumqttc::{Client, Connection, Incoming, QoS, Event};
 use std::time::Instant;
 use std::io::{self, BufRead, Write};
 use std::thread;
+use std::collections::{BTreeMap, HashMap, HashSet};
+use std::sync::mpsc;
+use std::time::{SystemTime, UNIX_EPOCH};
 
 #[derive(Debug)]
 pub struct NoCertificateVerification;
@@ -79,6 +82,239 @@ pub struct Device {
     pub uptime: u32,
 }
 
+/// Health record sent as heartbeat, see heartbeat_mode in mqttConnection.h
+#[derive(Debug, Default)]
+pub struct Heartbeat {
+    pub version: u32,
+    pub uptime: u32,
+    pub loops_per_s: u32,
+    pub max_loop_us: u32,
+    pub free_heap: u32,
+    pub min_free_heap: u32,
+    pub rssi: i32,
+    pub published: u32,
+    pub dropped: u32,
+    pub inbound_queue: u32,
+    pub reconnects: u32,
+    pub reset_reason: i32,
+    pub qos1_downgrades: u32,
+}
+
+/// Parses a heartbeat payload. Devices in plain mode send only the uptime,
+/// the other fields are then zero.
+pub fn parse_heartbeat(payload: &str) -> Option<Heartbeat> {
+    let fields: Vec<&str> = payload.trim().split(',').collect();
+    if fields.len() == 1 {
+        return Some(Heartbeat {
+            uptime: fields[0].parse().ok()?,
+            ..Default::default()
+        });
+    }
+    let version: u32 = fields[0].parse().ok()?;
+    if fields.len() < 12 || version < 1 || version > 2 || (version == 2 && fields.len() < 13) {
+        return None;
+    }
+    Some(Heartbeat {
+        version: version,
+        uptime: fields[1].parse().ok()?,
+        loops_per_s: fields[2].parse().ok()?,
+        max_loop_us: fields[3].parse().ok()?,
+        free_heap: fields[4].parse().ok()?,
+        min_free_heap: fields[5].parse().ok()?,
+        rssi: fields[6].parse().ok()?,
+        published: fields[7].parse().ok()?,
+        dropped: fields[8].parse().ok()?,
+        inbound_queue: fields[9].parse().ok()?,
+        reconnects: fields[10].parse().ok()?,
+        reset_reason: fields[11].parse().ok()?,
+        qos1_downgrades: if version >= 2 { fields[12].parse().ok()? } else { 0 },
+    })
+}
+
+/// Sequence envelope "#<sequence>:<epoch ms>|" that devices put in front of
+/// payloads on the topics given to set_sequence_envelope().
+pub struct Envelope {
+    pub sequence: u64,
+    pub device_ms: u64,
+}
+
+/// Splits a payload into its envelope (if any) and the message
+pub fn strip_envelope(payload: &str) -> (Option<Envelope>, &str) {
+    if let Some(rest) = payload.strip_prefix('#') {
+        if let Some((header, message)) = rest.split_once('|') {
+            if let Some((sequence, device_ms)) = header.split_once(':') {
+                if let (Ok(sequence), Ok(device_ms)) = (sequence.parse(), device_ms.parse()) {
+                    return (Some(Envelope { sequence, device_ms }), message);
+                }
+            }
+        }
+    }
+    (None, payload)
+}
+
+#[derive(Default)]
+struct TopicStats {
+    received: u64,
+    duplicates: u64,
+    reordered: u64,
+    latencies_ms: Vec<i64>,
+}
+
+fn percentile(sorted: &[i64], p: usize) -> i64 {
+    if sorted.is_empty() {
+        return 0;
+    }
+    sorted[(sorted.len() - 1) * p / 100]
+}
+
+/// Subscribes to all topics of a device and reports loss, reordering and
+/// one-way latency. Latency needs the device (NTP) and this host in sync.
+pub fn show_stats_for_device(mqtt_client: Client, mut mqtt_connection: Connection, maintopic: String, device: String, time_to_run_s: u64) {
+    let device_topic: String = format!("{}/{}/#", maintopic, device);
+    mqtt_client.subscribe(device_topic, QoS::AtMostOnce).unwrap();
+
+    let mut topics: BTreeMap<String, TopicStats> = BTreeMap::new();
+    let mut seen: HashSet<u64> = HashSet::new();
+    let mut first_sequence: Option<u64> = None;
+    let mut last_sequence: u64 = 0;
+    let mut unsequenced: u64 = 0;
+    let time_limit = Duration::from_secs(time_to_run_s);
+    let start_time = Instant::now();
+
+    for notification in mqtt_connection.iter() {
+        if start_time.elapsed() >= time_limit {
+            break;
+        }
+        if let Ok(Event::Incoming(Incoming::Publish(publish))) = notification {
+            let payload = String::from_utf8_lossy(&publish.payload);
+            let envelope = match strip_envelope(&payload) {
+                (Some(envelope), _) => envelope,
+                (None, _) => {
+                    unsequenced += 1;
+                    continue;
+                }
+            };
+            let stats = topics.entry(publish.topic.clone()).or_default();
+            stats.received += 1;
+            if !seen.insert(envelope.sequence) {
+                stats.duplicates += 1;
+                continue;
+            }
+            // the first message may be older than the subscription (retained)
+            if first_sequence.is_none() || envelope.sequence < first_sequence.unwrap() {
+                first_sequence = Some(envelope.sequence);
+            }
+            if envelope.sequence < last_sequence {
+                stats.reordered += 1;
+            }
+            last_sequence = last_sequence.max(envelope.sequence);
+            if envelope.device_ms != 0 {
+                let now_ms = SystemTime::now().duration_since(UNIX_EPOCH).unwrap().as_millis() as i64;
+                stats.latencies_ms.push(now_ms - envelope.device_ms as i64);
+            }
+        }
+    }
+
+    let expected = match first_sequence {
+        Some(first) => last_sequence - first + 1,
+        None => 0,
+    };
+    let lost = expected - seen.len() as u64;
+    println!("--- {} for {}s ---", device, time_to_run_s);
+    println!("Sequenced: {} of {} expected, {} lost ({:.2}%), {} without envelope",
+        seen.len(), expected, lost, if expected > 0 { lost as f64 * 100.0 / expected as f64 } else { 0.0 }, unsequenced);
+    println!("{:40} {:>8} {:>6} {:>9} {:>8} {:>8} {:>8} {:>8}", "topic", "received", "dups", "reordered", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    for (topic, stats) in &mut topics {
+        stats.latencies_ms.sort();
+        println!("{:40} {:>8} {:>6} {:>9} {:>8} {:>8} {:>8} {:>8}", topic, stats.received, stats.duplicates, stats.reordered,
+            percentile(&stats.latencies_ms, 50), percentile(&stats.latencies_ms, 90),
+            percentile(&stats.latencies_ms, 99), stats.latencies_ms.last().copied().unwrap_or(0));
+    }
+}
+
+struct Pong {
+    device: String,
+    token: u32,
+    received: Instant,
+    device_us: i64, // time between the device receiving and answering the probe
+}
+
+/// Sends `count` probes to every device, one round every `interval_ms`, and
+/// prints round trip times per device. Devices answer <topic>/<device>/ping
+/// on <topic>/<device>/pong with "<token>,<received us>,<sent us>".
+pub fn ping_devices(mqtt_client: Client, mut mqtt_connection: Connection, maintopic: String, devices: Vec<String>, count: u32, interval_ms: u64) {
+    for device in &devices {
+        mqtt_client.subscribe(format!("{}/{}/pong", maintopic, device), QoS::AtMostOnce).unwrap();
+    }
+
+    let (sender, receiver) = mpsc::channel::<Pong>();
+    thread::spawn(move || {
+        for notification in mqtt_connection.iter() {
+            if let Ok(Event::Incoming(Incoming::Publish(publish))) = notification {
+                let received = Instant::now();
+                let parts: Vec<_> = publish.topic.split("/").collect();
+                let payload = String::from_utf8_lossy(&publish.payload);
+                let fields: Vec<&str> = strip_envelope(&payload).1.split(',').collect();
+                if parts.len() < 2 || fields.len() != 3 {
+                    continue;
+                }
+                if let (Ok(token), Ok(device_received), Ok(device_sent)) =
+                    (fields[0].parse::<u32>(), fields[1].parse::<i64>(), fields[2].parse::<i64>()) {
+                    let pong = Pong { device: parts[1].to_string(), token, received, device_us: device_sent - device_received };
+                    if sender.send(pong).is_err() {
+                        break;
+                    }
+                }
+            }
+        }
+    });
+
+    // wait for the subscriptions before timing anything
+    thread::sleep(Duration::from_millis(500));
+
+    let mut sent: HashMap<(String, u32), Instant> = HashMap::new();
+    let mut rtts_ms: HashMap<String, Vec<f64>> = HashMap::new();
+    let mut device_times_ms: HashMap<String, Vec<f64>> = HashMap::new();
+    let mut collect = |pong: Pong, sent: &HashMap<(String, u32), Instant>| {
+        if let Some(start) = sent.get(&(pong.device.clone(), pong.token)) {
+            rtts_ms.entry(pong.device.clone()).or_default().push(pong.received.duration_since(*start).as_secs_f64() * 1000.0);
+            device_times_ms.entry(pong.device).or_default().push(pong.device_us as f64 / 1000.0);
+        }
+    };
+
+    for token in 0..count {
+        for device in &devices {
+            sent.insert((device.clone(), token), Instant::now());
+            if let Err(err) = mqtt_client.publish(format!("{}/{}/ping", maintopic, device), QoS::AtMostOnce, false, token.to_string()) {
+                eprintln!("Failed to ping {}: {}", device, err);
+            }
+        }
+        let round_end = Instant::now() + Duration::from_millis(interval_ms);
+        while let Ok(pong) = receiver.recv_timeout(round_end.saturating_duration_since(Instant::now())) {
+            collect(pong, &sent);
+        }
+    }
+    // late answers
+    while let Ok(pong) = receiver.recv_timeout(Duration::from_secs(2)) {
+        collect(pong, &sent);
+    }
+
+    println!("{:16} {:>6} {:>9} {:>9} {:>9} {:>12}", "device", "lost", "p50 ms", "p99 ms", "max ms", "device ms");
+    for device in &devices {
+        let mut rtts = rtts_ms.remove(device).unwrap_or_default();
+        let device_times = device_times_ms.remove(device).unwrap_or_default();
+        rtts.sort_by(|a, b| a.partial_cmp(b).unwrap());
+        let lost = count as usize - rtts.len().min(count as usize);
+        if rtts.is_empty() {
+            println!("{:16} {:>6} {:>9} {:>9} {:>9} {:>12}", device, lost, "-", "-", "-", "-");
+            continue;
+        }
+        let p = |p: usize| rtts[(rtts.len() - 1) * p / 100];
+        let device_avg = device_times.iter().sum::<f64>() / device_times.len() as f64;
+        println!("{:16} {:>6} {:>9.1} {:>9.1} {:>9.1} {:>12.2}", device, lost, p(50), p(99), rtts[rtts.len() - 1], device_avg);
+    }
+}
+
 pub fn scan_for_devices_for_seconds(mqtt_client: Client, mut mqtt_connection: Connection, maintopic: String, time_to_scan_s: u64) {
      let heartbeat_topic: String = format!("{}/+/heartbeat", maintopic);
 
@@ -101,8 +337,16 @@ pub fn scan_for_devices_for_seconds(mqtt_client: Client, mut mqtt_connection: Co
             // println!("[{}] {}: {}", i, publish.topic, String::from_utf8_lossy(&publish.payload));
             let parts: Vec<_> = publish.topic.split("/").collect();
             let device = parts[1];
-            let uptime = String::from_utf8_lossy(&publish.payload).parse::<u32>().expect("Uptime is not a number");
-            
+            let payload = String::from_utf8_lossy(&publish.payload);
+            let heartbeat = match parse_heartbeat(strip_envelope(&payload).1) {
+                Some(heartbeat) => heartbeat,
+                None => {
+                    eprintln!("Unknown heartbeat from {}: {}", device, String::from_utf8_lossy(&publish.payload));
+                    continue;
+                }
+            };
+            let uptime = heartbeat.uptime;
+
         let mut is_new_device: bool = true;    
 
         for d in &mut devices {
@@ -120,7 +364,14 @@ pub fn scan_for_devices_for_seconds(mqtt_client: Client, mut mqtt_connection: Co
 
             devices.push(new_device);
             let (d, h, m ,s) = convert_millis_to_hms(uptime);
-            println!("💡 {:16} 🥾 {}d {}h {}m {}s", device, d, h, m, s);
+            if heartbeat.version == 0 {
+                println!("💡 {:16} 🥾 {}d {}h {}m {}s", device, d, h, m, s);
+            } else {
+                println!("💡 {:16} 🥾 {}d {}h {}m {}s  📶 {}dB  🧠 {}/{}  🔁 {}/s max {}us  📤 {} dropped {}  🔌 {} reset {}  ⬇ {}",
+                    device, d, h, m, s, heartbeat.rssi, heartbeat.free_heap, heartbeat.min_free_heap,
+                    heartbeat.loops_per_s, heartbeat.max_loop_us, heartbeat.published, heartbeat.dropped,
+                    heartbeat.reconnects, heartbeat.reset_reason, heartbeat.qos1_downgrades);
+            }
         }
         }
     }
@@ -132,32 +383,47 @@ pub fn show_log_from_device(mqtt_client: Client, mut mqtt_connection: Connection
 
     for (_i, notification) in mqtt_connection.iter().enumerate() {
         if let Ok(Event::Incoming(Incoming::Publish(publish))) = notification {
-            let log_message = String::from_utf8_lossy(&publish.payload);
+            let payload = String::from_utf8_lossy(&publish.payload);
+            let (_envelope, log_message) = strip_envelope(&payload);
             println!("{}", log_message);
         }
     }
 }
 
-pub fn start_interactive(mqtt_client: Client, mut mqtt_connection: Connection, maintopic: String, device: String) {
-    let log_topic: String = format!("{}/{}/log", maintopic, device);
-    let cmd_topic: String = format!("{}/{}/command", maintopic, device);
-    mqtt_client.subscribe(log_topic, QoS::AtMostOnce).unwrap();
+/// Time to wait for the next line of a command response
+const RESPONSE_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Subscribes to the response topic of a device and forwards (correlation, line) pairs
+fn receive_responses(mqtt_client: &Client, mut mqtt_connection: Connection, maintopic: &str, device: &str) -> mpsc::Receiver<(String, String)> {
+    let response_topic: String = format!("{}/{}/response", maintopic, device);
+    mqtt_client.subscribe(response_topic, QoS::AtLeastOnce).unwrap();
 
-    let log_thread = thread::spawn(move || {
+    // responses are "<correlation>|<line>", the last one "<correlation>|END"
+    let (sender, receiver) = mpsc::channel::<(String, String)>();
+    thread::spawn(move || {
         for notification in mqtt_connection.iter() {
             if let Ok(Event::Incoming(Incoming::Publish(publish))) = notification {
-                let log_message = String::from_utf8_lossy(&publish.payload);
-                if log_message.contains("RESPONSE") {
-                    let (_head, cmd_response) = log_message.split_once("]").expect(&format!("Wrong response format: {}", log_message));
-                    println!("{}", cmd_response);
+                let payload = String::from_utf8_lossy(&publish.payload);
+                let (_envelope, response) = strip_envelope(&payload);
+                if let Some((correlation, line)) = response.split_once('|') {
+                    if sender.send((correlation.to_string(), line.to_string())).is_err() {
+                        break;
+                    }
                 }
             }
         }
     });
+    receiver
+}
+
+pub fn start_interactive(mqtt_client: Client, mqtt_connection: Connection, maintopic: String, device: String) {
+    let cmd_topic: String = format!("{}/{}/command", maintopic, device);
+    let receiver = receive_responses(&mqtt_client, mqtt_connection, &maintopic, &device);
 
     println!("Interactive mode started. Type commands and press enter. Type 'exit' to quit.");
     let stdin = io::stdin();
     let prompt = format!("{}> ", device);
+    let mut next_correlation: u32 = 1;
     print!("{}", prompt);
     io::stdout().flush().expect("Failed to flush stdout");
     for line in stdin.lock().lines() {
@@ -167,15 +433,16 @@ pub fn start_interactive(mqtt_client: Client, mut mqtt_connection: Connection, m
                 if command.eq_ignore_ascii_case("exit") {
                     break;
                 }
-                if let Err(err) = mqtt_client.publish(&cmd_topic, QoS::AtMostOnce, false, command) {
-                    eprintln!("Failed to publish command: {}", err);
-                }
                 if command.eq_ignore_ascii_case("help") {
-                    println!("Type \"1\" to get list of commands from device")
+                    println!("Type \"1\" to get list of commands from device. Separate several commands with ';', start with '!' to stop at the first failure")
                 }
-                // prepare for next command
-                if ! command.is_empty() {
-                    thread::sleep(Duration::from_millis(500));
+                else if !command.is_empty() {
+                    let correlation = next_correlation.to_string();
+                    next_correlation += 1;
+                    if let Err(err) = mqtt_client.publish(&cmd_topic, QoS::AtMostOnce, false, format!("@{}:{}", correlation, command)) {
+                        eprintln!("Failed to publish command: {}", err);
+                    }
+                    wait_for_response(&receiver, &correlation);
                 }
                 print!("{}", prompt);
                 io::stdout().flush().expect("Failed to flush stdout");
@@ -186,5 +453,55 @@ pub fn start_interactive(mqtt_client: Client, mut mqtt_connection: Connection, m
             }
         }
     }
-    drop(log_thread);
+}
+
+/// Sends all commands in a file as one script batch. The device runs them in
+/// order and stops at the first failing command.
+pub fn run_script(mqtt_client: Client, mqtt_connection: Connection, maintopic: String, device: String, script: String) -> bool {
+    let cmd_topic: String = format!("{}/{}/command", maintopic, device);
+    let receiver = receive_responses(&mqtt_client, mqtt_connection, &maintopic, &device);
+
+    // one command per line, '#' starts a comment line
+    let commands: Vec<&str> = script.lines()
+        .map(|line| line.trim())
+        .filter(|line| !line.is_empty() && !line.starts_with('#'))
+        .collect();
+    if commands.is_empty() {
+        println!("No commands in script");
+        return true;
+    }
+    let correlation = "script";
+    if let Err(err) = mqtt_client.publish(&cmd_topic, QoS::AtLeastOnce, false, format!("@{}:!{}", correlation, commands.join("\n"))) {
+        eprintln!("Failed to publish script: {}", err);
+        return false;
+    }
+    wait_for_response(&receiver, correlation)
+}
+
+/// Prints response lines for one command until its END marker arrives.
+/// Returns false if the command failed or did not finish.
+fn wait_for_response(receiver: &mpsc::Receiver<(String, String)>, correlation: &str) -> bool {
+    let mut deadline = Instant::now() + RESPONSE_TIMEOUT;
+    loop {
+        match receiver.recv_timeout(deadline.saturating_duration_since(Instant::now())) {
+            Ok((response_correlation, line)) => {
+                if response_correlation != correlation {
+                    continue; // late reply to an earlier command
+                }
+                if line == "END" {
+                    return true;
+                }
+                if line == "END ERROR" {
+                    println!("Command failed, see the device log");
+                    return false;
+                }
+                println!("{}", line);
+                deadline = Instant::now() + RESPONSE_TIMEOUT; // batches reply line by line
+            }
+            Err(_) => {
+                println!("No response within {}s", RESPONSE_TIMEOUT.as_secs());
+                return false;
+            }
+        }
+    }
 }
\ No newline at end of file
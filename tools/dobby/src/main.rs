@@ -6,7 +6,7 @@ use std::sync::Arc;
 use rustls::ClientConfig;
 
 // use chrono::{TimeZone, Utc, NaiveDateTime};
-use dobby::{NoCertificateVerification, scan_for_devices_for_seconds, show_log_from_device, start_interactive};
+use dobby::{NoCertificateVerification, scan_for_devices_for_seconds, show_log_from_device, show_stats_for_device, start_interactive, ping_devices, run_script};
 
 #[derive(Parser, Debug)]
 #[command(version, about, long_about = None)]
@@ -35,6 +35,27 @@ struct Args {
 
     #[arg(short='l', long, default_value_t = String::from(""), help = "Show log output for selected device")]
     log: String,
+
+    #[arg(long, default_value_t = String::from(""), help = "Report message loss, reordering and latency for selected device")]
+    stats: String,
+
+    #[arg(short='d', long, default_value_t = 60, help = "Seconds to collect statistics")]
+    duration: u64,
+
+    #[arg(long, value_delimiter = ',', help = "Measure round trip time to comma separated devices")]
+    ping: Vec<String>,
+
+    #[arg(short='n', long, default_value_t = 20, help = "Number of pings per device")]
+    count: u32,
+
+    #[arg(long, default_value_t = 200, help = "Milliseconds between ping rounds")]
+    interval: u64,
+
+    #[arg(long, default_value_t = String::from(""), help = "Run the commands in --file on selected device, stop at the first failure")]
+    run: String,
+
+    #[arg(short='f', long, default_value_t = String::from(""), help = "Command file, one command per line")]
+    file: String,
     
 }
 
@@ -75,6 +96,21 @@ fn main() {
         println!("--- Log for device {} ---", args.log);
         show_log_from_device(mqtt_client, mqtt_connection, args.topic, args.log);
     }
+    else if !args.ping.is_empty() {
+        println!("Pinging {} device(s) {} times", args.ping.len(), args.count);
+        ping_devices(mqtt_client, mqtt_connection, args.topic, args.ping, args.count, args.interval);
+    }
+    else if args.stats != "" {
+        println!("Collecting statistics for device {} for {}s", args.stats, args.duration);
+        show_stats_for_device(mqtt_client, mqtt_connection, args.topic, args.stats, args.duration);
+    }
+    else if args.run != "" {
+        let script = fs::read_to_string(&args.file).expect("Failed to read command file");
+        println!("Running {} on device {}", args.file, args.run);
+        if !run_script(mqtt_client, mqtt_connection, args.topic, args.run, script) {
+            std::process::exit(1);
+        }
+    }
     else {
         println!("Nothing to do...")
     }
@@ -0,0 +1,258 @@
+"""Packages firmware images for pull updates (see src/http_updater.h).
+
+Writes a .dbu file: an 80 byte header followed by the payload, which is the
+firmware image or a delta against a base image, LZSS compressed.
+
+Header (little endian):
+    magic "DBU1", flags (1 = compressed, 2 = delta), window_sz2, lookahead_sz2,
+    reserved, image size, payload size, SHA-256 of the image,
+    SHA-256 of the base image (zero unless delta). The base digest is the one
+    esptool appends to the image, which is what esp_partition_get_sha256()
+    returns for the running app partition.
+
+Delta payload: a sequence of
+    0x01 <u32 base offset> <u32 length>   copy from the running firmware
+    0x02 <u32 length> <bytes>             insert new bytes
+
+As a PlatformIO extra script it packages $BUILD_DIR/<env>.dbu after every
+build, and <env>-delta.dbu when custom_ota_base points to the image that
+runs on the device. It can also be run by hand:
+
+    python tools/package_firmware.py firmware.bin out.dbu [--base old.bin]
+"""
+
+import argparse
+import hashlib
+import os
+import struct
+
+MAGIC = b"DBU1"
+FLAG_COMPRESSED = 1
+FLAG_DELTA = 2
+WINDOW_SZ2 = 11
+LOOKAHEAD_SZ2 = 4
+MIN_MATCH = 3
+MAX_CANDIDATES = 32
+DELTA_BLOCK = 32
+OP_COPY = 1
+OP_INSERT = 2
+HEADER_FORMAT = "<4sBBBBII32s32s"
+HEADER_SIZE = struct.calcsize(HEADER_FORMAT)
+
+
+class BitWriter:
+    def __init__(self):
+        self.output = bytearray()
+        self.current = 0
+        self.count = 0
+
+    def write(self, value, bits):
+        for i in range(bits - 1, -1, -1):
+            self.current = (self.current << 1) | ((value >> i) & 1)
+            self.count += 1
+            if self.count == 8:
+                self.output.append(self.current)
+                self.current = 0
+                self.count = 0
+
+    def finish(self):
+        if self.count:
+            self.output.append(self.current << (8 - self.count))
+        return bytes(self.output)
+
+
+def lzss_compress(data, window_sz2=WINDOW_SZ2, lookahead_sz2=LOOKAHEAD_SZ2):
+    """Greedy LZSS in the heatshrink bit format, decoded by LzssDecoder"""
+    window = 1 << window_sz2
+    max_length = 1 << lookahead_sz2
+    writer = BitWriter()
+    table = {}
+    position = 0
+    size = len(data)
+    while position < size:
+        best_length = 0
+        best_distance = 0
+        limit = min(max_length, size - position)
+        if limit >= MIN_MATCH:
+            for candidate in reversed(table.get(data[position:position + MIN_MATCH], ())):
+                distance = position - candidate
+                if distance > window:
+                    break
+                length = MIN_MATCH
+                while length < limit and data[candidate + length] == data[position + length]:
+                    length += 1
+                if length > best_length:
+                    best_length = length
+                    best_distance = distance
+                    if length == limit:
+                        break
+        if best_length >= MIN_MATCH:
+            writer.write(0, 1)
+            writer.write(best_distance - 1, window_sz2)
+            writer.write(best_length - 1, lookahead_sz2)
+            step = best_length
+        else:
+            writer.write(1, 1)
+            writer.write(data[position], 8)
+            step = 1
+        for index in range(position, min(position + step, size - MIN_MATCH + 1)):
+            candidates = table.setdefault(data[index:index + MIN_MATCH], [])
+            candidates.append(index)
+            if len(candidates) > MAX_CANDIDATES:
+                del candidates[0]
+        position += step
+    return writer.finish()
+
+
+def lzss_decompress(data, window_sz2=WINDOW_SZ2, lookahead_sz2=LOOKAHEAD_SZ2):
+    """Reference decoder used to check every package before it is written"""
+    output = bytearray()
+    bits = ((byte >> i) & 1 for byte in data for i in range(7, -1, -1))
+
+    def read(count):
+        value = 0
+        for _ in range(count):
+            value = (value << 1) | next(bits)
+        return value
+
+    try:
+        while True:
+            if read(1):
+                output.append(read(8))
+            else:
+                distance = read(window_sz2) + 1
+                length = read(lookahead_sz2) + 1
+                for _ in range(length):
+                    output.append(output[-distance] if distance <= len(output) else 0)
+    except StopIteration:
+        return bytes(output)
+
+
+def make_delta(base, image):
+    """Copy/insert operations that rebuild image from base"""
+    index = {}
+    for offset in range(0, len(base) - DELTA_BLOCK + 1, 4):
+        index.setdefault(base[offset:offset + DELTA_BLOCK], offset)
+
+    operations = bytearray()
+    pending = bytearray()
+
+    def flush_insert():
+        if pending:
+            operations.extend(struct.pack("<BI", OP_INSERT, len(pending)))
+            operations.extend(pending)
+            pending.clear()
+
+    position = 0
+    while position < len(image):
+        offset = index.get(image[position:position + DELTA_BLOCK])
+        if offset is None:
+            pending.append(image[position])
+            position += 1
+            continue
+        length = DELTA_BLOCK
+        while (position + length < len(image) and offset + length < len(base)
+               and image[position + length] == base[offset + length]):
+            length += 1
+        flush_insert()
+        operations.extend(struct.pack("<BII", OP_COPY, offset, length))
+        position += length
+    flush_insert()
+    return bytes(operations)
+
+
+def apply_delta(base, operations):
+    image = bytearray()
+    position = 0
+    while position < len(operations):
+        op = operations[position]
+        if op == OP_COPY:
+            offset, length = struct.unpack_from("<II", operations, position + 1)
+            image.extend(base[offset:offset + length])
+            position += 9
+        elif op == OP_INSERT:
+            (length,) = struct.unpack_from("<I", operations, position + 1)
+            image.extend(operations[position + 5:position + 5 + length])
+            position += 5 + length
+        else:
+            raise ValueError("bad delta operation %d" % op)
+    return bytes(image)
+
+
+def app_image_digest(image):
+    """Digest esp_partition_get_sha256() returns for an app partition holding
+    image: the SHA-256 appended by esptool, over the image minus those 32 bytes."""
+    if len(image) < 32 or hashlib.sha256(image[:-32]).digest() != image[-32:]:
+        raise ValueError("image has no appended SHA-256")
+    return image[-32:]
+
+
+def read_package(data, base=None):
+    """Decodes a package like the device does and returns the image."""
+    (magic, flags, window_sz2, lookahead_sz2, _reserved, image_size, payload_size,
+     image_sha, base_sha) = struct.unpack_from(HEADER_FORMAT, data)
+    if magic != MAGIC:
+        raise ValueError("not a package")
+    payload = data[HEADER_SIZE:HEADER_SIZE + payload_size]
+    if flags & FLAG_COMPRESSED:
+        payload = lzss_decompress(payload, window_sz2, lookahead_sz2)
+    if flags & FLAG_DELTA:
+        if base is None or app_image_digest(base) != base_sha:
+            raise ValueError("base mismatch")
+        payload = apply_delta(base, payload)
+    image = payload[:image_size]
+    if hashlib.sha256(image).digest() != image_sha:
+        raise ValueError("image SHA-256 mismatch")
+    return image
+
+
+def package(image_path, output_path, base_path=None):
+    with open(image_path, "rb") as f:
+        image = f.read()
+    flags = FLAG_COMPRESSED
+    base_sha = bytes(32)
+    payload = image
+    if base_path:
+        with open(base_path, "rb") as f:
+            base = f.read()
+        payload = make_delta(base, image)
+        assert apply_delta(base, payload) == image
+        flags |= FLAG_DELTA
+        base_sha = app_image_digest(base)
+    raw_payload = payload
+    payload = lzss_compress(raw_payload)
+    assert lzss_decompress(payload)[:len(raw_payload)] == raw_payload
+
+    header = struct.pack(HEADER_FORMAT, MAGIC, flags, WINDOW_SZ2, LOOKAHEAD_SZ2, 0,
+                         len(image), len(payload), hashlib.sha256(image).digest(), base_sha)
+    with open(output_path, "wb") as f:
+        f.write(header)
+        f.write(payload)
+    print("Packaged %s: %d -> %d bytes%s" % (os.path.basename(output_path), len(image),
+                                             len(header) + len(payload), " (delta)" if base_path else ""))
+
+
+def _package_after_build(source, target, env):
+    build_dir = env.subst("$BUILD_DIR")
+    name = env.subst("$PIOENV")
+    firmware = str(target[0])
+    package(firmware, os.path.join(build_dir, name + ".dbu"))
+    base = env.GetProjectOption("custom_ota_base", "")
+    if base:
+        if os.path.isfile(base):
+            package(firmware, os.path.join(build_dir, name + "-delta.dbu"), base)
+        else:
+            print("custom_ota_base %s not found, no delta package" % base)
+
+
+try:
+    Import("env")  # noqa: F821, defined when run by PlatformIO (SCons)
+    env.AddPostAction("$BUILD_DIR/${PROGNAME}.bin", _package_after_build)  # noqa: F821
+except NameError:
+    if __name__ == "__main__":
+        parser = argparse.ArgumentParser(description="Package firmware for pull updates")
+        parser.add_argument("image")
+        parser.add_argument("output")
+        parser.add_argument("--base", help="image running on the device, makes a delta package")
+        args = parser.parse_args()
+        package(args.image, args.output, args.base)
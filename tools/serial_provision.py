@@ -0,0 +1,103 @@
+"""Sends a command file to a device over serial as binary frames
+(see src/serial_reader.h).
+
+Frame (little endian):
+    0x02, u16 payload length, payload, u16 CRC-16/CCITT-FALSE of the payload
+
+The device answers every frame with ACK (0x06) or NAK (0x15) followed by a
+status byte: 0 ok, 1 command failed, 2 CRC error, 3 too long, 4 timeout.
+Commands are packed into frames of up to MAX_PAYLOAD bytes, separated by
+line breaks. Each frame runs as a script, so the device stops at the first
+failing command, and so does this tool. Text printed by the device while a
+frame runs is passed through.
+
+    python tools/serial_provision.py /dev/ttyACM0 commands.txt
+"""
+
+import argparse
+import struct
+import sys
+import time
+
+import serial
+
+FRAME_START = 0x02
+ACK = 0x06
+NAK = 0x15
+MAX_PAYLOAD = 512
+REPLY_TIMEOUT_S = 10
+STATUS = ["ok", "command failed", "CRC error", "frame too long", "timeout"]
+
+
+def crc16_ccitt(data):
+    crc = 0xFFFF
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else (crc << 1)
+            crc &= 0xFFFF
+    return crc
+
+
+def frame(payload):
+    return bytes([FRAME_START]) + struct.pack("<H", len(payload)) + payload + struct.pack("<H", crc16_ccitt(payload))
+
+
+def read_commands(path):
+    # one command per line, '#' starts a comment line
+    with open(path) as f:
+        lines = (line.strip() for line in f)
+        return [line for line in lines if line and not line.startswith("#")]
+
+
+def pack(commands):
+    # "!" makes the device run the frame as a script
+    payloads = []
+    current = "!"
+    for command in commands:
+        if len(current) + len(command) + 1 > MAX_PAYLOAD:
+            payloads.append(current)
+            current = "!"
+        current += command + "\n"
+    if current != "!":
+        payloads.append(current)
+    return [payload.encode() for payload in payloads]
+
+
+def wait_for_reply(port):
+    deadline = time.monotonic() + REPLY_TIMEOUT_S
+    while time.monotonic() < deadline:
+        byte = port.read(1)
+        if not byte:
+            continue
+        if byte[0] in (ACK, NAK):
+            status = port.read(1)
+            return status[0] if status else len(STATUS) - 1
+        sys.stdout.write(byte.decode(errors="replace"))
+    return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Send commands to a device over serial")
+    parser.add_argument("port")
+    parser.add_argument("commands")
+    parser.add_argument("--baud", type=int, default=115200)
+    args = parser.parse_args()
+
+    commands = read_commands(args.commands)
+    with serial.Serial(args.port, args.baud, timeout=0.1) as port:
+        for payload in pack(commands):
+            port.write(frame(payload))
+            status = wait_for_reply(port)
+            if status is None:
+                print("No reply from device")
+                return 1
+            if status != 0:
+                print("Frame rejected: %s" % (STATUS[status] if status < len(STATUS) else status))
+                return 1
+    print("Sent %d commands" % len(commands))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
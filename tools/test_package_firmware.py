@@ -0,0 +1,70 @@
+"""Round trip tests for package_firmware.py.
+
+    python -m unittest discover -s tools -p "test_*.py"
+"""
+
+import hashlib
+import os
+import random
+import struct
+import tempfile
+import unittest
+
+import package_firmware as pf
+
+
+def make_app_image(body):
+    # esptool appends the SHA-256 of everything before it
+    return body + hashlib.sha256(body).digest()
+
+
+class PackageRoundTrip(unittest.TestCase):
+    def setUp(self):
+        rng = random.Random(1)
+        self.base = make_app_image(bytes(rng.getrandbits(8) for _ in range(20000)))
+        body = bytearray(self.base[:-32])
+        body[5000:5100] = bytes(rng.getrandbits(8) for _ in range(100))
+        body.extend(b"new code" * 50)
+        self.image = make_app_image(bytes(body))
+        self.directory = tempfile.TemporaryDirectory()
+
+    def tearDown(self):
+        self.directory.cleanup()
+
+    def _package(self, base=None):
+        paths = {}
+        for name, data in (("image.bin", self.image), ("base.bin", base)):
+            if data is not None:
+                paths[name] = os.path.join(self.directory.name, name)
+                with open(paths[name], "wb") as f:
+                    f.write(data)
+        output = os.path.join(self.directory.name, "out.dbu")
+        pf.package(paths["image.bin"], output, paths.get("base.bin"))
+        with open(output, "rb") as f:
+            return f.read()
+
+    def test_full_package(self):
+        data = self._package()
+        self.assertEqual(pf.read_package(data), self.image)
+
+    def test_delta_header_matches_running_partition_digest(self):
+        data = self._package(self.base)
+        header = struct.unpack_from(pf.HEADER_FORMAT, data)
+        # esp_partition_get_sha256() on the running app returns the appended digest
+        running_digest = hashlib.sha256(self.base[:-32]).digest()
+        self.assertEqual(header[8], running_digest)
+        self.assertNotEqual(header[8], hashlib.sha256(self.base).digest())
+        self.assertEqual(pf.read_package(data, self.base), self.image)
+
+    def test_delta_rejects_other_base(self):
+        data = self._package(self.base)
+        with self.assertRaises(ValueError):
+            pf.read_package(data, self.image)
+
+    def test_base_without_appended_digest(self):
+        with self.assertRaises(ValueError):
+            self._package(self.base[:-32])
+
+
+if __name__ == "__main__":
+    unittest.main()